@@ -0,0 +1,44 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <time.h>
+#include "common.h"
+
+double bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned long bench_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+unsigned int bench_parse_list(const char *text, unsigned int minimum, unsigned int **values) {
+  unsigned int count = 1, i;
+  const char *at;
+  char *end;
+
+  for (at = text; *at; ++at) {
+    count += *at == ',';
+  }
+
+  *values = (unsigned int *)malloc(sizeof(unsigned int) * count);
+  if (!*values) {
+    return 0;
+  }
+
+  for (i = 0, at = text; i < count; ++i, at = end + 1) {
+    (*values)[i] = (unsigned int)strtoul(at, &end, 10);
+    if (end == at || (*end != ',' && *end != '\0') || (*values)[i] < minimum) {
+      free(*values);
+      return 0;
+    }
+  }
+
+  return count;
+}
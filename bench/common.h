@@ -0,0 +1,26 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+/*
+ * Small helpers shared by the benchmark tools.
+ */
+
+/*
+ * Returns the time in seconds on a monotonic clock, for timing runs.
+ */
+double bench_now(void);
+
+/*
+ * Returns the time in nanoseconds on the same clock, for timing single
+ * operations.
+ */
+unsigned long bench_now_ns(void);
+
+/*
+ * Parses a comma separated list of numbers into a malloc'ed array.
+ * Returns the number of values, or 0 if the list is malformed or a value
+ * is below minimum.
+ */
+unsigned int bench_parse_list(const char *text, unsigned int minimum, unsigned int **values);
+
+#endif /* COMMON_H */
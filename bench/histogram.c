@@ -0,0 +1,92 @@
+#include <string.h>
+#include "histogram.h"
+
+/*
+ * Values below the sub-bucket count are counted exactly. Above that, the
+ * position of the highest set bit picks the bucket and the bits below it
+ * pick the sub-bucket.
+ */
+static unsigned int bucket_of(unsigned long value) {
+  unsigned int magnitude = 0;
+  unsigned long rest = value;
+
+  if (value < HISTOGRAM_SUB_COUNT) {
+    return (unsigned int)value;
+  }
+
+  while (rest >>= 1) {
+    magnitude++;
+  }
+
+  return (magnitude - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT +
+         (unsigned int)((value >> (magnitude - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_COUNT);
+}
+
+/*
+ * The largest value that lands in a bucket.
+ */
+static unsigned long highest_in(unsigned int bucket) {
+  unsigned int magnitude, sub;
+
+  if (bucket < HISTOGRAM_SUB_COUNT) {
+    return bucket;
+  }
+
+  magnitude = bucket / HISTOGRAM_SUB_COUNT - 1 + HISTOGRAM_SUB_BITS;
+  sub = bucket % HISTOGRAM_SUB_COUNT;
+
+  return (((unsigned long)(HISTOGRAM_SUB_COUNT + sub + 1)) << (magnitude - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void histogram_reset(Histogram *histogram) {
+  memset(histogram, 0, sizeof(Histogram));
+}
+
+void histogram_record(Histogram *histogram, unsigned long value) {
+  histogram->counts[bucket_of(value)]++;
+  histogram->total++;
+
+  if (value > histogram->max) {
+    histogram->max = value;
+  }
+}
+
+void histogram_merge(Histogram *target, const Histogram *source) {
+  unsigned int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    target->counts[i] += source->counts[i];
+  }
+
+  target->total += source->total;
+  if (source->max > target->max) {
+    target->max = source->max;
+  }
+}
+
+unsigned long histogram_percentile(const Histogram *histogram, double percentile) {
+  unsigned long wanted, seen = 0;
+  unsigned int i;
+
+  if (!histogram->total) {
+    return 0;
+  }
+
+  if (percentile >= 100.0) {
+    return histogram->max;
+  }
+
+  wanted = (unsigned long)(percentile / 100.0 * histogram->total + 0.5);
+  if (wanted == 0) {
+    wanted = 1;
+  }
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += histogram->counts[i];
+    if (seen >= wanted) {
+      return highest_in(i) < histogram->max ? highest_in(i) : histogram->max;
+    }
+  }
+
+  return histogram->max;
+}
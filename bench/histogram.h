@@ -0,0 +1,43 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/*
+ * A log-linear latency histogram in the style of HdrHistogram. Values are
+ * counted in buckets covering each power of two, split into a fixed number
+ * of sub-buckets, so every recorded value is kept to within 1% no matter
+ * how large it is while the histogram stays a fixed size.
+ */
+
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_COUNT (1u << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct Histogram {
+  unsigned long counts[HISTOGRAM_BUCKETS];
+  unsigned long total;
+  unsigned long max;
+} Histogram;
+
+/*
+ * Empties a histogram.
+ */
+void histogram_reset(Histogram *histogram);
+
+/*
+ * Counts one occurrence of value.
+ */
+void histogram_record(Histogram *histogram, unsigned long value);
+
+/*
+ * Adds every count of source into target.
+ */
+void histogram_merge(Histogram *target, const Histogram *source);
+
+/*
+ * Returns the value below which the given percentage of recorded values
+ * fall, or 0 if the histogram is empty. A percentile of 100 returns the
+ * exact maximum.
+ */
+unsigned long histogram_percentile(const Histogram *histogram, double percentile);
+
+#endif /* HISTOGRAM_H */
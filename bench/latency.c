@@ -0,0 +1,249 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "map.h"
+#include "histogram.h"
+#include "common.h"
+
+/*
+ * Drives a map at a fixed request rate and reports the latency of every
+ * operation type at every map size asked for.
+ *
+ * Each thread issues requests on a fixed schedule and measures latency
+ * from when a request was due rather than from when it was finally sent.
+ * Otherwise a stall (a table growing, a long memmove) would only count
+ * against the one request caught in it, while the requests that should
+ * have been sent during the stall would never be measured at all; this is
+ * known as coordinated omission. The uncorrected service time is reported
+ * alongside for comparison.
+ *
+ * The map starts out holding `size` keys out of a key space twice that
+ * size. Gets and deletes pick any key of the key space, and sets insert
+ * or update one, so with as many sets as deletes the map hovers around
+ * its starting size, growing its table now and again.
+ */
+
+enum { OP_GET, OP_SET, OP_DELETE, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = { "get", "set", "delete" };
+
+typedef struct Options {
+  unsigned int  threads;
+  double        rate;
+  double        seconds;
+  unsigned int  mix[OP_COUNT];
+  unsigned int *sizes;
+  unsigned int  size_count;
+} Options;
+
+typedef struct Worker {
+  pthread_t     thread;
+  unsigned int  index;
+  unsigned int  seed;
+  unsigned long started;
+  Histogram     corrected[OP_COUNT];
+  Histogram     service[OP_COUNT];
+} Worker;
+
+static Options options = { 4, 100000.0, 5.0, { 80, 10, 10 }, NULL, 0 };
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int *keys;
+static unsigned int key_space;
+static Map *map;
+
+/*
+ * Waits until the given time, sleeping while it is far off and spinning
+ * for the last stretch so requests go out on time.
+ */
+static void wait_until(unsigned long due) {
+  struct timespec pause = { 0, 0 };
+  unsigned long current = bench_now_ns();
+
+  while (current < due) {
+    if (due - current > 2000000) {
+      pause.tv_nsec = (long)(due - current - 1000000);
+      nanosleep(&pause, NULL);
+    }
+    current = bench_now_ns();
+  }
+}
+
+static unsigned int pick_op(Worker *worker) {
+  unsigned int roll = (unsigned int)rand_r(&worker->seed) % 100;
+
+  if (roll < options.mix[OP_GET]) {
+    return OP_GET;
+  }
+
+  return roll < options.mix[OP_GET] + options.mix[OP_SET] ? OP_SET : OP_DELETE;
+}
+
+static void *run_worker(void *argument) {
+  Worker *worker = (Worker *)argument;
+  unsigned long interval, due, sent, done, deadline;
+  unsigned int op, *key;
+
+  /* Threads split the rate and interleave their schedules evenly */
+  interval = (unsigned long)(options.threads * 1e9 / options.rate);
+  due = worker->started + worker->index * interval / options.threads;
+  deadline = worker->started + (unsigned long)(options.seconds * 1e9);
+
+  for (; due < deadline; due += interval) {
+    op = pick_op(worker);
+    key = &keys[(unsigned int)rand_r(&worker->seed) % key_space];
+
+    wait_until(due);
+    sent = bench_now_ns();
+
+    pthread_mutex_lock(&lock);
+    switch (op) {
+      case OP_GET:    map_get(map, key); break;
+      case OP_SET:    map_set(map, key, key); break;
+      case OP_DELETE: map_delete(map, key); break;
+    }
+    pthread_mutex_unlock(&lock);
+
+    done = bench_now_ns();
+    histogram_record(&worker->corrected[op], done - due);
+    histogram_record(&worker->service[op], done - sent);
+  }
+
+  return NULL;
+}
+
+static void report(unsigned int size, Worker *workers) {
+  static Histogram corrected, service;
+  unsigned int op, i;
+
+  for (op = 0; op < OP_COUNT; ++op) {
+    histogram_reset(&corrected);
+    histogram_reset(&service);
+    for (i = 0; i < options.threads; ++i) {
+      histogram_merge(&corrected, &workers[i].corrected[op]);
+      histogram_merge(&service, &workers[i].service[op]);
+    }
+
+    if (!corrected.total) {
+      continue;
+    }
+
+    printf("%10u %-7s %10lu %10lu %10lu %10lu %12lu %12lu\n", size, op_names[op], corrected.total,
+           histogram_percentile(&corrected, 50.0), histogram_percentile(&corrected, 99.0),
+           histogram_percentile(&corrected, 99.9), histogram_percentile(&corrected, 100.0),
+           histogram_percentile(&service, 99.9));
+  }
+}
+
+/*
+ * Runs the benchmark against a map starting out with size keys.
+ * Returns 0 on success, -1 on failure.
+ */
+static int run_size(unsigned int size) {
+  Worker *workers;
+  unsigned long started;
+  unsigned int i;
+
+  key_space = size * 2;
+  keys = (unsigned int *)malloc(sizeof(unsigned int) * key_space);
+  workers = (Worker *)calloc(options.threads, sizeof(Worker));
+  map = map_create(0, map_compare_uint_keys);
+  if (!keys || !workers || !map) {
+    free(keys);
+    free(workers);
+    map_free(map);
+    return -1;
+  }
+
+  for (i = 0; i < key_space; ++i) {
+    keys[i] = i;
+  }
+  for (i = 0; i < size; ++i) {
+    map_set(map, &keys[i], &keys[i]);
+  }
+
+  /* Give the threads a moment to start before the first request is due */
+  started = bench_now_ns() + 10000000UL;
+  for (i = 0; i < options.threads; ++i) {
+    workers[i].index = i;
+    workers[i].seed = i + 1;
+    workers[i].started = started;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  for (i = 0; i < options.threads; ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  report(size, workers);
+
+  map_free(map);
+  free(workers);
+  free(keys);
+
+  return 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [-t threads] [-r requests/s] [-s seconds] [-m get,set,delete%%] [-n size,...]\n",
+    name);
+}
+
+int main(int argc, char **argv) {
+  unsigned int *mix, i;
+  int option;
+
+  while ((option = getopt(argc, argv, "t:r:s:m:n:")) != -1) {
+    switch (option) {
+      case 't': options.threads = (unsigned int)atoi(optarg); break;
+      case 'r': options.rate = atof(optarg); break;
+      case 's': options.seconds = atof(optarg); break;
+      case 'm':
+        if (bench_parse_list(optarg, 0, &mix) != OP_COUNT || mix[0] + mix[1] + mix[2] != 100) {
+          usage(argv[0]);
+          return 1;
+        }
+        memcpy(options.mix, mix, sizeof(options.mix));
+        free(mix);
+        break;
+      case 'n':
+        options.size_count = bench_parse_list(optarg, 0, &options.sizes);
+        if (!options.size_count) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (optind != argc || !options.threads || options.rate <= 0 || options.seconds <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (!options.sizes) {
+    options.size_count = bench_parse_list("1000,10000", 0, &options.sizes);
+  }
+
+  printf("threads=%u rate=%.0f/s seconds=%.1f mix=%u/%u/%u (latencies in ns)\n",
+         options.threads, options.rate, options.seconds,
+         options.mix[OP_GET], options.mix[OP_SET], options.mix[OP_DELETE]);
+  printf("%10s %-7s %10s %10s %10s %10s %12s %12s\n",
+         "size", "op", "count", "p50", "p99", "p99.9", "max", "svc p99.9");
+
+  for (i = 0; i < options.size_count; ++i) {
+    if (options.sizes[i] == 0 || run_size(options.sizes[i]) != 0) {
+      fprintf(stderr, "could not run with %u keys\n", options.sizes[i]);
+      return 1;
+    }
+  }
+
+  free(options.sizes);
+  return 0;
+}
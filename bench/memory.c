@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "map.h"
+#include "map_tiered.h"
+#include "common.h"
+
+/*
+ * Measures what maps cost in memory per entry. The benchmark replaces the
+ * malloc family (as glibc allows) with wrappers that count the usable size
+ * of every live allocation, so everything is measured at the allocator
+ * level: entry tables and their slack, separately allocated keys and
+ * values, and whatever each engine keeps on top of that.
+ *
+ * For every engine, key type and size it builds a map, then deletes half
+ * of the entries, and prints one CSV row with the bytes per entry, the
+ * peak while building, what remains after the deletes and how long the
+ * build took per entry.
+ */
+
+#ifndef __GLIBC__
+#error "memory counting relies on replacing glibc's malloc"
+#endif
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void  __libc_free(void *pointer);
+
+static unsigned long live_bytes;
+static unsigned long peak_bytes;
+
+static void *counted(void *pointer) {
+  if (pointer) {
+    live_bytes += malloc_usable_size(pointer);
+    if (live_bytes > peak_bytes) {
+      peak_bytes = live_bytes;
+    }
+  }
+  return pointer;
+}
+
+void *malloc(size_t size) {
+  return counted(__libc_malloc(size));
+}
+
+void *calloc(size_t count, size_t size) {
+  return counted(__libc_calloc(count, size));
+}
+
+void *realloc(void *pointer, size_t size) {
+  size_t old = pointer ? malloc_usable_size(pointer) : 0;
+  void *grown = __libc_realloc(pointer, size);
+
+  /* A failed realloc leaves the old block alone */
+  if (grown || size == 0) {
+    live_bytes -= old;
+  }
+  return counted(grown);
+}
+
+void free(void *pointer) {
+  if (pointer) {
+    live_bytes -= malloc_usable_size(pointer);
+  }
+  __libc_free(pointer);
+}
+
+/* --- Keys and values --- */
+
+typedef enum KeyType { KEY_INT, KEY_STRING } KeyType;
+
+static const char *key_names[] = { "int", "string" };
+
+static unsigned int value_size = 128;
+static const char *directory = "/tmp";
+
+static void *make_key(KeyType type, unsigned int index) {
+  char text[32];
+  unsigned int *number;
+
+  if (type == KEY_INT) {
+    number = (unsigned int *)malloc(sizeof(unsigned int));
+    if (number) {
+      *number = index;
+    }
+    return number;
+  }
+
+  sprintf(text, "key:%u", index);
+  return strdup(text);
+}
+
+/*
+ * Values look like small JSON documents, which is what maps tend to hold.
+ */
+static char *make_value(unsigned int index) {
+  char *value = (char *)malloc(value_size + 1);
+  unsigned int length;
+
+  if (!value) {
+    return NULL;
+  }
+
+  length = (unsigned int)snprintf(value, value_size + 1, "{\"id\":%u,\"status\":\"active\",\"tags\":[", index);
+  while (length < value_size) {
+    value[length] = "\"tag\","[length % 6];
+    length++;
+  }
+  value[value_size] = '\0';
+
+  return value;
+}
+
+static const void *serialize_uint(const void *item, unsigned int *length, void *context) {
+  (void)context;
+  *length = sizeof(unsigned int);
+  return item;
+}
+
+static void *deserialize_uint(const void *bytes, unsigned int length, void *context) {
+  unsigned int *number = (unsigned int *)malloc(sizeof(unsigned int));
+
+  (void)context;
+  if (number && length == sizeof(unsigned int)) {
+    memcpy(number, bytes, sizeof(unsigned int));
+  }
+  return number;
+}
+
+/* --- Engines --- */
+
+/*
+ * What it takes to build and shrink a map with an engine. Keys and values
+ * are handed over on set; delete is given back the very key and value
+ * that were set and leaves nothing of them allocated.
+ */
+typedef struct Engine {
+  const char *name;
+  int         owns_entries;
+  void *(*create)(KeyType type);
+  int   (*set)(void *engine, void *key, void *value);
+  void  (*delete)(void *engine, void *key, void *value);
+  void  (*settle)(void *engine);
+  void  (*destroy)(void *engine);
+} Engine;
+
+static MapKeyCompareFunc compare_for(KeyType type) {
+  return type == KEY_INT ? map_compare_uint_keys : map_compare_string_keys;
+}
+
+static void *map_engine_create(KeyType type) {
+  return map_create(0, compare_for(type));
+}
+
+static int map_engine_set(void *engine, void *key, void *value) {
+  return map_set((Map *)engine, key, value);
+}
+
+static void map_engine_delete(void *engine, void *key, void *value) {
+  map_delete((Map *)engine, key);
+  free(key);
+  free(value);
+}
+
+static void map_engine_destroy(void *engine) {
+  map_free((Map *)engine);
+}
+
+static void *tiered_engine_create(KeyType type) {
+  static const MapCodec codecs[] = {
+    { serialize_uint, map_serialize_string, deserialize_uint, map_deserialize_string, NULL },
+    { map_serialize_string, map_serialize_string, map_deserialize_string, map_deserialize_string, NULL }
+  };
+
+  /* A budget this large keeps everything in memory */
+  return map_tiered_create(compare_for(type), &codecs[type], free, free, (unsigned long)-1, directory);
+}
+
+static int tiered_engine_set(void *engine, void *key, void *value) {
+  return map_tiered_set((MapTiered *)engine, key, value);
+}
+
+static void tiered_engine_delete(void *engine, void *key, void *value) {
+  (void)value;
+  map_tiered_delete((MapTiered *)engine, key);
+}
+
+/*
+ * Treats every entry as cold, as if nothing had been read in a while.
+ */
+static void tiered_engine_compress(void *engine) {
+  MapTiered *tiered = (MapTiered *)engine;
+
+  map_tiered_compress_cold(tiered, 2, (unsigned int)map_tiered_get_size(tiered));
+}
+
+static void tiered_engine_destroy(void *engine) {
+  map_tiered_free((MapTiered *)engine);
+}
+
+static const Engine engines[] = {
+  { "map", 0, map_engine_create, map_engine_set, map_engine_delete, NULL, map_engine_destroy },
+  { "tiered", 1, tiered_engine_create, tiered_engine_set, tiered_engine_delete, NULL, tiered_engine_destroy },
+  { "tiered-compressed", 1, tiered_engine_create, tiered_engine_set, tiered_engine_delete,
+    tiered_engine_compress, tiered_engine_destroy }
+};
+
+/* --- Measuring --- */
+
+/*
+ * Builds a map of size entries with an engine, measures it, deletes every
+ * other entry and measures it again. Returns 0 on success, -1 on failure.
+ */
+static int measure(const Engine *engine, KeyType type, unsigned int size) {
+  unsigned long baseline, built, peak, shrunk;
+  unsigned int remaining = size / 2 ? size / 2 : 1;
+  void **keys, **values;
+  void *instance;
+  double started, elapsed;
+  unsigned int i;
+
+  /* Keep our own bookkeeping out of the measurement */
+  keys = (void **)malloc(sizeof(void *) * size);
+  values = (void **)malloc(sizeof(void *) * size);
+  if (!keys || !values) {
+    free(keys);
+    free(values);
+    return -1;
+  }
+
+  baseline = live_bytes;
+  peak_bytes = live_bytes;
+
+  instance = engine->create(type);
+  if (!instance) {
+    free(keys);
+    free(values);
+    return -1;
+  }
+
+  started = bench_now();
+  for (i = 0; i < size; ++i) {
+    keys[i] = make_key(type, i);
+    values[i] = make_value(i);
+    if (!keys[i] || !values[i] || engine->set(instance, keys[i], values[i]) != 0) {
+      fprintf(stderr, "%s: could not add entry %u\n", engine->name, i);
+      return -1;
+    }
+  }
+  elapsed = bench_now() - started;
+
+  if (engine->settle) {
+    engine->settle(instance);
+  }
+
+  built = live_bytes - baseline;
+  peak = peak_bytes - baseline;
+
+  for (i = 0; i < size; i += 2) {
+    engine->delete(instance, keys[i], values[i]);
+  }
+  shrunk = live_bytes - baseline;
+
+  printf("%s,%s,%u,%u,%.1f,%lu,%lu,%.1f,%.1f\n",
+         engine->name, key_names[type], size, value_size, (double)built / size,
+         peak, shrunk, (double)shrunk / remaining, elapsed * 1e9 / size);
+  fflush(stdout);
+
+  if (!engine->owns_entries) {
+    for (i = 1; i < size; i += 2) {
+      free(keys[i]);
+      free(values[i]);
+    }
+  }
+  engine->destroy(instance);
+
+  free(keys);
+  free(values);
+
+  return 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-e engine] [-n size,...] [-v value_size] [-d spill_directory]\n", name);
+  fprintf(stderr, "  engines: map, tiered, tiered-compressed (default: all)\n");
+}
+
+int main(int argc, char **argv) {
+  const char *only = NULL;
+  unsigned int *sizes = NULL, size_count = 0, e, i;
+  int type, option;
+
+  while ((option = getopt(argc, argv, "e:n:v:d:")) != -1) {
+    switch (option) {
+      case 'e': only = optarg; break;
+      case 'n':
+        free(sizes);
+        size_count = bench_parse_list(optarg, 1, &sizes);
+        if (!size_count) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'v': value_size = (unsigned int)atoi(optarg); break;
+      case 'd': directory = optarg; break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (optind != argc || value_size < 32) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (!sizes) {
+    size_count = bench_parse_list("1000,10000", 1, &sizes);
+  }
+
+  printf("engine,key_type,entries,value_size,bytes_per_entry,peak_bytes,"
+         "bytes_after_delete,bytes_per_entry_after_delete,build_ns_per_entry\n");
+
+  for (e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+    if (only && strcmp(only, engines[e].name) != 0) {
+      continue;
+    }
+
+    for (type = KEY_INT; type <= KEY_STRING; ++type) {
+      for (i = 0; i < size_count; ++i) {
+        if (measure(&engines[e], (KeyType)type, sizes[i]) != 0) {
+          return 1;
+        }
+      }
+    }
+  }
+
+  free(sizes);
+  return 0;
+}
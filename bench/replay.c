@@ -0,0 +1,345 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "map.h"
+#include "map_shm.h"
+#include "common.h"
+
+/*
+ * Replays a trace recorded with a MapTracer against one of the map
+ * engines, on one or more threads, and reports the throughput along with
+ * latency percentiles. Traces only hold key hashes, so every distinct hash
+ * becomes an unsigned int key; the order and mix of operations on them is
+ * what the trace reproduces.
+ */
+
+/*
+ * What it takes to drive an engine. Keys are indexes into the table of
+ * distinct hashes, which also gives the map engine stable key pointers.
+ */
+typedef struct Engine {
+  const char *name;
+  void *(*create)(unsigned int keys, unsigned int threads);
+  void  (*destroy)(void *engine);
+  void  (*get)(void *engine, unsigned int *key);
+  void  (*set)(void *engine, unsigned int *key);
+  void  (*delete)(void *engine, unsigned int *key);
+} Engine;
+
+typedef struct Options {
+  const char   *path;
+  const Engine *engine;
+  unsigned int  threads;
+  unsigned int  loops;
+  int           preload;
+} Options;
+
+typedef struct Worker {
+  pthread_t      thread;
+  unsigned int   index;
+  unsigned long  operations;
+  unsigned int  *latencies;
+} Worker;
+
+static Options options = { NULL, NULL, 1, 1, 0 };
+static MapTraceRecord *records;
+static unsigned int *record_keys;
+static unsigned int *keys;
+static unsigned long record_count;
+static void *engine;
+
+/* --- The linear map, behind a mutex when shared between threads --- */
+
+typedef struct LockedMap {
+  Map             *map;
+  pthread_mutex_t  lock;
+  int              locked;
+} LockedMap;
+
+static void *map_engine_create(unsigned int key_count, unsigned int threads) {
+  LockedMap *locked = (LockedMap *)calloc(1, sizeof(LockedMap));
+
+  if (!locked) {
+    return NULL;
+  }
+
+  locked->map = map_create(key_count, map_compare_uint_keys);
+  locked->locked = threads > 1;
+  pthread_mutex_init(&locked->lock, NULL);
+
+  if (!locked->map) {
+    free(locked);
+    return NULL;
+  }
+
+  return locked;
+}
+
+static void map_engine_destroy(void *engine) {
+  LockedMap *locked = (LockedMap *)engine;
+
+  map_free(locked->map);
+  pthread_mutex_destroy(&locked->lock);
+  free(locked);
+}
+
+static void map_engine_get(void *engine, unsigned int *key) {
+  LockedMap *locked = (LockedMap *)engine;
+
+  if (locked->locked) pthread_mutex_lock(&locked->lock);
+  map_get(locked->map, key);
+  if (locked->locked) pthread_mutex_unlock(&locked->lock);
+}
+
+static void map_engine_set(void *engine, unsigned int *key) {
+  LockedMap *locked = (LockedMap *)engine;
+
+  if (locked->locked) pthread_mutex_lock(&locked->lock);
+  map_set(locked->map, key, key);
+  if (locked->locked) pthread_mutex_unlock(&locked->lock);
+}
+
+static void map_engine_delete(void *engine, unsigned int *key) {
+  LockedMap *locked = (LockedMap *)engine;
+
+  if (locked->locked) pthread_mutex_lock(&locked->lock);
+  map_delete(locked->map, key);
+  if (locked->locked) pthread_mutex_unlock(&locked->lock);
+}
+
+/* --- The shared memory map, which needs no extra locking --- */
+
+static void *shm_engine_create(unsigned int key_count, unsigned int threads) {
+  (void)threads;
+  return map_shm_create(NULL, key_count, sizeof(unsigned int), sizeof(unsigned int));
+}
+
+static void shm_engine_destroy(void *engine) {
+  map_shm_close((MapShm *)engine);
+}
+
+static void shm_engine_get(void *engine, unsigned int *key) {
+  unsigned int value;
+
+  map_shm_get((MapShm *)engine, key, sizeof(*key), &value, NULL);
+}
+
+static void shm_engine_set(void *engine, unsigned int *key) {
+  map_shm_set((MapShm *)engine, key, sizeof(*key), key, sizeof(*key));
+}
+
+static void shm_engine_delete(void *engine, unsigned int *key) {
+  map_shm_delete((MapShm *)engine, key, sizeof(*key));
+}
+
+static const Engine engines[] = {
+  { "map", map_engine_create, map_engine_destroy, map_engine_get, map_engine_set, map_engine_delete },
+  { "shm", shm_engine_create, shm_engine_destroy, shm_engine_get, shm_engine_set, shm_engine_delete }
+};
+
+/* --- Replaying --- */
+
+static int compare_uints(const void *a, const void *b) {
+  unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+  return x < y ? -1 : (x > y);
+}
+
+/*
+ * Gives every distinct hash in the trace a key and maps each record to
+ * the index of its key, so that no lookups are needed while replaying.
+ * Returns the number of keys, or 0 on failure.
+ */
+static unsigned int assign_keys(void) {
+  unsigned int count = 0;
+  unsigned long i;
+  unsigned int *found;
+
+  keys = (unsigned int *)malloc(sizeof(unsigned int) * record_count);
+  record_keys = (unsigned int *)malloc(sizeof(unsigned int) * record_count);
+  if (!keys || !record_keys) {
+    return 0;
+  }
+
+  for (i = 0; i < record_count; ++i) {
+    keys[i] = records[i].hash;
+  }
+  qsort(keys, record_count, sizeof(unsigned int), compare_uints);
+
+  for (i = 0; i < record_count; ++i) {
+    if (count == 0 || keys[count - 1] != keys[i]) {
+      keys[count++] = keys[i];
+    }
+  }
+
+  for (i = 0; i < record_count; ++i) {
+    found = (unsigned int *)bsearch(&records[i].hash, keys, count, sizeof(unsigned int), compare_uints);
+    record_keys[i] = (unsigned int)(found - keys);
+  }
+
+  return count;
+}
+
+/*
+ * Each worker replays every threads'th record of the trace, starting at
+ * its own index, and times every operation.
+ */
+static void *run_worker(void *argument) {
+  Worker *worker = (Worker *)argument;
+  const Engine *driver = options.engine;
+  unsigned long i, started, samples = 0;
+  unsigned int loop, *key;
+
+  for (loop = 0; loop < options.loops; ++loop) {
+    for (i = worker->index; i < record_count; i += options.threads) {
+      key = &keys[record_keys[i]];
+      started = bench_now_ns();
+
+      switch (records[i].op) {
+        case MAP_TRACE_GET:    driver->get(engine, key); break;
+        case MAP_TRACE_SET:    driver->set(engine, key); break;
+        case MAP_TRACE_DELETE: driver->delete(engine, key); break;
+      }
+
+      worker->latencies[samples++] = (unsigned int)(bench_now_ns() - started);
+    }
+  }
+
+  worker->operations = samples;
+  return NULL;
+}
+
+static void report_latencies(Worker *workers) {
+  static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+  unsigned long total = 0, i, at;
+  unsigned int *all, p;
+
+  for (i = 0; i < options.threads; ++i) {
+    total += workers[i].operations;
+  }
+
+  all = (unsigned int *)malloc(sizeof(unsigned int) * (total ? total : 1));
+  if (!all || !total) {
+    free(all);
+    return;
+  }
+
+  for (i = 0, at = 0; i < options.threads; ++i) {
+    memcpy(all + at, workers[i].latencies, sizeof(unsigned int) * workers[i].operations);
+    at += workers[i].operations;
+  }
+  qsort(all, total, sizeof(unsigned int), compare_uints);
+
+  printf("latency (ns):");
+  for (p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); ++p) {
+    printf(" p%g=%u", percentiles[p], all[(unsigned long)(percentiles[p] / 100.0 * (total - 1))]);
+  }
+  printf(" max=%u\n", all[total - 1]);
+
+  free(all);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-e map|shm] [-t threads] [-l loops] [-p] trace_file\n", name);
+  fprintf(stderr, "  -p  set every key in the trace before replaying it\n");
+}
+
+int main(int argc, char **argv) {
+  Worker *workers;
+  unsigned int key_count, i;
+  unsigned long per_thread, total = 0;
+  double started, elapsed;
+  long loaded;
+  int option;
+
+  options.engine = &engines[0];
+
+  while ((option = getopt(argc, argv, "e:t:l:p")) != -1) {
+    switch (option) {
+      case 'e':
+        options.engine = NULL;
+        for (i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+          if (strcmp(optarg, engines[i].name) == 0) {
+            options.engine = &engines[i];
+          }
+        }
+        if (!options.engine) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 't': options.threads = (unsigned int)atoi(optarg); break;
+      case 'l': options.loops = (unsigned int)atoi(optarg); break;
+      case 'p': options.preload = 1; break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (optind != argc - 1 || !options.threads || !options.loops) {
+    usage(argv[0]);
+    return 1;
+  }
+  options.path = argv[optind];
+
+  loaded = map_trace_load(options.path, &records);
+  if (loaded <= 0) {
+    fprintf(stderr, "could not read a trace from %s\n", options.path);
+    return 1;
+  }
+  record_count = (unsigned long)loaded;
+
+  key_count = assign_keys();
+  engine = key_count ? options.engine->create(key_count, options.threads) : NULL;
+  workers = (Worker *)calloc(options.threads, sizeof(Worker));
+  if (!engine || !workers) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  if (options.preload) {
+    for (i = 0; i < key_count; ++i) {
+      options.engine->set(engine, &keys[i]);
+    }
+  }
+
+  per_thread = (record_count / options.threads + 1) * options.loops;
+  for (i = 0; i < options.threads; ++i) {
+    workers[i].index = i;
+    workers[i].latencies = (unsigned int *)malloc(sizeof(unsigned int) * per_thread);
+    if (!workers[i].latencies) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+  }
+
+  started = bench_now();
+  for (i = 0; i < options.threads; ++i) {
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  for (i = 0; i < options.threads; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    total += workers[i].operations;
+  }
+  elapsed = bench_now() - started;
+
+  printf("engine=%s threads=%u records=%lu keys=%u loops=%u\n",
+         options.engine->name, options.threads, record_count, key_count, options.loops);
+  printf("%lu operations in %.2fs: %.0f ops/s\n", total, elapsed, total / elapsed);
+  report_latencies(workers);
+
+  for (i = 0; i < options.threads; ++i) {
+    free(workers[i].latencies);
+  }
+  free(workers);
+  options.engine->destroy(engine);
+  free(records);
+  free(record_keys);
+  free(keys);
+
+  return 0;
+}
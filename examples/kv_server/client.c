@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "client.h"
+#include "protocol.h"
+
+#define READ_CHUNK 65536
+
+struct KvClient {
+  int            fd;
+  unsigned char *out;
+  size_t         out_len;
+  size_t         out_cap;
+  unsigned char *in;
+  size_t         in_len;
+  size_t         in_pos;
+  size_t         in_cap;
+};
+
+/* --- Private Helper Functions --- */
+
+static int reserve(unsigned char **data, size_t *cap, size_t needed) {
+  unsigned char *grown;
+  size_t new_cap = *cap ? *cap : 4096;
+
+  while (new_cap < needed) {
+    new_cap *= 2;
+  }
+
+  if (new_cap != *cap) {
+    grown = (unsigned char *)realloc(*data, new_cap);
+    if (!grown) {
+      return -1;
+    }
+    *data = grown;
+    *cap = new_cap;
+  }
+
+  return 0;
+}
+
+static int append(KvClient *client, const void *data, size_t len) {
+  if (reserve(&client->out, &client->out_cap, client->out_len + len) != 0) {
+    return -1;
+  }
+
+  memcpy(client->out + client->out_len, data, len);
+  client->out_len += len;
+
+  return 0;
+}
+
+/*
+ * Makes sure at least len unread bytes are buffered, reading more from the
+ * socket as needed.
+ */
+static int fill(KvClient *client, size_t len) {
+  ssize_t received;
+
+  if (client->in_pos > 0 && client->in_len - client->in_pos < len) {
+    memmove(client->in, client->in + client->in_pos, client->in_len - client->in_pos);
+    client->in_len -= client->in_pos;
+    client->in_pos = 0;
+  }
+
+  while (client->in_len - client->in_pos < len) {
+    if (reserve(&client->in, &client->in_cap, client->in_len + READ_CHUNK) != 0) {
+      return -1;
+    }
+
+    received = read(client->fd, client->in + client->in_len, client->in_cap - client->in_len);
+    if (received <= 0) {
+      if (received < 0 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    client->in_len += (size_t)received;
+  }
+
+  return 0;
+}
+
+/* --- Public API Functions --- */
+
+KvClient *kv_client_connect(const char *path) {
+  struct sockaddr_un address;
+  KvClient *client;
+
+  if (!path || strlen(path) >= sizeof(address.sun_path)) {
+    return NULL;
+  }
+
+  client = (KvClient *)calloc(1, sizeof(KvClient));
+  if (!client) {
+    return NULL;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (client->fd == -1 ||
+      connect(client->fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    if (client->fd != -1) {
+      close(client->fd);
+    }
+    free(client);
+    return NULL;
+  }
+
+  return client;
+}
+
+void kv_client_close(KvClient *client) {
+  if (!client) {
+    return;
+  }
+
+  close(client->fd);
+  free(client->out);
+  free(client->in);
+  free(client);
+}
+
+int kv_client_queue(KvClient *client, int op, const void *key, unsigned short key_len,
+                    const void *value, unsigned int value_len) {
+  KvRequestHeader header;
+  size_t queued;
+
+  if (!client || op == KV_OP_MGET || value_len > KV_MAX_VALUE_LEN) {
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.op = (unsigned char)op;
+  header.key_len = key_len;
+  header.value_len = op == KV_OP_SET ? value_len : 0;
+
+  /* A request that cannot be queued whole is taken back out entirely */
+  queued = client->out_len;
+  if (append(client, &header, sizeof(header)) != 0 ||
+      append(client, key, key_len) != 0 ||
+      (header.value_len && append(client, value, header.value_len) != 0)) {
+    client->out_len = queued;
+    return -1;
+  }
+
+  return 0;
+}
+
+int kv_client_queue_mget(KvClient *client, const void **keys,
+                         const unsigned short *key_lens, unsigned short count) {
+  KvRequestHeader header;
+  unsigned long total = 0;
+  unsigned short i;
+  size_t queued;
+
+  if (!client || (count && (!keys || !key_lens))) {
+    return -1;
+  }
+
+  /* The key list travels as the request's value, so it has the same limit */
+  for (i = 0; i < count; ++i) {
+    total += sizeof(unsigned short) + key_lens[i];
+  }
+  if (total > KV_MAX_VALUE_LEN) {
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.op = KV_OP_MGET;
+  header.key_len = count;
+  header.value_len = (unsigned int)total;
+
+  queued = client->out_len;
+  if (append(client, &header, sizeof(header)) != 0) {
+    return -1;
+  }
+
+  for (i = 0; i < count; ++i) {
+    if (append(client, &key_lens[i], sizeof(unsigned short)) != 0 ||
+        append(client, keys[i], key_lens[i]) != 0) {
+      client->out_len = queued;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int kv_client_flush(KvClient *client) {
+  size_t sent = 0;
+  ssize_t written;
+
+  if (!client) {
+    return -1;
+  }
+
+  while (sent < client->out_len) {
+    written = write(client->fd, client->out + sent, client->out_len - sent);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    sent += (size_t)written;
+  }
+
+  client->out_len = 0;
+  return 0;
+}
+
+int kv_client_read(KvClient *client, void *value, unsigned int capacity,
+                   unsigned int *value_len) {
+  KvResponseHeader header;
+
+  if (!client || fill(client, sizeof(header)) != 0) {
+    return -1;
+  }
+
+  memcpy(&header, client->in + client->in_pos, sizeof(header));
+  if (fill(client, sizeof(header) + header.value_len) != 0) {
+    return -1;
+  }
+
+  if (value) {
+    memcpy(value, client->in + client->in_pos + sizeof(header),
+           header.value_len < capacity ? header.value_len : capacity);
+  }
+  if (value_len) {
+    *value_len = header.value_len;
+  }
+
+  client->in_pos += sizeof(header) + header.value_len;
+  return header.status;
+}
+
+int kv_client_get(KvClient *client, const void *key, unsigned short key_len,
+                  void *value, unsigned int capacity, unsigned int *value_len) {
+  if (kv_client_queue(client, KV_OP_GET, key, key_len, NULL, 0) != 0 ||
+      kv_client_flush(client) != 0) {
+    return -1;
+  }
+
+  return kv_client_read(client, value, capacity, value_len);
+}
+
+int kv_client_set(KvClient *client, const void *key, unsigned short key_len,
+                  const void *value, unsigned int value_len) {
+  if (kv_client_queue(client, KV_OP_SET, key, key_len, value, value_len) != 0 ||
+      kv_client_flush(client) != 0) {
+    return -1;
+  }
+
+  return kv_client_read(client, NULL, 0, NULL);
+}
+
+int kv_client_delete(KvClient *client, const void *key, unsigned short key_len) {
+  if (kv_client_queue(client, KV_OP_DELETE, key, key_len, NULL, 0) != 0 ||
+      kv_client_flush(client) != 0) {
+    return -1;
+  }
+
+  return kv_client_read(client, NULL, 0, NULL);
+}
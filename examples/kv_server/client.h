@@ -0,0 +1,115 @@
+#ifndef KV_CLIENT_H
+#define KV_CLIENT_H
+
+/*
+ * A minimal client for the kv_server example. Requests are queued into an
+ * output buffer and only sent by `kv_client_flush`, so any number of them
+ * can be pipelined before reading the responses back in order with
+ * `kv_client_read`. The `kv_client_get`, `kv_client_set` and
+ * `kv_client_delete` helpers do all three steps for a single request.
+ */
+typedef struct KvClient KvClient;
+
+/*
+ * Connects to a server listening on the given Unix socket path.
+ *
+ * @param path The path of the server's socket.
+ * @return A pointer to the client, or NULL on failure.
+ */
+KvClient *kv_client_connect(const char *path);
+
+/*
+ * Closes the connection and frees the client.
+ *
+ * @param client A pointer to the client.
+ */
+void kv_client_close(KvClient *client);
+
+/*
+ * Queues a get, set or delete request. Only set requests carry a value.
+ *
+ * @param client A pointer to the client.
+ * @param op One of KV_OP_GET, KV_OP_SET or KV_OP_DELETE.
+ * @param key A pointer to the key bytes.
+ * @param key_len The length of the key.
+ * @param value A pointer to the value bytes, or NULL.
+ * @param value_len The length of the value.
+ * @return 0 on success, -1 on failure.
+ */
+int kv_client_queue(KvClient *client, int op, const void *key, unsigned short key_len,
+                    const void *value, unsigned int value_len);
+
+/*
+ * Queues a multi-get request. The server answers with one response per key.
+ * The key lengths and keys together must not exceed KV_MAX_VALUE_LEN.
+ *
+ * @param client A pointer to the client.
+ * @param keys An array of `count` pointers to key bytes.
+ * @param key_lens An array of `count` key lengths.
+ * @param count The number of keys.
+ * @return 0 on success, -1 on failure.
+ */
+int kv_client_queue_mget(KvClient *client, const void **keys,
+                         const unsigned short *key_lens, unsigned short count);
+
+/*
+ * Sends every queued request to the server.
+ *
+ * @param client A pointer to the client.
+ * @return 0 on success, -1 on failure.
+ */
+int kv_client_flush(KvClient *client);
+
+/*
+ * Reads the next response. Values longer than `capacity` are truncated but
+ * `value_len` always receives the full length.
+ *
+ * @param client A pointer to the client.
+ * @param value A buffer receiving the value, or NULL.
+ * @param capacity The size of the value buffer.
+ * @param value_len Receives the length of the value, may be NULL.
+ * @return The response status (KV_STATUS_*), or -1 on failure.
+ */
+int kv_client_read(KvClient *client, void *value, unsigned int capacity,
+                   unsigned int *value_len);
+
+/*
+ * Gets the value of a key, queueing, flushing and reading the response in
+ * one go. Any requests queued before are sent along with it, so their
+ * responses must have been read first.
+ *
+ * @param client A pointer to the client.
+ * @param key A pointer to the key bytes.
+ * @param key_len The length of the key.
+ * @param value A buffer receiving the value, or NULL.
+ * @param capacity The size of the value buffer.
+ * @param value_len Receives the full length of the value, may be NULL.
+ * @return The response status (KV_STATUS_*), or -1 on failure.
+ */
+int kv_client_get(KvClient *client, const void *key, unsigned short key_len,
+                  void *value, unsigned int capacity, unsigned int *value_len);
+
+/*
+ * Sets the value of a key and waits for the server to acknowledge it.
+ *
+ * @param client A pointer to the client.
+ * @param key A pointer to the key bytes.
+ * @param key_len The length of the key.
+ * @param value A pointer to the value bytes.
+ * @param value_len The length of the value, at most KV_MAX_VALUE_LEN.
+ * @return The response status (KV_STATUS_*), or -1 on failure.
+ */
+int kv_client_set(KvClient *client, const void *key, unsigned short key_len,
+                  const void *value, unsigned int value_len);
+
+/*
+ * Deletes a key and waits for the server to acknowledge it.
+ *
+ * @param client A pointer to the client.
+ * @param key A pointer to the key bytes.
+ * @param key_len The length of the key.
+ * @return The response status (KV_STATUS_*), or -1 on failure.
+ */
+int kv_client_delete(KvClient *client, const void *key, unsigned short key_len);
+
+#endif /* KV_CLIENT_H */
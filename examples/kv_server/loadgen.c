@@ -0,0 +1,193 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "client.h"
+#include "protocol.h"
+
+/*
+ * Load generator for the kv_server example. Each thread opens its own
+ * connection and keeps `depth` requests in flight, mixing gets and sets
+ * over a fixed key space, then the aggregate throughput is reported.
+ */
+
+typedef struct Options {
+  const char  *path;
+  unsigned int threads;
+  unsigned int depth;
+  unsigned int keys;
+  unsigned int read_percent;
+  unsigned int value_size;
+  double       seconds;
+} Options;
+
+typedef struct Worker {
+  pthread_t     thread;
+  unsigned int  seed;
+  unsigned long operations;
+  int           failed;
+} Worker;
+
+static Options options = { NULL, 4, 32, 100000, 90, 64, 5.0 };
+static volatile int running = 1;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned short make_key(char *key, unsigned int index) {
+  return (unsigned short)sprintf(key, "key:%u", index);
+}
+
+static void *run_worker(void *argument) {
+  Worker *worker = (Worker *)argument;
+  KvClient *client = kv_client_connect(options.path);
+  char *value = (char *)calloc(1, options.value_size);
+  char key[32];
+  unsigned short key_len;
+  unsigned int i;
+
+  if (!client || !value) {
+    worker->failed = 1;
+    kv_client_close(client);
+    free(value);
+    return NULL;
+  }
+
+  while (running) {
+    for (i = 0; i < options.depth; ++i) {
+      key_len = make_key(key, rand_r(&worker->seed) % options.keys);
+      if ((unsigned int)(rand_r(&worker->seed) % 100) < options.read_percent) {
+        kv_client_queue(client, KV_OP_GET, key, key_len, NULL, 0);
+      }
+      else {
+        kv_client_queue(client, KV_OP_SET, key, key_len, value, options.value_size);
+      }
+    }
+
+    if (kv_client_flush(client) != 0) {
+      worker->failed = 1;
+      break;
+    }
+
+    for (i = 0; i < options.depth; ++i) {
+      if (kv_client_read(client, NULL, 0, NULL) < 0) {
+        worker->failed = 1;
+        running = 0;
+        break;
+      }
+    }
+    worker->operations += options.depth;
+  }
+
+  kv_client_close(client);
+  free(value);
+  return NULL;
+}
+
+/*
+ * Loads every key once, pipelining in batches, so reads hit from the start.
+ */
+static int preload(void) {
+  KvClient *client = kv_client_connect(options.path);
+  char *value = (char *)calloc(1, options.value_size);
+  char key[32];
+  unsigned int i, batch, pending = 0;
+  int result = client && value ? 0 : -1;
+
+  for (i = 0; result == 0 && i < options.keys; ++i) {
+    kv_client_queue(client, KV_OP_SET, key, make_key(key, i), value, options.value_size);
+    pending++;
+
+    if (pending == 1024 || i + 1 == options.keys) {
+      result = kv_client_flush(client);
+      for (batch = 0; result == 0 && batch < pending; ++batch) {
+        result = kv_client_read(client, NULL, 0, NULL) == KV_STATUS_OK ? 0 : -1;
+      }
+      pending = 0;
+    }
+  }
+
+  kv_client_close(client);
+  free(value);
+  return result;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [-t threads] [-d depth] [-k keys] [-r read%%] [-v value_size] [-s seconds] socket_path\n",
+    name);
+}
+
+int main(int argc, char **argv) {
+  struct timespec tick = { 0, 10000000 };
+  Worker *workers;
+  unsigned long total = 0;
+  double started, elapsed;
+  unsigned int i;
+  int option;
+
+  while ((option = getopt(argc, argv, "t:d:k:r:v:s:")) != -1) {
+    switch (option) {
+      case 't': options.threads = (unsigned int)atoi(optarg); break;
+      case 'd': options.depth = (unsigned int)atoi(optarg); break;
+      case 'k': options.keys = (unsigned int)atoi(optarg); break;
+      case 'r': options.read_percent = (unsigned int)atoi(optarg); break;
+      case 'v': options.value_size = (unsigned int)atoi(optarg); break;
+      case 's': options.seconds = atof(optarg); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (optind != argc - 1 || !options.threads || !options.depth || !options.keys) {
+    usage(argv[0]);
+    return 1;
+  }
+  options.path = argv[optind];
+
+  if (preload() != 0) {
+    fprintf(stderr, "could not preload %s\n", options.path);
+    return 1;
+  }
+
+  workers = (Worker *)calloc(options.threads, sizeof(Worker));
+  if (!workers) {
+    return 1;
+  }
+
+  started = now();
+  for (i = 0; i < options.threads; ++i) {
+    workers[i].seed = i + 1;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+
+  while (running && now() - started < options.seconds) {
+    nanosleep(&tick, NULL);
+  }
+  running = 0;
+
+  for (i = 0; i < options.threads; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    total += workers[i].operations;
+    if (workers[i].failed) {
+      fprintf(stderr, "worker %u failed\n", i);
+    }
+  }
+  elapsed = now() - started;
+
+  printf("threads=%u depth=%u keys=%u reads=%u%% value=%uB\n",
+         options.threads, options.depth, options.keys,
+         options.read_percent, options.value_size);
+  printf("%lu operations in %.2fs: %.0f ops/s\n", total, elapsed, total / elapsed);
+
+  free(workers);
+  return 0;
+}
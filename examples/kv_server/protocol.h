@@ -0,0 +1,45 @@
+#ifndef KV_PROTOCOL_H
+#define KV_PROTOCOL_H
+
+/*
+ * The wire protocol spoken between the kv_server example and its clients.
+ * Both sides live on the same machine, so integers are sent in native byte
+ * order.
+ *
+ * Every request starts with a KvRequestHeader followed by key_len bytes of
+ * key and value_len bytes of value. A multi-get instead uses key_len as the
+ * number of keys and carries them in the value as a run of 16-bit length
+ * prefixed keys.
+ *
+ * Every response starts with a KvResponseHeader followed by value_len bytes
+ * of value. A multi-get is answered with one response per key, in order.
+ *
+ * Requests may be pipelined; responses come back in request order.
+ */
+
+#define KV_OP_GET    1
+#define KV_OP_SET    2
+#define KV_OP_DELETE 3
+#define KV_OP_MGET   4
+
+#define KV_STATUS_OK        0
+#define KV_STATUS_NOT_FOUND 1
+#define KV_STATUS_ERROR     2
+
+/* Requests carrying more than this are rejected and the connection closed */
+#define KV_MAX_VALUE_LEN (16u * 1024u * 1024u)
+
+typedef struct KvRequestHeader {
+  unsigned char  op;
+  unsigned char  reserved;
+  unsigned short key_len;
+  unsigned int   value_len;
+} KvRequestHeader;
+
+typedef struct KvResponseHeader {
+  unsigned char  status;
+  unsigned char  reserved[3];
+  unsigned int   value_len;
+} KvResponseHeader;
+
+#endif /* KV_PROTOCOL_H */
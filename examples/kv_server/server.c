@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "map.h"
+#include "protocol.h"
+
+/*
+ * A small key/value server sharing one in-memory map with local clients
+ * over a Unix domain socket. The map is split into shards, each a Map
+ * guarded by its own mutex, and one epoll event loop runs per thread.
+ */
+
+#define MAX_EVENTS 64
+#define READ_CHUNK 65536
+
+/*
+ * Keys are length prefixed so binary keys work. Values remember the key
+ * they belong to so both can be freed when the entry goes away.
+ */
+typedef struct Key {
+  unsigned short len;
+  unsigned char  data[1];
+} Key;
+
+typedef struct Value {
+  Key          *key;
+  unsigned int  len;
+  unsigned char data[1];
+} Value;
+
+typedef struct Shard {
+  pthread_mutex_t lock;
+  Map            *map;
+} Shard;
+
+typedef struct Buffer {
+  unsigned char *data;
+  size_t         len;
+  size_t         cap;
+} Buffer;
+
+typedef struct Connection {
+  int    fd;
+  Buffer in;
+  Buffer out;
+  size_t out_pos;
+} Connection;
+
+static Shard *shards;
+static unsigned int shard_count = 16;
+static int listen_fd = -1;
+
+/* --- Map helpers --- */
+
+static int compare_keys(const void *key1, const void *key2) {
+  const Key *a = (const Key *)key1;
+  const Key *b = (const Key *)key2;
+
+  if (a->len != b->len) {
+    return a->len < b->len ? -1 : 1;
+  }
+
+  return memcmp(a->data, b->data, a->len);
+}
+
+static Shard *shard_for(const unsigned char *key, unsigned short len) {
+  unsigned int hash = 2166136261u;
+  unsigned short i;
+
+  for (i = 0; i < len; ++i) {
+    hash = (hash ^ key[i]) * 16777619u;
+  }
+
+  return &shards[hash % shard_count];
+}
+
+/* --- Buffer helpers --- */
+
+static int buffer_reserve(Buffer *buffer, size_t extra) {
+  unsigned char *data;
+  size_t cap = buffer->cap ? buffer->cap : 4096;
+
+  while (cap < buffer->len + extra) {
+    cap *= 2;
+  }
+
+  if (cap != buffer->cap) {
+    data = (unsigned char *)realloc(buffer->data, cap);
+    if (!data) {
+      return -1;
+    }
+    buffer->data = data;
+    buffer->cap = cap;
+  }
+
+  return 0;
+}
+
+static int buffer_append(Buffer *buffer, const void *data, size_t len) {
+  if (buffer_reserve(buffer, len) != 0) {
+    return -1;
+  }
+
+  memcpy(buffer->data + buffer->len, data, len);
+  buffer->len += len;
+
+  return 0;
+}
+
+/* --- Request handling --- */
+
+static int respond(Connection *conn, unsigned char status,
+                   const void *value, unsigned int value_len) {
+  KvResponseHeader header;
+
+  memset(&header, 0, sizeof(header));
+  header.status = status;
+  header.value_len = value_len;
+
+  if (buffer_append(&conn->out, &header, sizeof(header)) != 0) {
+    return -1;
+  }
+
+  return value_len ? buffer_append(&conn->out, value, value_len) : 0;
+}
+
+/*
+ * Builds a lookup key in scratch space; the map only ever compares it.
+ */
+static Key *probe_key(Buffer *scratch, const unsigned char *data, unsigned short len) {
+  Key *key;
+
+  scratch->len = 0;
+  if (buffer_reserve(scratch, sizeof(Key) + len) != 0) {
+    return NULL;
+  }
+
+  key = (Key *)scratch->data;
+  key->len = len;
+  memcpy(key->data, data, len);
+
+  return key;
+}
+
+static int handle_get(Connection *conn, Buffer *scratch,
+                      const unsigned char *key_data, unsigned short key_len) {
+  Shard *shard = shard_for(key_data, key_len);
+  Key *key = probe_key(scratch, key_data, key_len);
+  Value *value;
+  int result;
+
+  if (!key) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&shard->lock);
+  value = (Value *)map_get(shard->map, key);
+  result = value
+    ? respond(conn, KV_STATUS_OK, value->data, value->len)
+    : respond(conn, KV_STATUS_NOT_FOUND, NULL, 0);
+  pthread_mutex_unlock(&shard->lock);
+
+  return result;
+}
+
+static int handle_set(Connection *conn, Buffer *scratch,
+                      const unsigned char *key_data, unsigned short key_len,
+                      const unsigned char *value_data, unsigned int value_len) {
+  Shard *shard = shard_for(key_data, key_len);
+  Key *key = probe_key(scratch, key_data, key_len);
+  MapEntryHandle handle;
+  Value *value, *old_value;
+  int stored;
+
+  if (!key) {
+    return -1;
+  }
+
+  value = (Value *)malloc(sizeof(Value) + value_len);
+  if (!value) {
+    return respond(conn, KV_STATUS_ERROR, NULL, 0);
+  }
+  value->len = value_len;
+  memcpy(value->data, value_data, value_len);
+
+  pthread_mutex_lock(&shard->lock);
+  handle = map_find(shard->map, key);
+  old_value = (Value *)map_handle_value(shard->map, handle);
+
+  if (old_value) {
+    value->key = old_value->key;
+    map_handle_set(shard->map, handle, value);
+    stored = 1;
+  }
+  else {
+    value->key = (Key *)malloc(sizeof(Key) + key_len);
+    if (value->key) {
+      memcpy(value->key, key, sizeof(Key) + key_len);
+    }
+    stored = value->key && map_set(shard->map, value->key, value) == 0;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if (!stored) {
+    free(value->key);
+    free(value);
+    return respond(conn, KV_STATUS_ERROR, NULL, 0);
+  }
+
+  free(old_value);
+  return respond(conn, KV_STATUS_OK, NULL, 0);
+}
+
+static int handle_delete(Connection *conn, Buffer *scratch,
+                         const unsigned char *key_data, unsigned short key_len) {
+  Shard *shard = shard_for(key_data, key_len);
+  Key *key = probe_key(scratch, key_data, key_len);
+  MapEntryHandle handle;
+  Value *value;
+
+  if (!key) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&shard->lock);
+  handle = map_find(shard->map, key);
+  value = (Value *)map_handle_value(shard->map, handle);
+  if (value) {
+    map_handle_erase(shard->map, handle);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if (!value) {
+    return respond(conn, KV_STATUS_NOT_FOUND, NULL, 0);
+  }
+
+  free(value->key);
+  free(value);
+  return respond(conn, KV_STATUS_OK, NULL, 0);
+}
+
+static int handle_mget(Connection *conn, Buffer *scratch, unsigned short count,
+                       const unsigned char *payload, unsigned int payload_len) {
+  unsigned short key_len;
+  unsigned int offset = 0;
+  unsigned short i;
+
+  for (i = 0; i < count; ++i) {
+    if (offset + sizeof(key_len) > payload_len) {
+      return -1;
+    }
+    memcpy(&key_len, payload + offset, sizeof(key_len));
+    offset += sizeof(key_len);
+
+    if (offset + key_len > payload_len) {
+      return -1;
+    }
+    if (handle_get(conn, scratch, payload + offset, key_len) != 0) {
+      return -1;
+    }
+    offset += key_len;
+  }
+
+  return 0;
+}
+
+/*
+ * Handles every complete request in the input buffer, leaving a trailing
+ * partial request for the next read. Returns -1 if the connection should
+ * be dropped.
+ */
+static int process_requests(Connection *conn, Buffer *scratch) {
+  KvRequestHeader header;
+  const unsigned char *body;
+  size_t offset = 0;
+  size_t body_len;
+  int result = 0;
+
+  while (result == 0 && conn->in.len - offset >= sizeof(header)) {
+    memcpy(&header, conn->in.data + offset, sizeof(header));
+
+    if (header.value_len > KV_MAX_VALUE_LEN) {
+      return -1;
+    }
+
+    /* A multi-get carries its keys inside the value */
+    body_len = header.value_len + (header.op == KV_OP_MGET ? 0 : header.key_len);
+    if (conn->in.len - offset < sizeof(header) + body_len) {
+      break;
+    }
+
+    body = conn->in.data + offset + sizeof(header);
+    switch (header.op) {
+      case KV_OP_GET:
+        result = handle_get(conn, scratch, body, header.key_len);
+        break;
+      case KV_OP_SET:
+        result = handle_set(conn, scratch, body, header.key_len,
+                            body + header.key_len, header.value_len);
+        break;
+      case KV_OP_DELETE:
+        result = handle_delete(conn, scratch, body, header.key_len);
+        break;
+      case KV_OP_MGET:
+        result = handle_mget(conn, scratch, header.key_len, body, header.value_len);
+        break;
+      default:
+        result = -1;
+    }
+
+    offset += sizeof(header) + body_len;
+  }
+
+  memmove(conn->in.data, conn->in.data + offset, conn->in.len - offset);
+  conn->in.len -= offset;
+
+  return result;
+}
+
+/* --- Event loop --- */
+
+static void close_connection(int epoll_fd, Connection *conn) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  free(conn->in.data);
+  free(conn->out.data);
+  free(conn);
+}
+
+static void accept_connections(int epoll_fd) {
+  struct epoll_event event;
+  Connection *conn;
+  int fd;
+
+  while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    conn = (Connection *)calloc(1, sizeof(Connection));
+    if (!conn) {
+      close(fd);
+      continue;
+    }
+
+    conn->fd = fd;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+      close(fd);
+      free(conn);
+    }
+  }
+}
+
+/*
+ * Writes as much pending output as the socket takes, asking to be woken up
+ * for writability only while some is left over. Returns -1 on error.
+ */
+static int flush_output(int epoll_fd, Connection *conn) {
+  struct epoll_event event;
+  ssize_t written;
+
+  while (conn->out_pos < conn->out.len) {
+    written = write(conn->fd, conn->out.data + conn->out_pos, conn->out.len - conn->out_pos);
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    conn->out_pos += (size_t)written;
+  }
+
+  if (conn->out_pos == conn->out.len) {
+    conn->out.len = conn->out_pos = 0;
+  }
+
+  event.events = EPOLLIN | EPOLLRDHUP | (conn->out.len ? EPOLLOUT : 0);
+  event.data.ptr = conn;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+static int read_input(Connection *conn) {
+  ssize_t received;
+
+  for (;;) {
+    if (buffer_reserve(&conn->in, READ_CHUNK) != 0) {
+      return -1;
+    }
+
+    received = read(conn->fd, conn->in.data + conn->in.len, conn->in.cap - conn->in.len);
+    if (received > 0) {
+      conn->in.len += (size_t)received;
+      continue;
+    }
+
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+
+    return -1; /* closed by the peer or failed */
+  }
+}
+
+static void *event_loop(void *unused) {
+  struct epoll_event events[MAX_EVENTS];
+  struct epoll_event event;
+  Buffer scratch;
+  Connection *conn;
+  int epoll_fd, count, i, closed;
+
+  (void)unused;
+  memset(&scratch, 0, sizeof(scratch));
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    perror("epoll_create1");
+    return NULL;
+  }
+
+  /* Every loop watches the listening socket; only one is woken per client */
+  event.events = EPOLLIN | EPOLLEXCLUSIVE;
+  event.data.ptr = NULL;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) {
+    perror("epoll_ctl");
+    close(epoll_fd);
+    return NULL;
+  }
+
+  for (;;) {
+    count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+    for (i = 0; i < count; ++i) {
+      conn = (Connection *)events[i].data.ptr;
+      if (!conn) {
+        accept_connections(epoll_fd);
+        continue;
+      }
+
+      closed = 0;
+      if (events[i].events & EPOLLIN) {
+        closed = read_input(conn) != 0;
+        /* Answer everything that arrived, even if the peer then hung up */
+        if (process_requests(conn, &scratch) != 0) {
+          closed = 1;
+        }
+      }
+
+      if (flush_output(epoll_fd, conn) != 0) {
+        closed = 1;
+      }
+
+      if (closed || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+        close_connection(epoll_fd, conn);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-t threads] [-s shards] socket_path\n", name);
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_un address;
+  pthread_t *threads;
+  long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *path;
+  unsigned int i;
+  int option;
+
+  while ((option = getopt(argc, argv, "t:s:")) != -1) {
+    switch (option) {
+      case 't': thread_count = atol(optarg); break;
+      case 's': shard_count = (unsigned int)atoi(optarg); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (optind != argc - 1 || thread_count < 1 || shard_count < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  path = argv[optind];
+
+  signal(SIGPIPE, SIG_IGN);
+
+  shards = (Shard *)calloc(shard_count, sizeof(Shard));
+  threads = (pthread_t *)calloc((size_t)thread_count, sizeof(pthread_t));
+  if (!shards || !threads) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  for (i = 0; i < shard_count; ++i) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+    shards[i].map = map_create(1024, compare_keys);
+    if (!shards[i].map) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "socket path too long\n");
+    return 1;
+  }
+  strcpy(address.sun_path, path);
+  unlink(path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1 ||
+      bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listen_fd, SOMAXCONN) != 0) {
+    perror(path);
+    return 1;
+  }
+
+  printf("Serving %s with %ld threads over %u shards\n", path, thread_count, shard_count);
+  fflush(stdout);
+
+  for (i = 0; i < (unsigned int)thread_count; ++i) {
+    pthread_create(&threads[i], NULL, event_loop, NULL);
+  }
+
+  for (i = 0; i < (unsigned int)thread_count; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  return 0;
+}
@@ -22,13 +22,229 @@ typedef struct Map {
  */
 typedef int (*MapKeyCompareFunc)(const void *key1, const void *key2);
 
+/*
+ * A handle to a single entry of a map as returned by `map_find`. The fields
+ * are an implementation detail; treat the handle as opaque and only pass it
+ * back to the `map_handle_*` functions of the map that produced it.
+ *
+ * A handle goes stale as soon as the map moves entries around (currently
+ * whenever any entry is removed). Stale handles are detected and rejected
+ * rather than silently touching the wrong entry.
+ */
+typedef struct MapEntryHandle {
+  int index;
+  unsigned int generation;
+} MapEntryHandle;
+
+/*
+ * Decides what `map_merge` does when a key from the source map is already
+ * present in the destination map.
+ */
+typedef enum MapMergePolicy {
+  MAP_MERGE_OVERWRITE,     /* the source value replaces the existing one */
+  MAP_MERGE_KEEP_EXISTING  /* the destination value is left untouched    */
+} MapMergePolicy;
+
+/*
+ * The set of callbacks reported to by `map_diff`. Any of them may be NULL if
+ * the caller is not interested in that kind of difference.
+ */
+typedef struct MapDiffCallbacks {
+  void (*added)(void *key, void *value, void *context);
+  void (*removed)(void *key, void *value, void *context);
+  void (*changed)(void *key, void *old_value, void *new_value, void *context);
+} MapDiffCallbacks;
+
+/*
+ * The direction in which `map_export_sorted` orders keys.
+ */
+typedef enum MapSortOrder {
+  MAP_SORT_ASCENDING,
+  MAP_SORT_DESCENDING
+} MapSortOrder;
+
+/*
+ * Function pointer type invoked by `map_join` for every input row whose key
+ * is found in the map. Row is the index of the key in the input array.
+ */
+typedef void (*MapJoinFunc)(unsigned int row, void *key, void *value, void *context);
+
+/*
+ * Function pointer type used by `map_group_by` to fold a row into the
+ * aggregate for its key. The accumulator is NULL for a key the map does not
+ * hold yet; the returned pointer becomes the key's new value in the map.
+ */
+typedef void *(*MapAggregateFunc)(void *accumulator, void *row, void *context);
+
+/*
+ * Function pointer type used to turn a key or value into bytes when a map
+ * is written to disk. It returns a pointer to the bytes representing item
+ * (which may simply be item itself) and stores their count in length. The
+ * bytes only need to stay valid until the next call.
+ */
+typedef const void *(*MapSerializeFunc)(const void *item, unsigned int *length, void *context);
+
+/*
+ * Function pointer type used to rebuild a key or value from the bytes a
+ * `MapSerializeFunc` produced. It returns a newly allocated item, or NULL on
+ * failure. Items rebuilt by `map_load` are owned by the caller.
+ */
+typedef void *(*MapDeserializeFunc)(const void *bytes, unsigned int length, void *context);
+
+/*
+ * Describes how the keys and values of a map are written to and read from
+ * a snapshot. The deserializers may be NULL when only saving, and the
+ * serializers may be NULL when only loading.
+ */
+typedef struct MapCodec {
+  MapSerializeFunc   serialize_key;
+  MapSerializeFunc   serialize_value;
+  MapDeserializeFunc deserialize_key;
+  MapDeserializeFunc deserialize_value;
+  void              *context;
+} MapCodec;
+
+/*
+ * An atomically swappable reference to a map, letting reader threads keep
+ * using whichever map is current while a replacement is published. See
+ * `map_ref_create`.
+ */
+typedef struct MapRef MapRef;
+
+/*
+ * Marks a reader as inside a `MapRef`, as filled in by `map_ref_enter`. The
+ * fields are an implementation detail.
+ */
+typedef struct MapRefGuard {
+  MapRef *ref;
+  unsigned int slot;
+} MapRefGuard;
+
+/*
+ * How a map rearranges itself as keys are looked up, as set with
+ * `map_organize`. Each policy includes the ones listed before it.
+ */
+typedef enum MapOrganizePolicy {
+  MAP_ORGANIZE_NONE,          /* entries stay in insertion order           */
+  MAP_ORGANIZE_TAGS,          /* entries are tagged to skip most compares  */
+  MAP_ORGANIZE_TRANSPOSE,     /* a key found swaps places with the one
+                                 in front of it                            */
+  MAP_ORGANIZE_MOVE_TO_FRONT  /* a key found often enough moves to the
+                                 front of the table                        */
+} MapOrganizePolicy;
+
+/*
+ * Levels of vector instructions the comparison, tag, checksum and sketch
+ * kernels can use, each including the ones before it. See `map_cpu_level`.
+ */
+typedef enum MapCpuLevel {
+  MAP_CPU_SCALAR,             /* plain C                                   */
+  MAP_CPU_SSE2,               /* 16 bytes per step                         */
+  MAP_CPU_SSE42,              /* adds the crc32 instruction for snapshots  */
+  MAP_CPU_AVX2,               /* 32 bytes per step                         */
+  MAP_CPU_AVX512              /* 64 bytes per step (AVX-512BW)             */
+} MapCpuLevel;
+
+/*
+ * Function pointer type for hashing keys. Keys that compare equal must
+ * hash equally.
+ */
+typedef unsigned int (*MapHashFunc)(const void *key);
+
+/*
+ * A one to one map that can be looked up by key or by value in constant
+ * time. See `map_bimap_create`.
+ */
+typedef struct MapBimap MapBimap;
+
+/*
+ * A secondary index over a map, finding entries by a field of their
+ * values. See `map_index_create`.
+ */
+typedef struct MapIndex MapIndex;
+
+/*
+ * Function pointer type used by a secondary index to extract the indexed
+ * field of an entry, e.g. a pointer to the email string inside a user
+ * record. The returned pointer must stay valid while the entry holds the
+ * value.
+ */
+typedef const void *(*MapFieldFunc)(const void *key, const void *value, void *context);
+
+/*
+ * Samples the keys used with a map to find the hottest ones. See
+ * `map_sampler_create`.
+ */
+typedef struct MapSampler MapSampler;
+
+/*
+ * One of the hottest keys reported by `map_sampler_top`. Keys are known by
+ * their hash only; the count is an estimate of how often the key was used
+ * that overstates the truth by at most error.
+ */
+typedef struct MapHotKey {
+  unsigned int hash;
+  unsigned long count;
+  unsigned long error;
+} MapHotKey;
+
+/*
+ * Counts keys approximately in a fixed amount of memory, however many
+ * distinct keys there are. See `map_sketch_create`.
+ */
+typedef struct MapSketch MapSketch;
+
+/*
+ * Records the operations performed on a map to a trace file. See
+ * `map_tracer_create`.
+ */
+typedef struct MapTracer MapTracer;
+
+/*
+ * The operations a trace records.
+ */
+typedef enum MapTraceOp {
+  MAP_TRACE_GET,
+  MAP_TRACE_SET,
+  MAP_TRACE_DELETE
+} MapTraceOp;
+
+/*
+ * A single operation read back from a trace by `map_trace_load`. Keys are
+ * known by their hash only; time is in nanoseconds since the trace started.
+ */
+typedef struct MapTraceRecord {
+  MapTraceOp op;
+  unsigned int hash;
+  unsigned long long time;
+} MapTraceRecord;
+
+/*
+ * A named group that maps can be attached to so the memory they take up
+ * is added up in one place, and optionally kept within a budget. See
+ * `map_account_create`.
+ */
+typedef struct MapAccount MapAccount;
+
+/*
+ * Function pointer type invoked when a charge takes an account over its
+ * soft limit, with the number of bytes the account would then hold. It is
+ * the place to free memory, e.g. by evicting entries the caller owns.
+ */
+typedef void (*MapBudgetFunc)(MapAccount *account, unsigned long bytes, void *context);
+
+/*
+ * Function pointer type invoked once per entry by `map_scan`. The context
+ * pointer is whatever was handed to `map_scan` and is passed through as is.
+ */
+typedef void (*MapScanFunc)(void *key, void *value, void *context);
+
 /* -- Some definitions of comparators have been provided for easy reuse -- */
 
 /*
  * Conforming to the `MapKeyCompareFunc` type, this comparator assumes the
  * keys in the map are both strings and compares them in a case insensitive
- * manner. Internally it converts a copy to lower-case for each string and
- * then uses `strcmp` to evaluate the result, freeing memory post comparison.
+ * manner, folding ASCII letters to lower-case as it goes.
  *
  * @param key1 a pointer to a character string
  * @param key2 a pointer to a character string
@@ -41,12 +257,37 @@ int map_compare_string_keys_ignoring_case(const void *key1, const void *key2);
  * keys in the map are both strings and compares them in a case sensitive
  * manner.
  *
+ * Both string comparators work through up to 64 bytes at a time with the
+ * widest vector instructions the CPU supports (see `map_cpu_level`), which
+ * pays off for long keys that share a prefix.
+ *
  * @param key1 a pointer to a character string
  * @param key2 a pointer to a character string
  * @return -1 if key1 is less than key2, 0 if they match, 1 if key is greater
  */
 int map_compare_string_keys(const void *key1, const void *key2);
 
+/*
+ * A key made of a run of bytes with a known length, which may contain NUL
+ * bytes and need not be terminated. The map stores a pointer to it as with
+ * any other key, so both it and its bytes must outlive the entry.
+ */
+typedef struct MapSizedKey {
+  const void *bytes;
+  unsigned int length;
+} MapSizedKey;
+
+/*
+ * Conforming to the `MapKeyCompareFunc` type, this comparator assumes the
+ * keys in the map are both `MapSizedKey`s. The bytes are compared like
+ * `memcmp`, and a key that is a prefix of the other sorts first.
+ *
+ * @param key1 a pointer to a MapSizedKey
+ * @param key2 a pointer to a MapSizedKey
+ * @return -1 if key1 is less than key2, 0 if they match, 1 if key is greater
+ */
+int map_compare_sized_keys(const void *key1, const void *key2);
+
 /*
  * Conforming to the `MapKeyCompareFunc` type, this comparator assumes the
  * keys in the map are both integers. The numbers are cast and dereferenced
@@ -54,7 +295,8 @@ int map_compare_string_keys(const void *key1, const void *key2);
  *
  * @param int1 a pointer to an integer
  * @param int2 a pointer to an integer
- * @return 0 if the dereferenced values match, -1 otherwise
+ * @return -1 if the first value is less than the second, 0 if they match,
+ *  1 if it is greater
  */
 int map_compare_int_keys(const void *intPtr1, const void *intPtr2);
 
@@ -65,7 +307,8 @@ int map_compare_int_keys(const void *intPtr1, const void *intPtr2);
  *
  * @param uintPtr1 a pointer to an unsigned integer
  * @param uintPtr2 a pointer to an unsigned integer
- * @return 0 if the dereferenced values match, -1 otherwise
+ * @return -1 if the first value is less than the second, 0 if they match,
+ *  1 if it is greater
  */
 int map_compare_uint_keys(const void *uintPtr1, const void *uintPtr2);
 
@@ -73,10 +316,12 @@ int map_compare_uint_keys(const void *uintPtr1, const void *uintPtr2);
  * Conforming to the `MapKeyCompareFunc` type, this comparator assumes the
  * keys in the map are both floats. The numbers are cast and dereferenced
  * before comparing.
+ * A NaN key matches no key, not even itself.
  *
  * @param floatPtr1 a pointer to an integer
  * @param floatPtr2 a pointer to an integer
- * @return 0 if the dereferenced values match, -1 otherwise
+ * @return -1 if the first value is less than the second, 0 if they match,
+ *  1 if it is greater
  */
 int map_compare_float_keys(const void *floatPtr1, const void *floatPtr2);
 
@@ -84,10 +329,12 @@ int map_compare_float_keys(const void *floatPtr1, const void *floatPtr2);
  * Conforming to the `MapKeyCompareFunc` type, this comparator assumes the
  * keys in the map are both doubles. The numbers are cast and dereferenced
  * before comparing.
+ * A NaN key matches no key, not even itself.
  *
  * @param doublePtr1 a pointer to a double
  * @param doublePtr2 a pointer to a double
- * @return 0 if the dereferenced values match, -1 otherwise
+ * @return -1 if the first value is less than the second, 0 if they match,
+ *  1 if it is greater
  */
 int map_compare_double_keys(const void *doublePtr1, const void *doublePtr2);
 
@@ -102,6 +349,33 @@ int map_compare_double_keys(const void *doublePtr1, const void *doublePtr2);
  */
 int map_compare_ptr_keys(const void *ptrKey1, const void *ptrKey2);
 
+/* -- As have hash functions to go with them -- */
+
+/*
+ * Conforming to the `MapHashFunc` type, this hashes a NUL terminated string
+ * (FNV-1a), for use with `map_compare_string_keys`.
+ */
+unsigned int map_hash_string(const void *key);
+
+/*
+ * Conforming to the `MapHashFunc` type, this hashes the bytes of a
+ * `MapSizedKey` (FNV-1a), for use with `map_compare_sized_keys`.
+ */
+unsigned int map_hash_sized_key(const void *key);
+
+/*
+ * Conforming to the `MapHashFunc` type, this hashes the value of an int or
+ * unsigned int key, for use with `map_compare_int_keys` and
+ * `map_compare_uint_keys`.
+ */
+unsigned int map_hash_int(const void *intPtr);
+
+/*
+ * Conforming to the `MapHashFunc` type, this hashes the pointer itself, for
+ * use with `map_compare_ptr_keys`.
+ */
+unsigned int map_hash_ptr(const void *ptrKey);
+
 /*
  * Creates and initializes a new map. For ease of use, a number of common
  * comparators are provided by this code. Either choose one of the
@@ -109,6 +383,7 @@ int map_compare_ptr_keys(const void *ptrKey1, const void *ptrKey2);
  *
  *   - map_compare_string_keys_ignoring_case
  *   - map_compare_string_keys
+ *   - map_compare_sized_keys
  *   - map_compare_int_keys
  *   - map_compare_uint_keys
  *   - map_compare_float_keys
@@ -179,4 +454,940 @@ int map_get_capacity(Map *map);
  */
 void map_delete(Map *map, const void *key);
 
+/*
+ * Ensures the map can hold at least `capacity` entries without growing
+ * again. Useful before inserting a known number of entries in a batch.
+ *
+ * @param map A pointer to the map.
+ * @param capacity The number of entries the map should be able to hold.
+ * @return 0 on success, -1 on failure (e.g., memory allocation error).
+ */
+int map_reserve(Map *map, unsigned int capacity);
+
+/*
+ * Creates a copy of a map, sharing the same comparator. The entry table is
+ * copied wholesale, so this costs a single allocation and copy regardless
+ * of the number of entries. Keys and values are not duplicated; both maps
+ * point at the same ones.
+ *
+ * @param map A pointer to the map to copy.
+ * @return A pointer to the new map, or NULL if allocation fails.
+ */
+Map *map_clone(Map *map);
+
+/*
+ * Copies every entry of `src` into `dst`. Room for all of `src` is reserved
+ * up front so `dst` grows at most once. When both maps share the same
+ * comparator, keys coming from `src` are only compared against the entries
+ * `dst` held before the merge. If a unique secondary index of `dst` refuses
+ * one of the entries, the merge fails as a whole and `dst` is left as it
+ * was.
+ *
+ * @param dst A pointer to the map receiving entries.
+ * @param src A pointer to the map whose entries are copied.
+ * @param policy What to do with keys already present in `dst`.
+ * @return 0 on success, -1 on failure (e.g., memory allocation error).
+ */
+int map_merge(Map *dst, Map *src, MapMergePolicy policy);
+
+/*
+ * Compares two maps and reports keys present only in `b` as added, keys
+ * present only in `a` as removed and keys present in both but mapped to a
+ * different value pointer as changed.
+ *
+ * Each key is first compared against the entry at the same relative
+ * position in the other map, so maps that share an origin (such as a map
+ * and an edited `map_clone` of it) are diffed in close to linear time.
+ * Unrelated maps fall back to a search per key, which is quadratic; use
+ * `map_diff_hashed` for those.
+ *
+ * @param a A pointer to the old map.
+ * @param b A pointer to the new map.
+ * @param callbacks The callbacks to report differences to.
+ * @param context An opaque pointer handed to each callback invocation.
+ * @return The number of differences found, or -1 if either map is invalid.
+ */
+int map_diff(Map *a, Map *b, const MapDiffCallbacks *callbacks, void *context);
+
+/*
+ * Like `map_diff`, but given a hash function the keys are matched through
+ * a temporary hash index over `a`, so any two maps are diffed in linear
+ * time. Differences are reported in the same order as by `map_diff`.
+ *
+ * @param a A pointer to the old map.
+ * @param b A pointer to the new map.
+ * @param hash_func A hash function consistent with the comparator of `a`,
+ *  or NULL to behave exactly like `map_diff`.
+ * @param callbacks The callbacks to report differences to.
+ * @param context An opaque pointer handed to each callback invocation.
+ * @return The number of differences found, or -1 if either map is invalid
+ *  or memory for the index could not be allocated.
+ */
+int map_diff_hashed(Map *a, Map *b, MapHashFunc hash_func,
+                    const MapDiffCallbacks *callbacks, void *context);
+
+/*
+ * Writes every key and value of a map into caller supplied arrays, ordered
+ * by key. Both arrays must have room for `map_get_size(map)` pointers;
+ * either may be NULL if only keys or only values are wanted.
+ *
+ * Maps using the built-in string comparators are sorted with an MSD radix
+ * sort on the key bytes, and maps using the int, uint or float comparators
+ * with an LSD radix sort on the key bits. Any other comparator falls back to
+ * a merge sort, in which case it must impose an ordering (negative, zero or
+ * positive) rather than just report equality.
+ *
+ * Maps of 65536 entries or more are sorted on up to `map_threads` threads:
+ * the MSD radix sort sorts its first level buckets in parallel, the LSD
+ * radix sort counts and scatters a slice of the entries per thread, and
+ * the merge sort sorts a run per thread before merging the runs pairwise.
+ * The comparator may therefore be called from several threads at once.
+ *
+ * @param map A pointer to the map.
+ * @param out_keys An array receiving the keys, or NULL.
+ * @param out_values An array receiving the values, or NULL.
+ * @param order Whether to sort ascending or descending.
+ * @return The number of entries written, or -1 on failure (e.g., invalid
+ *  map or memory allocation error).
+ */
+int map_export_sorted(Map *map, void **out_keys, void **out_values,
+                      MapSortOrder order);
+
+/*
+ * Joins an array of keys against a map, invoking `callback` for every key
+ * that is present in the map. Rather than searching the map once per row,
+ * larger inputs are sorted alongside a sorted copy of the map's entries and
+ * matched in a single merge pass, so the comparator must impose an ordering
+ * (as all built-in comparators other than `map_compare_ptr_keys` do).
+ *
+ * Matches are reported in key order rather than row order; the row index
+ * passed to the callback identifies the input key that matched.
+ *
+ * For 65536 rows or more the sorts and the matching run on up to
+ * `map_threads` threads, each matching its own partition of the sorted rows,
+ * so the comparator may be called from several threads at once. The
+ * callback is only ever called from the calling thread.
+ *
+ * @param map A pointer to the map.
+ * @param keys An array of `count` keys to look up.
+ * @param count The number of keys in the array.
+ * @param callback The function invoked for each matching row.
+ * @param context An opaque pointer handed to each callback invocation.
+ * @return The number of matching rows, or -1 on failure (e.g., invalid map
+ *  or memory allocation error).
+ */
+int map_join(Map *map, void **keys, unsigned int count,
+             MapJoinFunc callback, void *context);
+
+/*
+ * Aggregates rows into a map by key. The rows are first sorted by key and
+ * matched against a sorted copy of the map's entries, as in `map_join` and
+ * on as many threads, so that every run of equal keys is folded together
+ * through `aggregate` and the map is updated once for the whole run. The
+ * same ordering requirement as `map_join` applies to the comparator, and
+ * `aggregate` is likewise only called from the calling thread.
+ *
+ * Keys not yet in the map are inserted using the first matching key pointer
+ * from the input, so those keys must outlive the map as with `map_set`.
+ *
+ * This is not atomic: if memory runs out or a unique secondary index
+ * refuses a group's aggregate, the call fails but the groups stored before
+ * it stay in the map, and `aggregate` may already have updated existing
+ * aggregates in place.
+ *
+ * @param map A pointer to the map holding the aggregates.
+ * @param keys An array of `count` keys, one per row.
+ * @param rows An array of `count` rows handed to `aggregate`.
+ * @param count The number of rows.
+ * @param aggregate The function folding a row into its key's aggregate.
+ * @param context An opaque pointer handed to each aggregate invocation.
+ * @return The number of distinct keys aggregated, or -1 on failure (e.g.,
+ *  invalid map or memory allocation error).
+ */
+int map_group_by(Map *map, void **keys, void **rows, unsigned int count,
+                 MapAggregateFunc aggregate, void *context);
+
+/*
+ * Conforming to the `MapSerializeFunc` type, this serializer assumes the
+ * item is a NUL terminated string and uses its bytes, terminator included.
+ */
+const void *map_serialize_string(const void *item, unsigned int *length, void *context);
+
+/*
+ * Conforming to the `MapDeserializeFunc` type, this deserializer rebuilds a
+ * string written by `map_serialize_string` into newly malloc'ed memory.
+ */
+void *map_deserialize_string(const void *bytes, unsigned int length, void *context);
+
+/*
+ * Writes every entry of a map to a binary snapshot file. The snapshot is
+ * written to path with ".tmp" appended first and then renamed over path,
+ * so a reader never sees a partially written file. Two saves to the same
+ * path must not run at the same time, as they would share that file.
+ *
+ * Entries are grouped into blocks of roughly a megabyte, each carrying a
+ * CRC32C checksum (computed with the SSE4.2 crc32 instruction when the CPU
+ * has it) so that corruption is caught on load and so that blocks can be
+ * loaded on their own with `map_load_blocks`. Blocks are compressed with
+ * `map_lz_compress` when that makes them at least an eighth smaller, and
+ * are compressed and checksummed on up to `map_threads` threads at once.
+ * The codec itself is only ever called from the calling thread.
+ *
+ * @param map A pointer to the map.
+ * @param path The path of the snapshot file.
+ * @param codec How to turn keys and values into bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int map_save(Map *map, const char *path, const MapCodec *codec);
+
+/*
+ * Creates a new map holding every entry of a snapshot written by
+ * `map_save`. The keys and values are rebuilt through the codec and belong
+ * to the caller, just as with any other map. Blocks are read in batches,
+ * which are checked and decompressed on up to `map_threads` threads while
+ * the codec runs on the calling thread only.
+ *
+ * @param path The path of the snapshot file.
+ * @param compare_func A pointer to a function used to compare keys.
+ * @param codec How to turn bytes back into keys and values.
+ * @return A pointer to the new map, or NULL on failure.
+ */
+Map *map_load(const char *path, MapKeyCompareFunc compare_func, const MapCodec *codec);
+
+/*
+ * Returns the number of blocks in a snapshot written by `map_save`.
+ *
+ * @param path The path of the snapshot file.
+ * @return The number of blocks, or -1 if the file is not a snapshot.
+ */
+int map_snapshot_block_count(const char *path);
+
+/*
+ * Like `map_load`, but only loads a range of the snapshot's blocks. The
+ * blocks before the range are skipped over without being read, and the
+ * range is clamped to the blocks the snapshot actually has.
+ *
+ * @param path The path of the snapshot file.
+ * @param compare_func A pointer to a function used to compare keys.
+ * @param codec How to turn bytes back into keys and values.
+ * @param first_block The index of the first block to load.
+ * @param block_count The number of blocks to load.
+ * @return A pointer to the new map, or NULL on failure (including a block
+ *  failing its checksum).
+ */
+Map *map_load_blocks(const char *path, MapKeyCompareFunc compare_func, const MapCodec *codec,
+                     unsigned int first_block, unsigned int block_count);
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#define MAP_HAVE_BGSAVE 1
+
+/*
+ * Writes a snapshot in the background, like `map_save`. A child process is
+ * forked to serialize the map as it was at the time of the call, while the
+ * caller carries on reading and writing it; the operating system copies
+ * only the pages the caller modifies in the meantime. Completion is
+ * reported through `map_bgsave_status`.
+ *
+ * Large entry tables are opted out of transparent huge pages before the
+ * fork where the platform supports it, so that a single write in the
+ * parent does not copy a whole huge page.
+ *
+ * The child works on its own copy of the map, keys and values, so the
+ * caller may modify or free them freely while the save is running.
+ *
+ * The codec runs in the child, which only has a copy of the thread that
+ * called `map_bgsave`. Its functions must therefore be safe to call after
+ * `fork()`: they must not take locks that other threads of the parent may
+ * have held at the time, or rely on those threads to make progress. The
+ * built-in string codec is safe.
+ *
+ * Like `map_save`, the child writes to path with ".tmp" appended before
+ * renaming it over path, so no other save to the same path, in the
+ * foreground or the background, may run until this one has finished as
+ * reported by `map_bgsave_status`. Otherwise both write the same
+ * temporary file and the snapshot ends up corrupt or missing.
+ *
+ * Only available where MAP_HAVE_BGSAVE is defined.
+ *
+ * @param map A pointer to the map.
+ * @param path The path of the snapshot file.
+ * @param codec How to turn keys and values into bytes.
+ * @return The process id of the saving child, or -1 on failure.
+ */
+long map_bgsave(Map *map, const char *path, const MapCodec *codec);
+
+/*
+ * Checks on a background save started by `map_bgsave` without blocking.
+ * Once a finished save has been reported, its process id must not be
+ * checked again.
+ *
+ * @param pid The process id returned by `map_bgsave`.
+ * @return 1 if the save is still running, 0 if it completed successfully,
+ *  -1 if it failed
+ */
+int map_bgsave_status(long pid);
+#endif
+
+/*
+ * Creates a reference through which readers on any thread can use a map
+ * while a writer replaces it wholesale with `map_swap`, for example with a
+ * freshly built routing table. Readers never block; a swap waits only for
+ * the readers that might still be using the old map to leave it.
+ *
+ * The map behind a reference is meant to be read only. Readers must not
+ * modify it, since other threads may be reading it at the same time. A map
+ * organized with `MAP_ORGANIZE_TRANSPOSE` or `MAP_ORGANIZE_MOVE_TO_FRONT`
+ * reorders itself on every `map_get` (see `map_organize`), so such maps
+ * are refused here and by `map_swap`, and must not be organized that way
+ * while behind a reference.
+ *
+ * @param map A pointer to the map readers start out with.
+ * @return A pointer to the reference, or NULL if allocation fails or the
+ *  map reorders itself on lookups.
+ */
+MapRef *map_ref_create(Map *map);
+
+/*
+ * Frees a reference. No reader may be inside it any longer.
+ *
+ * @param ref A pointer to the reference.
+ * @return The map that was current, which the caller still owns.
+ */
+Map *map_ref_free(MapRef *ref);
+
+/*
+ * Enters a reference and returns the map that is current. The map stays
+ * valid until the same guard is passed to `map_ref_leave`, even if a newer
+ * one is published in the meantime. Keep the time between the two short,
+ * as a pending `map_swap` waits for it.
+ *
+ * @param ref A pointer to the reference.
+ * @param guard Receives what `map_ref_leave` needs to know.
+ * @return A pointer to the current map.
+ */
+Map *map_ref_enter(MapRef *ref, MapRefGuard *guard);
+
+/*
+ * Leaves a reference previously entered with `map_ref_enter`. The map it
+ * returned must not be used afterwards.
+ *
+ * @param guard The guard filled in by `map_ref_enter`.
+ */
+void map_ref_leave(MapRefGuard *guard);
+
+/*
+ * Publishes a new map through a reference. Readers entering afterwards see
+ * the new map at once; the call returns once no reader can still be using
+ * the old one, which is handed back so the caller can free it (along with
+ * its keys and values) safely.
+ *
+ * As with `map_ref_create`, a map that reorders itself on lookups is
+ * refused and the reference is left as it was.
+ *
+ * @param ref A pointer to the reference.
+ * @param map A pointer to the map to publish.
+ * @return The previously current map, or NULL if ref is invalid or the map
+ *  reorders itself on lookups.
+ */
+Map *map_swap(MapRef *ref, Map *map);
+
+/*
+ * Creates an accounting group. Every map attached to it charges it for the
+ * memory of the map itself (the structure and its entry table), while the
+ * owners of keys, values or indexes can charge it for those explicitly
+ * with `map_account_charge`. Charges only happen when memory is allocated,
+ * such as when a map's table grows, so keeping count costs nothing on
+ * ordinary lookups and updates.
+ *
+ * Accounts may be shared by maps used on different threads.
+ *
+ * @param name A name to tell the group apart by; it is copied.
+ * @param soft_limit The number of bytes past which over_soft_limit is
+ *  called before each charge, or 0 for none.
+ * @param hard_limit The number of bytes no charge may take the group past,
+ *  or 0 for none. A `map_set` that would need to grow a table past it
+ *  fails instead.
+ * @param over_soft_limit Called when the soft limit is exceeded, may be NULL.
+ * @param context Passed through to over_soft_limit as is.
+ * @return A pointer to the account, or NULL if allocation fails.
+ */
+MapAccount *map_account_create(const char *name, unsigned long soft_limit, unsigned long hard_limit,
+                               MapBudgetFunc over_soft_limit, void *context);
+
+/*
+ * Frees an account. Every map attached to it must have been freed or moved
+ * to another account first.
+ *
+ * @param account A pointer to the account.
+ */
+void map_account_free(MapAccount *account);
+
+/*
+ * Attaches a map to an account, moving what it has charged so far out of
+ * its previous account, if any. Clones of the map join the same account.
+ *
+ * @param map A pointer to the map.
+ * @param account A pointer to the account, or NULL to detach the map.
+ * @return 0 on success, -1 if map is invalid or the account has no room.
+ */
+int map_account_attach(Map *map, MapAccount *account);
+
+/*
+ * Returns the account a map is attached to.
+ *
+ * @param map A pointer to the map.
+ * @return A pointer to the account, or NULL if there is none.
+ */
+MapAccount *map_account_of(Map *map);
+
+/*
+ * Charges an account for memory the maps themselves do not know about,
+ * such as keys and values owned by the caller.
+ *
+ * @param account A pointer to the account.
+ * @param bytes The number of bytes to add.
+ * @return 0 on success, -1 if it would exceed the hard limit.
+ */
+int map_account_charge(MapAccount *account, unsigned long bytes);
+
+/*
+ * Gives back bytes previously charged with `map_account_charge`.
+ *
+ * @param account A pointer to the account.
+ * @param bytes The number of bytes to subtract.
+ */
+void map_account_release(MapAccount *account, unsigned long bytes);
+
+/*
+ * Returns the number of bytes currently charged to an account.
+ *
+ * @param account A pointer to the account.
+ * @return The number of bytes, or 0 if account is invalid.
+ */
+unsigned long map_account_bytes(MapAccount *account);
+
+/*
+ * Returns the name an account was created with.
+ *
+ * @param account A pointer to the account.
+ * @return The name, or NULL if account is invalid.
+ */
+const char *map_account_name(MapAccount *account);
+
+/*
+ * Creates a sampler that finds the most frequently used keys. One in every
+ * rate keys recorded is hashed and counted into a space-saving summary of
+ * capacity counters, which keeps the counts of the most frequent hashes
+ * close while using a fixed amount of memory. Summaries are kept in
+ * several stripes that are merged when reported on, so threads recording
+ * at the same time rarely meet; a sample that does is simply dropped.
+ *
+ * @param rate Sample one in this many keys; 0 or 1 samples every key.
+ * @param capacity The number of counters in each stripe, comfortably more
+ *  than the number of hot keys to be reported.
+ * @param hash_func Hashes the keys of the maps being sampled.
+ * @return A pointer to the sampler, or NULL on failure.
+ */
+MapSampler *map_sampler_create(unsigned int rate, unsigned int capacity, MapHashFunc hash_func);
+
+/*
+ * Frees a sampler. It must no longer be attached to any map.
+ *
+ * @param sampler A pointer to the sampler.
+ */
+void map_sampler_free(MapSampler *sampler);
+
+/*
+ * Attaches a sampler to a map, after which every key passed to `map_get`
+ * and `map_set` is recorded. A map without a sampler pays only for a NULL
+ * check. Several maps, used from any thread, may share one sampler.
+ *
+ * @param map A pointer to the map.
+ * @param sampler A pointer to the sampler, or NULL to stop sampling.
+ * @return 0 on success, -1 if map is invalid.
+ */
+int map_sampler_attach(Map *map, MapSampler *sampler);
+
+/*
+ * Records the use of a key, as attached maps do on every lookup and update.
+ *
+ * @param sampler A pointer to the sampler.
+ * @param key A pointer to the key used.
+ */
+void map_sampler_record(MapSampler *sampler, const void *key);
+
+/*
+ * Reports the most frequently used keys recorded so far, most frequent
+ * first, with counts scaled up by the sampling rate.
+ *
+ * @param sampler A pointer to the sampler.
+ * @param keys An array receiving up to count hot keys.
+ * @param count The size of the keys array.
+ * @return The number of hot keys reported, or -1 on failure.
+ */
+int map_sampler_top(MapSampler *sampler, MapHotKey *keys, unsigned int count);
+
+/*
+ * Forgets everything recorded so far, e.g. to start a new window.
+ *
+ * @param sampler A pointer to the sampler.
+ */
+void map_sampler_reset(MapSampler *sampler);
+
+/*
+ * Creates a tracer writing to a new trace file. Each recorded operation
+ * takes 16 bytes: what it was, the hash of its key and when it happened.
+ * Records are gathered in a buffer shared by all recording threads, which
+ * claim their place in it without locking, and written out a few thousand
+ * at a time. The write happens on the thread that fills the buffer, and
+ * any thread recording meanwhile waits for it to finish, so an operation
+ * on a traced map now and then takes as long as a file write. The
+ * `bench/replay` tool plays traces back.
+ *
+ * @param path The file to write the trace to; it is overwritten.
+ * @param hash_func Hashes the keys of the maps being traced.
+ * @return A pointer to the tracer, or NULL on failure.
+ */
+MapTracer *map_tracer_create(const char *path, MapHashFunc hash_func);
+
+/*
+ * Attaches a tracer to a map, after which every `map_get`, `map_set` and
+ * `map_delete` on it is recorded. Several maps, used from any thread, may
+ * share one tracer.
+ *
+ * @param map A pointer to the map.
+ * @param tracer A pointer to the tracer, or NULL to stop tracing.
+ * @return 0 on success, -1 if map is invalid.
+ */
+int map_tracer_attach(Map *map, MapTracer *tracer);
+
+/*
+ * Records an operation, as attached maps do by themselves.
+ *
+ * @param tracer A pointer to the tracer.
+ * @param op The operation performed.
+ * @param key A pointer to the key it was performed with.
+ */
+void map_tracer_record(MapTracer *tracer, MapTraceOp op, const void *key);
+
+/*
+ * Writes out whatever is still buffered, closes the trace file and frees
+ * the tracer. It must no longer be attached to any map.
+ *
+ * @param tracer A pointer to the tracer.
+ * @return 0 if the whole trace was written, -1 otherwise.
+ */
+int map_tracer_close(MapTracer *tracer);
+
+/*
+ * Reads a trace file written by a tracer.
+ *
+ * @param path The trace file.
+ * @param records Receives a malloc'ed array of the records, which the
+ *  caller frees.
+ * @return The number of records, or -1 on failure.
+ */
+long map_trace_load(const char *path, MapTraceRecord **records);
+
+/*
+ * Makes a map organize itself for skewed lookups, without any hashing.
+ *
+ * With any policy but `MAP_ORGANIZE_NONE`, maps using the built-in string,
+ * int or unsigned int comparators keep a one byte tag per entry (the first
+ * character or the low byte of the key) and lookups only call the
+ * comparator on entries whose tag matches, checking 16 tags at a time
+ * where SSE2 is available.
+ *
+ * With `MAP_ORGANIZE_TRANSPOSE` or `MAP_ORGANIZE_MOVE_TO_FRONT`, every key
+ * found by `map_get` also moves towards the front of the table, so the
+ * most frequently used keys end up being compared first. Moving an entry
+ * invalidates outstanding handles like a delete does, and may make a
+ * `map_scan` in progress visit some entries twice or miss them. Since
+ * `map_get` then changes the map, it must not be called on the same map
+ * from several threads at once, and such maps cannot be shared through a
+ * `MapRef`.
+ *
+ * @param map A pointer to the map.
+ * @param policy How the map should organize itself.
+ * @param threshold For `MAP_ORGANIZE_MOVE_TO_FRONT`, the number of times a
+ *  key must be found before it moves (counted again after each move); 0 or
+ *  1 moves it every time. Ignored by the other policies.
+ * @return 0 on success, -1 on failure (e.g., memory allocation).
+ */
+int map_organize(Map *map, MapOrganizePolicy policy, unsigned int threshold);
+
+/*
+ * Returns the level of vector instructions in use. It is detected once,
+ * when the library is loaded, as the highest the CPU supports; setting the
+ * MAP_CPU_LEVEL environment variable to the name of a lower level (see
+ * `map_cpu_level_name`) caps it, which is handy for comparing kernels in
+ * benchmarks and tests.
+ *
+ * @return The level in use.
+ */
+MapCpuLevel map_cpu_level(void);
+
+/*
+ * Switches every kernel over to the versions for the given level. This is
+ * meant for benchmarks and tests, and must not be called while other
+ * threads are using maps.
+ *
+ * @param level The level to use.
+ * @return 0 on success, -1 if the CPU does not support the level.
+ */
+int map_set_cpu_level(MapCpuLevel level);
+
+/*
+ * Returns the name of a level as accepted by MAP_CPU_LEVEL: "scalar",
+ * "sse2", "sse4.2", "avx2" or "avx512".
+ *
+ * @param level The level.
+ * @return The name, or NULL if level is invalid.
+ */
+const char *map_cpu_level_name(MapCpuLevel level);
+
+/*
+ * Returns the number of threads bulk operations such as `map_save` and
+ * `map_load` spread their work over. It is worked out on first use as the
+ * MAP_THREADS environment variable if set, and otherwise the number of
+ * online processors, at most 64. It is always 1 where there are no POSIX
+ * threads.
+ *
+ * @return The number of threads in use.
+ */
+unsigned int map_threads(void);
+
+/*
+ * Sets the number of threads bulk operations use; 1 does all of the work
+ * on the calling thread and 0 goes back to working it out as described
+ * for `map_threads`. Bulk operations already running are not affected.
+ *
+ * @param threads The number of threads to use, at most 64.
+ * @return 0 on success, -1 if the platform cannot use that many.
+ */
+int map_set_threads(unsigned int threads);
+
+/*
+ * Compresses bytes with the small LZ77 compressor used for snapshot blocks
+ * and for cold values in tiered maps. Like LZ4 it trades ratio for speed,
+ * and it needs no external library.
+ *
+ * @param src The bytes to compress.
+ * @param length The number of bytes in src.
+ * @param dst Receives the compressed bytes.
+ * @param capacity The size of dst. Passing less than length only accepts
+ *  output that saves at least the difference.
+ * @return The compressed length, or 0 if it would not fit in capacity.
+ */
+unsigned int map_lz_compress(const void *src, unsigned int length, void *dst, unsigned int capacity);
+
+/*
+ * Reverses `map_lz_compress`. The original length is not part of the
+ * compressed bytes, so it must be kept alongside them. Malformed input is
+ * rejected without reading or writing out of bounds.
+ *
+ * @param src The compressed bytes.
+ * @param src_length The number of bytes in src.
+ * @param dst Receives the decompressed bytes.
+ * @param length The original length, which is the size of dst.
+ * @return 0 on success, -1 if src is malformed or does not decompress to
+ *  exactly length bytes.
+ */
+int map_lz_decompress(const void *src, unsigned int src_length, void *dst, unsigned int length);
+
+/*
+ * Creates a new, empty bimap: a map in which every value belongs to at
+ * most one key, so that keys can be found from values as cheaply as
+ * values from keys. Both directions are hash indexes over one shared array
+ * of pairs, so each lookup costs a hash and usually a single compare.
+ *
+ * As with `Map`, the bimap only stores pointers; keys and values remain
+ * owned by the caller.
+ *
+ * @param key_compare A pointer to a function used to compare keys.
+ * @param key_hash A hash function consistent with key_compare.
+ * @param value_compare A pointer to a function used to compare values.
+ * @param value_hash A hash function consistent with value_compare.
+ * @return A pointer to the new bimap, or NULL on failure.
+ */
+MapBimap *map_bimap_create(MapKeyCompareFunc key_compare, MapHashFunc key_hash,
+                           MapKeyCompareFunc value_compare, MapHashFunc value_hash);
+
+/*
+ * Frees all memory associated with the bimap, but not the keys and values.
+ *
+ * @param bimap A pointer to the bimap.
+ */
+void map_bimap_free(MapBimap *bimap);
+
+/*
+ * Pairs a key with a value, keeping both directions in step. If the key
+ * already has a value, that value is replaced; if the value already
+ * belongs to another key, that other pair is removed.
+ *
+ * @param bimap A pointer to the bimap.
+ * @param key A pointer to the key.
+ * @param value A pointer to the value.
+ * @return 0 on success, -1 on failure (e.g., memory allocation error), in
+ *  which case the bimap is left unchanged.
+ */
+int map_bimap_set(MapBimap *bimap, void *key, void *value);
+
+/*
+ * Retrieves the value paired with a key.
+ *
+ * @param bimap A pointer to the bimap.
+ * @param key A pointer to the key to look up.
+ * @return A pointer to the value, or NULL if the key is not found.
+ */
+void *map_bimap_get(MapBimap *bimap, const void *key);
+
+/*
+ * Retrieves the key paired with a value.
+ *
+ * @param bimap A pointer to the bimap.
+ * @param value A pointer to the value to look up.
+ * @return A pointer to the key, or NULL if the value is not found.
+ */
+void *map_bimap_get_key(MapBimap *bimap, const void *value);
+
+/*
+ * Removes the pair holding a key.
+ *
+ * @param bimap A pointer to the bimap.
+ * @param key A pointer to the key to remove.
+ */
+void map_bimap_delete(MapBimap *bimap, const void *key);
+
+/*
+ * Removes the pair holding a value.
+ *
+ * @param bimap A pointer to the bimap.
+ * @param value A pointer to the value to remove.
+ */
+void map_bimap_delete_value(MapBimap *bimap, const void *value);
+
+/*
+ * Returns the number of pairs in the bimap.
+ *
+ * @param bimap A pointer to the bimap
+ * @return an integer indicating how many pairs are held, or -1 if
+ *  bimap is invalid
+ */
+int map_bimap_get_size(MapBimap *bimap);
+
+/*
+ * Attaches a secondary index to a map, so entries can be found by a field
+ * of their values in constant time instead of by scanning. The index is
+ * built from the entries already in the map and kept up to date by
+ * `map_set`, `map_delete`, `map_merge`, `map_group_by` and the handle
+ * functions. A map may carry several indexes.
+ *
+ * A unique index refuses to hold the same field for two keys: a change
+ * that would do so fails with -1 and leaves the map untouched, except
+ * that `map_group_by` keeps the groups it stored before the failure. A
+ * value changed in place must be stored again with `map_set` for its
+ * indexes to notice.
+ *
+ * Indexes are freed along with their map and are not copied by
+ * `map_clone`.
+ *
+ * @param map A pointer to the map.
+ * @param field_func Extracts the indexed field of an entry.
+ * @param context An opaque pointer handed to each call of field_func.
+ * @param compare_func Compares two fields; 0 means equal.
+ * @param hash_func A hash function for fields consistent with compare_func.
+ * @param unique Non-zero to allow each field to belong to one key only.
+ * @return A pointer to the new index, or NULL on failure, including when a
+ *  unique index would already have a duplicate.
+ */
+MapIndex *map_index_create(Map *map, MapFieldFunc field_func, void *context,
+                           MapKeyCompareFunc compare_func, MapHashFunc hash_func, int unique);
+
+/*
+ * Detaches a secondary index from its map and frees it.
+ *
+ * @param index A pointer to the index.
+ */
+void map_index_free(MapIndex *index);
+
+/*
+ * Retrieves the value of an entry whose field equals field. Meant for
+ * unique indexes; with a non-unique one any of the matching entries may
+ * be returned.
+ *
+ * @param index A pointer to the index.
+ * @param field A pointer to the field to look up.
+ * @return A pointer to the value, or NULL if no entry matches.
+ */
+void *map_index_get(MapIndex *index, const void *field);
+
+/*
+ * Finds every entry whose field equals field, storing the keys and values
+ * of the first count of them, in no particular order.
+ *
+ * @param index A pointer to the index.
+ * @param field A pointer to the field to look up.
+ * @param keys Receives the matching keys, or NULL if not needed.
+ * @param values Receives the matching values, or NULL if not needed.
+ * @param count The number of slots in keys and values.
+ * @return The number of matching entries, which may exceed count, or -1
+ *  if index is invalid.
+ */
+int map_index_find(MapIndex *index, const void *field, void **keys, void **values,
+                   unsigned int count);
+
+/*
+ * Creates a sketch for counting events per key when there are too many
+ * distinct keys to count exactly, e.g. requests per client address. It is
+ * a count-min sketch with conservative update: depth rows of width
+ * counters, in which each key has one counter per row. Estimates never
+ * understate a count, and overstate it by more than e / width of the total
+ * counted only with probability e^-depth. Alongside it the top keys with
+ * the highest estimates are tracked, so the heaviest hitters can be
+ * listed. Memory is fixed at creation, and counting a key costs the same
+ * whatever the number of keys seen. Rows are updated together with the
+ * vector kernels where the CPU allows (see `map_cpu_level`).
+ *
+ * Like a map, a sketch must not be used from several threads at once.
+ *
+ * @param width The number of counters per row, rounded up to a power of
+ *  two; at most 2^27.
+ * @param depth The number of rows, from 1 to 8.
+ * @param top The number of heavy hitters to track, or 0 for none.
+ * @param hash_func Hashes the keys counted. Keys with equal hashes are
+ *  counted as one.
+ * @return A pointer to the sketch, or NULL on failure.
+ */
+MapSketch *map_sketch_create(unsigned int width, unsigned int depth, unsigned int top,
+                             MapHashFunc hash_func);
+
+/*
+ * Frees a sketch.
+ *
+ * @param sketch A pointer to the sketch.
+ */
+void map_sketch_free(MapSketch *sketch);
+
+/*
+ * Counts amount more events for key.
+ *
+ * @param sketch A pointer to the sketch.
+ * @param key A pointer to the key.
+ * @param amount The number of events to add, usually 1.
+ * @return The key's estimated count after adding, or 0 if sketch is
+ *  invalid.
+ */
+unsigned long map_sketch_increment(MapSketch *sketch, const void *key, unsigned long amount);
+
+/*
+ * Estimates how many events were counted for key.
+ *
+ * @param sketch A pointer to the sketch.
+ * @param key A pointer to the key.
+ * @return The estimated count, 0 if the key was never counted or sketch
+ *  is invalid.
+ */
+unsigned long map_sketch_get(MapSketch *sketch, const void *key);
+
+/*
+ * Reports the heavy hitters, highest estimate first. Keys are known by
+ * their hash, and error is the sketch's probable bound on how far each
+ * count may be overstated.
+ *
+ * @param sketch A pointer to the sketch.
+ * @param keys An array receiving up to count hot keys.
+ * @param count The size of the keys array.
+ * @return The number of hot keys reported, or -1 on failure.
+ */
+int map_sketch_top(MapSketch *sketch, MapHotKey *keys, unsigned int count);
+
+/*
+ * Forgets everything counted so far, e.g. to start a new window.
+ *
+ * @param sketch A pointer to the sketch.
+ */
+void map_sketch_reset(MapSketch *sketch);
+
+/*
+ * Looks up a key once and returns a handle to its entry, so that the value
+ * can be read, replaced or the entry removed without searching again.
+ *
+ * @param map A pointer to the map.
+ * @param key A pointer to the key to look up.
+ * @return A handle to the entry; if the key is not found (or map is invalid)
+ *  the handle will fail `map_handle_valid`.
+ */
+MapEntryHandle map_find(Map *map, const void *key);
+
+/*
+ * Checks whether a handle still refers to the entry it was created for.
+ *
+ * @param map A pointer to the map the handle came from.
+ * @param handle A handle obtained from `map_find`.
+ * @return 1 if the handle can be used, 0 if it is stale or was never valid
+ */
+int map_handle_valid(Map *map, MapEntryHandle handle);
+
+/*
+ * Retrieves the value of the entry a handle refers to.
+ *
+ * @param map A pointer to the map the handle came from.
+ * @param handle A handle obtained from `map_find`.
+ * @return A pointer to the value, or NULL if the handle is not valid.
+ */
+void *map_handle_value(Map *map, MapEntryHandle handle);
+
+/*
+ * Replaces the value of the entry a handle refers to. The handle remains
+ * valid afterwards.
+ *
+ * @param map A pointer to the map the handle came from.
+ * @param handle A handle obtained from `map_find`.
+ * @param value A pointer to the new value.
+ * @return 0 on success, -1 if the handle is not valid.
+ */
+int map_handle_set(Map *map, MapEntryHandle handle, void *value);
+
+/*
+ * Removes the entry a handle refers to. This invalidates the handle along
+ * with every other outstanding handle into the same map.
+ *
+ * @param map A pointer to the map the handle came from.
+ * @param handle A handle obtained from `map_find`.
+ * @return 0 on success, -1 if the handle is not valid.
+ */
+int map_handle_erase(Map *map, MapEntryHandle handle);
+
+/*
+ * Incrementally walks the entries of a map, visiting at most `count` of them
+ * per call. Start a scan with a cursor of 0 and keep passing back the value
+ * returned until it is 0 again, at which point the scan is complete.
+ *
+ * Entries are walked from the end of the table towards the front. Since
+ * `map_set` only ever appends and `map_delete` only shifts the entries after
+ * the removed one, every entry present for the whole duration of a scan is
+ * visited at least once even if the map grows or shrinks between calls. An
+ * entry may be visited more than once if entries before it are deleted
+ * mid-scan, and entries added mid-scan may or may not be visited.
+ *
+ * The exception is a map organized with `MAP_ORGANIZE_TRANSPOSE` or
+ * `MAP_ORGANIZE_MOVE_TO_FRONT`, where every `map_get` may move entries
+ * around (see `map_organize`). A lookup between two calls can then make
+ * the scan visit an entry twice or miss one entirely, so avoid lookups on
+ * such a map while scanning it, or organize it with a different policy
+ * for the duration.
+ *
+ * No state is held between calls, so a scan may be abandoned at any time.
+ *
+ * @param map A pointer to the map.
+ * @param cursor 0 to begin a scan, otherwise the value previously returned.
+ * @param count The maximum number of entries to visit; 0 means 10.
+ * @param callback The function invoked for each visited entry.
+ * @param context An opaque pointer handed to each invocation of callback.
+ * @return The cursor to pass to the next call, or 0 if the scan is done.
+ */
+unsigned int map_scan(Map *map, unsigned int cursor, unsigned int count,
+                      MapScanFunc callback, void *context);
+
 #endif /* MAP_H */
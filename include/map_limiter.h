@@ -0,0 +1,83 @@
+#ifndef MAP_LIMITER_H
+#define MAP_LIMITER_H
+
+/*
+ * A fixed capacity table of per-key rate limits, e.g. one per API client,
+ * that many threads can check at once. Each key is limited to `limit`
+ * requests per `period`, with bursts of up to `limit` requests, using the
+ * generic cell rate algorithm: a key's whole state is the time at which
+ * its next request would be exactly on schedule, kept inline in its slot
+ * of an open addressing hash table.
+ *
+ * Checking a key that is already in the table takes no lock; it is one
+ * probe followed by a compare-and-swap of that time. Adding a new key and
+ * sweeping out idle ones take a mutex, so they never race each other.
+ * A key is idle once its allowance has fully refilled, so sweeping it out
+ * changes nothing about how later requests for it are treated.
+ *
+ * Keys are copied into the table as bytes, up to a size chosen at
+ * creation. This is POSIX only; link with -lpthread.
+ */
+typedef struct MapLimiter MapLimiter;
+
+/*
+ * Creates a new, empty rate limiter.
+ *
+ * @param capacity The maximum number of keys tracked at once.
+ * @param key_size The maximum length of a key in bytes.
+ * @param limit The number of requests a key may make per period.
+ * @param period_us The length of the period in microseconds. Requests are
+ *  spaced at least a microsecond apart on average, so period_us should be
+ *  no less than limit.
+ * @return A pointer to the limiter, or NULL on failure.
+ */
+MapLimiter *map_limiter_create(unsigned int capacity, unsigned int key_size,
+                               unsigned int limit, unsigned long period_us);
+
+/*
+ * Frees the limiter. No other thread may be using it at the time.
+ *
+ * @param limiter A pointer to the limiter.
+ */
+void map_limiter_free(MapLimiter *limiter);
+
+/*
+ * Decides whether a request costing cost units may go ahead for key, and
+ * if so counts it. A key not seen before (or swept out since) starts with
+ * its full allowance.
+ *
+ * @param limiter A pointer to the limiter.
+ * @param key A pointer to the key's bytes.
+ * @param key_len The length of the key in bytes.
+ * @param cost The number of requests this one counts as, usually 1. A
+ *  cost above the limit is never allowed.
+ * @param retry_us If not NULL, receives how many microseconds to wait
+ *  before the request would be allowed, or 0 if it was allowed.
+ * @return 1 if the request is allowed, 0 if it is over the limit, or -1
+ *  on error (the key is too long or the table is full).
+ */
+int map_limiter_check(MapLimiter *limiter, const void *key, unsigned int key_len,
+                      unsigned int cost, unsigned long *retry_us);
+
+/*
+ * Removes idle keys, walking the next count slots of the table on each
+ * call and starting over once all have been seen, so it can be called a
+ * little at a time from a timer or a background thread while other
+ * threads keep checking keys.
+ *
+ * @param limiter A pointer to the limiter.
+ * @param count The number of slots to visit.
+ * @return The number of keys removed, or -1 if limiter is invalid.
+ */
+int map_limiter_sweep(MapLimiter *limiter, unsigned int count);
+
+/*
+ * Returns the number of keys currently tracked.
+ *
+ * @param limiter A pointer to the limiter
+ * @return an integer indicating how many keys are tracked, or -1 if
+ *  limiter is invalid
+ */
+int map_limiter_get_size(MapLimiter *limiter);
+
+#endif /* MAP_LIMITER_H */
@@ -0,0 +1,108 @@
+#ifndef MAP_SHM_H
+#define MAP_SHM_H
+
+/*
+ * A fixed capacity map that lives entirely inside a shared memory segment
+ * so that several processes can share a single copy of it. Unlike `Map`,
+ * which only stores pointers, a shared map copies the bytes of each key and
+ * value into the segment, since a pointer from one process means nothing in
+ * another. Everything inside the segment is addressed relative to its start.
+ *
+ * Updates are serialized by a process-shared mutex and published through a
+ * sequence counter, so lookups never take a lock; they copy the value out
+ * and simply retry if a writer was active at the same time.
+ *
+ * This is POSIX only. Link with -lpthread (and -lrt on older glibc).
+ */
+typedef struct MapShm MapShm;
+
+/*
+ * Creates and initializes a new shared map.
+ *
+ * When name is not NULL, a named segment is created with `shm_open` (the
+ * name must start with a '/' and must not exist yet) that other processes
+ * can attach to with `map_shm_open`. When name is NULL, an anonymous shared
+ * mapping is used instead which is shared with children created by `fork`.
+ *
+ * @param name The name of the segment, or NULL for an anonymous one.
+ * @param capacity The maximum number of entries the map can hold.
+ * @param key_size The maximum length of a key in bytes.
+ * @param value_size The maximum length of a value in bytes.
+ * @return A pointer to the shared map, or NULL on failure.
+ */
+MapShm *map_shm_create(const char *name, unsigned int capacity,
+                       unsigned int key_size, unsigned int value_size);
+
+/*
+ * Attaches to a shared map previously created by another process.
+ *
+ * @param name The name the segment was created with.
+ * @return A pointer to the shared map, or NULL on failure.
+ */
+MapShm *map_shm_open(const char *name);
+
+/*
+ * Detaches from a shared map. The segment itself lives on until it has been
+ * unlinked and every process has detached.
+ *
+ * @param shm A pointer to the shared map.
+ */
+void map_shm_close(MapShm *shm);
+
+/*
+ * Removes the name of a shared map so no further process can attach to it.
+ *
+ * @param name The name the segment was created with.
+ * @return 0 on success, -1 on failure.
+ */
+int map_shm_unlink(const char *name);
+
+/*
+ * Copies a key and value into the shared map. If the key already exists,
+ * the old value is replaced with the new value.
+ *
+ * @param shm A pointer to the shared map.
+ * @param key A pointer to the key bytes.
+ * @param key_len The length of the key, at most the map's key size.
+ * @param value A pointer to the value bytes.
+ * @param value_len The length of the value, at most the map's value size.
+ * @return 0 on success, -1 on failure (e.g., the map is full or the key or
+ *  value is too large).
+ */
+int map_shm_set(MapShm *shm, const void *key, unsigned int key_len,
+                const void *value, unsigned int value_len);
+
+/*
+ * Copies the value associated with a key out of the shared map. This never
+ * blocks on writers.
+ *
+ * @param shm A pointer to the shared map.
+ * @param key A pointer to the key bytes.
+ * @param key_len The length of the key.
+ * @param value A buffer at least the map's value size long.
+ * @param value_len Receives the length of the value, may be NULL.
+ * @return 0 if the key was found, -1 otherwise.
+ */
+int map_shm_get(MapShm *shm, const void *key, unsigned int key_len,
+                void *value, unsigned int *value_len);
+
+/*
+ * Removes a key and its value from the shared map.
+ *
+ * @param shm A pointer to the shared map.
+ * @param key A pointer to the key bytes.
+ * @param key_len The length of the key.
+ * @return 0 if the key was removed, -1 if it was not found.
+ */
+int map_shm_delete(MapShm *shm, const void *key, unsigned int key_len);
+
+/*
+ * Returns the currently occupied size of the given shared map.
+ *
+ * @param shm A pointer to the shared map
+ * @return an integer indicating how much is used, or -1 if
+ *  shm is invalid
+ */
+int map_shm_get_size(MapShm *shm);
+
+#endif /* MAP_SHM_H */
@@ -0,0 +1,71 @@
+#ifndef MAP_SKIPLIST_H
+#define MAP_SKIPLIST_H
+
+#include "map.h"
+
+/*
+ * An ordered map that many threads can read and write at once without
+ * locks, built as a lock-free skip list. Keys are kept sorted by the
+ * comparator, so besides the usual lookups it supports walking the entries
+ * of a key range in order while other threads keep writing.
+ *
+ * The map is used through the function pointers of the `Map` it returns
+ * (`map->set(map, key, value)` and so on), which are safe to call from any
+ * number of threads. The `map_*` functions of map.h only work on maps made
+ * by `map_create` and must not be given a skip list.
+ *
+ * Thread safety rests on GCC style atomic builtins (GCC and clang). Built
+ * with any other compiler the list falls back to plain loads and stores
+ * and must then only be used from one thread at a time.
+ *
+ * Removed entries are freed with epoch based reclamation: every operation
+ * runs inside an epoch, and an entry's memory is only released once every
+ * operation that might still be looking at it has finished. As with `Map`,
+ * keys and values are owned by the caller; a key or value must stay valid
+ * until its entry has been removed or replaced and all operations running
+ * at that time have returned.
+ */
+
+/*
+ * Creates a new, empty skip list.
+ *
+ * The comparator must order keys, returning a negative number, 0 or a
+ * positive number as `strcmp` does; all built-in comparators except
+ * `map_compare_ptr_keys` do.
+ *
+ * @param compare_func A pointer to a function used to order keys.
+ * @return A pointer to the new map, or NULL if allocation fails.
+ */
+Map *map_skiplist_create(MapKeyCompareFunc compare_func);
+
+/*
+ * Frees all memory associated with the skip list. No other thread may be
+ * using the map at the time.
+ *
+ * NOTE: This does not free the memory for the keys and values themselves,
+ * as the map only stores pointers. That is the responsibility of the user.
+ *
+ * @param map A pointer to a map made by `map_skiplist_create`.
+ */
+void map_skiplist_free(Map *map);
+
+/*
+ * Visits the entries whose keys lie in [from, to) in ascending order.
+ *
+ * The walk is safe against concurrent writes and consistent in the usual
+ * sense for concurrent ordered maps: every entry in the range that is
+ * present for the whole walk is visited exactly once, keys are always
+ * visited in increasing order, and entries added or removed during the
+ * walk may or may not be seen. The callback may itself use the map.
+ *
+ * @param map A pointer to a map made by `map_skiplist_create`.
+ * @param from The first key of the range, or NULL to start at the lowest.
+ * @param to The key the range stops before, or NULL to go to the end.
+ * @param callback The function invoked for each visited entry.
+ * @param context An opaque pointer handed to each invocation of callback.
+ * @return The number of entries visited, or -1 if map is invalid.
+ */
+int map_skiplist_range(Map *map, const void *from, const void *to,
+                       MapScanFunc callback, void *context);
+
+#endif /* MAP_SKIPLIST_H */
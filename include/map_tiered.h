@@ -0,0 +1,140 @@
+#ifndef MAP_TIERED_H
+#define MAP_TIERED_H
+
+#include "map.h"
+
+/*
+ * A map for data sets larger than memory. Recently used entries are kept
+ * in a regular in-memory `Map` whose size is held within a byte budget;
+ * once the budget is exceeded, the least recently used entries are spilled
+ * to files on disk and transparently brought back into memory when they
+ * are looked up again.
+ *
+ * Spilled entries are spread over a fixed number of partition files by the
+ * hash of their serialized key. Each partition is an append-only log with
+ * a small in-memory index of key hash to file offset, so finding a spilled
+ * entry costs one read. A partition is compacted once most of its file is
+ * taken up by entries that have since been removed or brought back.
+ *
+ * Values that have gone cold can also be compressed in memory, which lets
+ * far more entries fit in the budget before any are spilled.
+ *
+ * Unlike `Map`, a tiered map owns its keys and values, since it must free
+ * them when they are spilled; the free functions given at creation are
+ * used for that.
+ */
+typedef struct MapTiered MapTiered;
+
+/*
+ * Function pointer type used to release a key or value owned by a map.
+ */
+typedef void (*MapFreeFunc)(void *item);
+
+/*
+ * Creates a new tiered map.
+ *
+ * The memory budget is measured in the serialized size of the entries in
+ * memory plus the map's own per entry overhead, which is what the codec
+ * can tell about them.
+ *
+ * @param compare_func A pointer to a function used to compare keys.
+ * @param codec How to turn keys and values into bytes and back; all four
+ *  functions are required.
+ * @param free_key Releases keys owned by the map, or NULL to never free.
+ * @param free_value Releases values owned by the map, or NULL to never free.
+ * @param memory_budget The number of bytes entries in memory may take up.
+ * @param directory An existing directory to hold the partition files.
+ * @return A pointer to the new map, or NULL on failure.
+ */
+MapTiered *map_tiered_create(MapKeyCompareFunc compare_func, const MapCodec *codec,
+                             MapFreeFunc free_key, MapFreeFunc free_value,
+                             unsigned long memory_budget, const char *directory);
+
+/*
+ * Frees the map along with every key and value it owns, and removes its
+ * partition files.
+ *
+ * @param tiered A pointer to the map.
+ */
+void map_tiered_free(MapTiered *tiered);
+
+/*
+ * Associates a value with a key, taking ownership of both. If the key
+ * already exists, the old value is freed and replaced, and the key passed
+ * in is freed in favour of the one already held.
+ *
+ * @param tiered A pointer to the map.
+ * @param key A pointer to the key.
+ * @param value A pointer to the value.
+ * @return 0 on success, -1 on failure (e.g., memory allocation or I/O
+ *  error).
+ */
+int map_tiered_set(MapTiered *tiered, void *key, void *value);
+
+/*
+ * Retrieves the value associated with a key, bringing it back into memory
+ * first if it was spilled. The value belongs to the map and may be spilled
+ * (and freed) by any later call that adds entries to memory, so copy out
+ * whatever is needed before making another call.
+ *
+ * @param tiered A pointer to the map.
+ * @param key A pointer to the key to look up.
+ * @return A pointer to the value, or NULL if the key is not found.
+ */
+void *map_tiered_get(MapTiered *tiered, const void *key);
+
+/*
+ * Removes a key and its value from the map, freeing both.
+ *
+ * @param tiered A pointer to the map.
+ * @param key A pointer to the key to remove.
+ */
+void map_tiered_delete(MapTiered *tiered, const void *key);
+
+/*
+ * Compresses the values of cold entries in memory, walking the next count
+ * entries on each call and starting over once all have been seen, so it
+ * can be called a little at a time from an idle loop or timer. An entry
+ * is cold when it was looked up fewer than threshold times since the
+ * previous pass over it; each pass halves the counts so that only recent
+ * lookups count. A compressed value is decompressed again the next time
+ * it is looked up and stays that way until it goes cold once more.
+ *
+ * Values freed by compression are gone just as if they had been spilled,
+ * so the same rules apply to pointers returned by `map_tiered_get`.
+ *
+ * @param tiered A pointer to the map.
+ * @param threshold Entries looked up fewer times than this are compressed.
+ * @param count The number of entries to visit.
+ * @return The number of values compressed, or -1 on failure.
+ */
+int map_tiered_compress_cold(MapTiered *tiered, unsigned int threshold, unsigned int count);
+
+/*
+ * Returns the number of entries held, in memory and on disk.
+ *
+ * @param tiered A pointer to the map
+ * @return an integer indicating how much is used, or -1 if
+ *  tiered is invalid
+ */
+int map_tiered_get_size(MapTiered *tiered);
+
+/*
+ * Returns the number of entries currently spilled to disk.
+ *
+ * @param tiered A pointer to the map
+ * @return an integer indicating how many entries are on disk, or -1 if
+ *  tiered is invalid
+ */
+int map_tiered_get_spilled_size(MapTiered *tiered);
+
+/*
+ * Returns the number of entries in memory whose values are compressed.
+ *
+ * @param tiered A pointer to the map
+ * @return an integer indicating how many values are compressed, or -1 if
+ *  tiered is invalid
+ */
+int map_tiered_get_compressed_size(MapTiered *tiered);
+
+#endif /* MAP_TIERED_H */
@@ -1,8 +1,42 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <time.h>
 #include "map.h"
 
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+#define MAP_HAVE_SSE2 1
+#include <emmintrin.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MAP_HAVE_AVX2 1
+#define MAP_HAVE_AVX512 1
+#include <immintrin.h>
+#endif
+#endif
+
+/*
+ * POSIX facilities used outside of bgsave, such as sched_yield, the
+ * monotonic clock and threads. These do not depend on bgsave being
+ * available.
+ */
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#define MAP_HAVE_POSIX 1
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#ifdef MAP_HAVE_BGSAVE
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#endif
+
 /*
  * Internal structure for a single key-value entry.
  */
@@ -19,27 +53,237 @@ typedef struct MapImpl {
     MapEntry *entries;
     unsigned int size;
     unsigned int capacity;
+    unsigned int generation;
     MapKeyCompareFunc compare_func;
+    MapAccount *account;
+    MapSampler *sampler;
+    MapTracer *tracer;
+    MapOrganizePolicy organize;
+    unsigned int threshold;
+    unsigned char *tags;
+    unsigned int *hits;
+    MapIndex *indexes;
 } MapImpl;
 
+/*
+ * Atomic operations used where maps are shared between threads. Platforms
+ * without GCC style builtins are assumed to run single threaded.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define MAP_ATOMIC_LOAD(p)        __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define MAP_ATOMIC_STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define MAP_ATOMIC_EXCHANGE(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define MAP_ATOMIC_ADD(p, v)      __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define MAP_ATOMIC_SUB(p, v)      __atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define MAP_ATOMIC_CAS(p, e, v)   \
+    __atomic_compare_exchange_n((p), (e), (v), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#else
+#define MAP_ATOMIC_LOAD(p)        (*(p))
+#define MAP_ATOMIC_STORE(p, v)    (*(p) = (v))
+#define MAP_ATOMIC_EXCHANGE(p, v) map_plain_exchange((void **)(p), (v))
+#define MAP_ATOMIC_ADD(p, v)      (*(p) += (v))
+#define MAP_ATOMIC_SUB(p, v)      (*(p) -= (v))
+#define MAP_ATOMIC_CAS(p, e, v)   \
+    (*(p) == *(e) ? (*(p) = (v), 1) : (*(e) = *(p), 0))
+
+static void *map_plain_exchange(void **p, void *v) {
+    void *old = *p;
+    *p = v;
+    return old;
+}
+#endif
+
+/*
+ * Gives up the processor while spinning on other threads, so that a waiter
+ * does not starve the very threads it is waiting for.
+ */
+#ifdef MAP_HAVE_POSIX
+#define MAP_YIELD() sched_yield()
+#else
+#define MAP_YIELD() ((void)0)
+#endif
+
+/*
+ * Bulk operations spread their work over threads where there are both
+ * POSIX threads and the atomics to hand work out between them.
+ */
+#if defined(MAP_HAVE_POSIX) && (defined(__GNUC__) || defined(__clang__))
+#define MAP_HAVE_THREADS 1
+#endif
+
+/* Keeps the reader counters of a MapRef on separate cache lines */
+#define MAP_CACHE_LINE 64
+
+/*
+ * The vectorized kernels, bound once to the best versions the CPU supports
+ * (see CPU Dispatch below).
+ */
+typedef struct {
+    int (*compare_strings)(const unsigned char *s1, const unsigned char *s2, int ignore_case);
+    int (*compare_bytes)(const unsigned char *b1, const unsigned char *b2, size_t length);
+    unsigned long long (*match_tags)(const unsigned char *tags, unsigned char tag);
+    unsigned int (*crc32c)(unsigned int crc, const unsigned char *data, size_t length);
+    unsigned long long (*sketch_add)(unsigned long long *counters, const unsigned int *cells,
+                                     unsigned int depth, unsigned long long amount);
+} MapKernels;
+
+static const MapKernels *map_kernels(void);
+
+/*
+ * The internal structure behind a MapRef. Readers count themselves into
+ * the slot matching the epoch they entered in; a swap moves on to the next
+ * epoch and waits for the previous epoch's slot to drain.
+ */
+struct MapRef {
+    Map *current;
+    unsigned int epoch;
+    unsigned int swapping;
+    struct {
+        unsigned int count;
+        char padding[MAP_CACHE_LINE - sizeof(unsigned int)];
+    } readers[2];
+};
+
+/*
+ * The internal structure behind a MapAccount. Maps of any thread may
+ * charge the same account, so its byte count is only updated atomically.
+ */
+struct MapAccount {
+    char *name;
+    unsigned long bytes;
+    unsigned long soft_limit;
+    unsigned long hard_limit;
+    MapBudgetFunc over_soft_limit;
+    void *context;
+};
+
+/* Samples are spread over this many independently locked summaries */
+#define MAP_SAMPLER_STRIPES 8
+
+/*
+ * One counter of a space-saving summary: the hash it tracks, how often it
+ * was sampled and by how much that may be overstated.
+ */
+typedef struct SamplerCounter {
+    unsigned int hash;
+    unsigned long count;
+    unsigned long error;
+} SamplerCounter;
+
+/*
+ * The internal structure behind a MapSampler. Threads sampling at the same
+ * time each take a different stripe, and a sample is simply dropped when
+ * its stripe is busy, so recording never waits.
+ */
+struct MapSampler {
+    MapHashFunc hash_func;
+    unsigned int rate;
+    unsigned int capacity;
+    unsigned int ticks;
+    struct {
+        unsigned int busy;
+        unsigned int used;
+        SamplerCounter *counters;
+        char padding[MAP_CACHE_LINE - 2 * sizeof(unsigned int) - sizeof(SamplerCounter *)];
+    } stripes[MAP_SAMPLER_STRIPES];
+};
+
 /* --- Private Helper Function --- */
 
-char *str_lower(char *s) {
-  while (*s)
-    *s++ = tolower(*s);
+/*
+ * Whether the keys of a comparator can be tagged; see key_tag.
+ */
+static int taggable(MapKeyCompareFunc compare_func) {
+    return compare_func == map_compare_string_keys ||
+           compare_func == map_compare_string_keys_ignoring_case ||
+           compare_func == map_compare_sized_keys ||
+           compare_func == map_compare_int_keys ||
+           compare_func == map_compare_uint_keys;
+}
 
-  return s;
+/*
+ * Folds an ASCII letter to lower case when asked to. Only ASCII is folded,
+ * whatever the locale, so that the byte-at-a-time and vector comparisons
+ * always agree.
+ */
+static int fold_case(int c, int ignore_case) {
+    return ignore_case && c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
 }
 
 /*
- * Finds the index of an entry by its key.
+ * Works out the one byte tag of a key that self-organizing maps keep next
+ * to every entry: the first byte of a string or the low byte of an
+ * integer. Keys that compare equal always get the same tag, so entries
+ * with a different tag can be skipped without calling the comparator.
+ */
+static void key_tag(MapKeyCompareFunc compare_func, const void *key, unsigned char *tag) {
+    if (compare_func == map_compare_string_keys) {
+        *tag = *(const unsigned char *)key;
+    }
+    else if (compare_func == map_compare_string_keys_ignoring_case) {
+        *tag = (unsigned char)fold_case(*(const unsigned char *)key, 1);
+    }
+    else if (compare_func == map_compare_sized_keys) {
+        *tag = ((const MapSizedKey *)key)->length
+            ? *(const unsigned char *)((const MapSizedKey *)key)->bytes : 0;
+    }
+    else {
+        *tag = (unsigned char)(*(const unsigned int *)key & 0xff);
+    }
+}
+
+/*
+ * Finds the index of an entry by its key among the first limit entries of
+ * a tagged map, only calling the comparator for entries with a matching
+ * tag. The tags of 64 entries are checked at once by the tag kernel.
  * Returns -1 if the key is not found.
  */
-static int find_entry_index(Map *map, const void *key) {
-    MapImpl *impl = (MapImpl*)map;
+static int find_tagged_index_below(MapImpl *impl, const void *key, unsigned int limit) {
+    unsigned char tag = 0;
+    unsigned int i = 0;
+#ifdef MAP_HAVE_SSE2
+    const MapKernels *kernels = map_kernels();
+    unsigned long long mask;
+    unsigned int bit;
+#endif
+
+    key_tag(impl->compare_func, key, &tag);
+
+#ifdef MAP_HAVE_SSE2
+    for (; i + 64 <= limit; i += 64) {
+        mask = kernels->match_tags(impl->tags + i, tag);
+
+        while (mask) {
+            bit = (unsigned int)__builtin_ctzll(mask);
+            if (impl->compare_func(impl->entries[i + bit].key, key) == 0) {
+                return (int)(i + bit);
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i < limit; ++i) {
+        if (impl->tags[i] == tag && impl->compare_func(impl->entries[i].key, key) == 0) {
+            return (int)i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Finds the index of an entry by its key, looking only at the first limit
+ * entries. Returns -1 if the key is not found.
+ */
+static int find_entry_index_below(MapImpl *impl, const void *key, unsigned int limit) {
     unsigned int i;
 
-    for (i = 0; i < impl->size; ++i) {
+    if (impl->tags) {
+        return find_tagged_index_below(impl, key, limit);
+    }
+
+    for (i = 0; i < limit; ++i) {
         if (impl->compare_func(impl->entries[i].key, key) == 0) {
             return i;
         }
@@ -48,181 +292,4687 @@ static int find_entry_index(Map *map, const void *key) {
     return -1;
 }
 
-/* --- Public API Functions --- */
-
-int map_compare_string_keys(const void *key1, const void *key2) {
-  const char *string1 = (const char *)key1;
-  const char *string2 = (const char *)key2;
+/*
+ * Finds the index of an entry by its key.
+ * Returns -1 if the key is not found.
+ */
+static int find_entry_index(Map *map, const void *key) {
+    MapImpl *impl = (MapImpl*)map;
 
-  return strcmp(string1, string2);
+    return find_entry_index_below(impl, key, impl->size);
 }
 
-int map_compare_string_keys_ignoring_case(const void *key1, const void *key2) {
-  char *string1 = NULL;
-  char *string2 = NULL;
-  int result = -2;
+/*
+ * Finds the index of an entry by its key, trying the index hint first.
+ * Returns -1 if the key is not found.
+ */
+static int find_entry_index_near(MapImpl *impl, const void *key, int hint) {
+    if (hint >= 0 && (unsigned int)hint < impl->size &&
+        impl->compare_func(impl->entries[hint].key, key) == 0) {
+        return hint;
+    }
 
-  string1 = key1 ? str_lower(strdup(key1)) : (char*)key1;
-  string2 = key2 ? str_lower(strdup(key2)) : (char*)key2;
+    return find_entry_index_below(impl, key, impl->size);
+}
 
-  result = map_compare_string_keys(string1, string2);
+/*
+ * Whether lookups on a map move its entries, which makes map_get a write.
+ */
+static int map_reorders(const Map *map) {
+    const MapImpl *impl = (const MapImpl*)map;
 
-  if (string1 && key1 && ((void *)string1 != key1)) {
-    /* free(string1); */
-  }
+    return map && (impl->organize == MAP_ORGANIZE_TRANSPOSE ||
+                   impl->organize == MAP_ORGANIZE_MOVE_TO_FRONT);
+}
 
-  if (string2 && key2 && ((void *)string2 != key2)) {
-    /* free(string2); */
-  }
+/*
+ * The number of bytes each slot of the entry table takes up, including the
+ * tag and hit count kept alongside by self-organizing maps.
+ */
+static unsigned long slot_bytes(MapImpl *impl) {
+    return sizeof(MapEntry) + (impl->tags ? 1 : 0) + (impl->hits ? sizeof(unsigned int) : 0);
+}
 
-  return result;
+/*
+ * The number of bytes a map itself takes up, which is what it charges to
+ * its account.
+ */
+static unsigned long table_bytes(MapImpl *impl) {
+    return sizeof(MapImpl) + (unsigned long)impl->capacity * slot_bytes(impl);
 }
 
-int map_compare_int_keys(const void *intPtr1, const void *intPtr2) {
-  int int1 = *((const int *)intPtr1);
-  int int2 = *((const int *)intPtr2);
+/*
+ * Charges bytes to an account, giving its soft limit callback a chance to
+ * free memory first. Returns 0 on success, -1 if the charge would take
+ * the account over its hard limit.
+ */
+static int charge_account(MapAccount *account, unsigned long bytes) {
+    unsigned long total;
+
+    if (!account || bytes == 0) {
+        return 0;
+    }
 
-  return int1 == int2 ? 0 : -1;
+    total = MAP_ATOMIC_LOAD(&account->bytes) + bytes;
+    if (account->soft_limit && total > account->soft_limit && account->over_soft_limit) {
+        account->over_soft_limit(account, total, account->context);
+    }
+
+    total = MAP_ATOMIC_ADD(&account->bytes, bytes);
+    if (account->hard_limit && total > account->hard_limit) {
+        MAP_ATOMIC_SUB(&account->bytes, bytes);
+        return -1;
+    }
+
+    return 0;
 }
 
-int map_compare_uint_keys(const void *uintPtr1, const void *uintPtr2) {
-  unsigned int int1 = *((const unsigned int *)uintPtr1);
-  unsigned int int2 = *((const unsigned int *)uintPtr2);
+static void release_account(MapAccount *account, unsigned long bytes) {
+    if (account) {
+        MAP_ATOMIC_SUB(&account->bytes, bytes);
+    }
+}
+
+/*
+ * Counts a hash into a space-saving summary. Once all counters are taken,
+ * the least frequent one is handed over to the new hash, which inherits
+ * its count as the possible error.
+ */
+static void sampler_count(SamplerCounter *counters, unsigned int *used,
+                          unsigned int capacity, unsigned int hash) {
+    unsigned int i, smallest = 0;
+
+    for (i = 0; i < *used; ++i) {
+        if (counters[i].hash == hash) {
+            counters[i].count++;
+            return;
+        }
 
-  return int1 == int2 ? 0 : -1;
+        if (counters[i].count < counters[smallest].count) {
+            smallest = i;
+        }
+    }
+
+    if (*used < capacity) {
+        counters[*used].hash = hash;
+        counters[*used].count = 1;
+        counters[*used].error = 0;
+        (*used)++;
+        return;
+    }
 
+    counters[smallest].hash = hash;
+    counters[smallest].error = counters[smallest].count;
+    counters[smallest].count++;
 }
 
-int map_compare_float_keys(const void *floatPtr1, const void *floatPtr2) {
-  float float1 = *((const float *)floatPtr1);
-  float float2 = *((const float *)floatPtr2);
+static void sampler_lock(MapSampler *sampler, unsigned int stripe) {
+    unsigned int expected = 0;
 
-  return float1 == float2 ? 0 : -1;
+    while (!MAP_ATOMIC_CAS(&sampler->stripes[stripe].busy, &expected, 1)) {
+        expected = 0;
+        MAP_YIELD();
+    }
 }
 
-int map_compare_double_keys(const void *doublePtr1, const void *doublePtr2) {
-  double double1 = *((const double *)doublePtr1);
-  double double2 = *((const double *)doublePtr2);
+static void sampler_unlock(MapSampler *sampler, unsigned int stripe) {
+    MAP_ATOMIC_STORE(&sampler->stripes[stripe].busy, 0);
+}
+
+static int compare_counter_hashes(const void *a, const void *b) {
+    unsigned int hash1 = ((const SamplerCounter *)a)->hash;
+    unsigned int hash2 = ((const SamplerCounter *)b)->hash;
 
-  return double1 == double2 ? 0 : -1;
+    return hash1 < hash2 ? -1 : (hash1 > hash2);
 }
 
-int map_compare_ptr_keys(const void *ptrKey1, const void *ptrKey2) {
-  return ptrKey1 == ptrKey2;
+static int compare_counter_counts(const void *a, const void *b) {
+    unsigned long count1 = ((const SamplerCounter *)a)->count;
+    unsigned long count2 = ((const SamplerCounter *)b)->count;
+
+    /* Most frequent first */
+    return count1 > count2 ? -1 : (count1 < count2);
 }
 
-void map_free(Map *map) {
-    MapImpl *impl = (MapImpl*)map;
+static unsigned int mix_bits(size_t bits) {
+    /* The 64-bit finalizer of MurmurHash3, folded down to 32 bits */
+    unsigned long long x = (unsigned long long)bits;
 
-    if (!map) {
-        return;
-    }
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
 
-    free(impl->entries);
-    free(impl);
+    return (unsigned int)(x ^ (x >> 32));
 }
 
-int map_set(Map *map, void *key, void *value) {
-    int index;
+/*
+ * Grows the entry table so it can hold at least capacity entries.
+ * Returns 0 on success, -1 if the allocation failed or the map's account
+ * has no room for it.
+ */
+static int grow_entries(MapImpl *impl, unsigned int capacity) {
     MapEntry *new_entries;
-    MapImpl *impl;
+    unsigned char *new_tags;
+    unsigned int *new_hits;
+    unsigned long bytes;
 
-    if (!map) {
+    if (capacity <= impl->capacity) {
+        return 0;
+    }
+
+    if (capacity > (size_t)-1 / sizeof(MapEntry)) {
         return -1;
     }
 
-    impl = (MapImpl*)map;
+    bytes = (unsigned long)(capacity - impl->capacity) * slot_bytes(impl);
+    if (charge_account(impl->account, bytes) != 0) {
+        return -1;
+    }
 
-    /* First, check if the key already exists and update it */
-    index = find_entry_index(map, key);
-    if (index != -1) {
-        impl->entries[index].value = value;
-        return 0;
+    new_entries = (MapEntry *)realloc(impl->entries, sizeof(MapEntry) * capacity);
+    if (!new_entries) {
+        release_account(impl->account, bytes);
+        return -1; /* Allocation failed */
     }
+    impl->entries = new_entries;
 
-    /* If the map is full, resize it */
-    if (impl->size >= impl->capacity) {
-        unsigned int new_capacity = impl->capacity * 2;
-        new_entries = (MapEntry *)realloc(impl->entries, sizeof(MapEntry) * new_capacity);
+    /* The capacity only grows once every array kept per entry has grown */
+    if (impl->tags) {
+        new_tags = (unsigned char *)realloc(impl->tags, capacity);
+        if (!new_tags) {
+            release_account(impl->account, bytes);
+            return -1;
+        }
+        impl->tags = new_tags;
+    }
 
-        if (!new_entries) {
-            return -1; /* Allocation failed */
+    if (impl->hits) {
+        new_hits = (unsigned int *)realloc(impl->hits, sizeof(unsigned int) * capacity);
+        if (!new_hits) {
+            release_account(impl->account, bytes);
+            return -1;
         }
-        impl->entries = new_entries;
-        impl->capacity = new_capacity;
+        impl->hits = new_hits;
     }
 
-    /* Add the new key-value pair */
+    impl->capacity = capacity;
+
+    return 0;
+}
+
+/*
+ * Adds an entry at the end of the table, which must have room for it.
+ */
+static void append_entry(MapImpl *impl, void *key, void *value) {
     impl->entries[impl->size].key = key;
     impl->entries[impl->size].value = value;
-    impl->size++;
 
-    return 0;
+    if (impl->tags) {
+        key_tag(impl->compare_func, key, &impl->tags[impl->size]);
+    }
+    if (impl->hits) {
+        impl->hits[impl->size] = 0;
+    }
+
+    impl->size++;
 }
 
-void *map_get(Map *map, const void *key) {
-    MapImpl *impl = (MapImpl*)map;
-    int index;
+/*
+ * Moves the entry at index to the front of a self-organizing map when its
+ * policy says so. Returns the index the entry ends up at.
+ */
+static int organize_hit(MapImpl *impl, int index) {
+    MapEntry entry;
+    unsigned char tag = 0;
 
-    if (!map) {
-        return NULL;
+    if (impl->hits) {
+        if (++impl->hits[index] < impl->threshold) {
+            return index;
+        }
+        impl->hits[index] = 0;
     }
 
-    index = find_entry_index(map, key);
+    if (index == 0) {
+        return index;
+    }
 
-    if (index != -1) {
-        return impl->entries[index].value;
+    entry = impl->entries[index];
+    if (impl->tags) {
+        tag = impl->tags[index];
     }
 
-    return NULL;
+    if (impl->organize == MAP_ORGANIZE_TRANSPOSE) {
+        /* Swap places with the entry in front */
+        impl->entries[index] = impl->entries[index - 1];
+        impl->entries[index - 1] = entry;
+        if (impl->tags) {
+            impl->tags[index] = impl->tags[index - 1];
+            impl->tags[index - 1] = tag;
+        }
+        if (impl->hits) {
+            impl->hits[index] = impl->hits[index - 1];
+            impl->hits[index - 1] = 0;
+        }
+        index--;
+    }
+    else {
+        memmove(&impl->entries[1], &impl->entries[0], sizeof(MapEntry) * index);
+        impl->entries[0] = entry;
+        if (impl->tags) {
+            memmove(&impl->tags[1], &impl->tags[0], index);
+            impl->tags[0] = tag;
+        }
+        if (impl->hits) {
+            memmove(&impl->hits[1], &impl->hits[0], sizeof(unsigned int) * index);
+            impl->hits[0] = 0;
+        }
+        index = 0;
+    }
+
+    impl->generation++;
+
+    return index;
 }
 
-void map_delete(Map *map, const void *key) {
-    MapImpl *impl = (MapImpl*)map;
-    int index;
+/*
+ * Removes the entry at index, shifting all subsequent entries one position
+ * to the left. Since entries move, outstanding handles are invalidated.
+ */
+static void remove_entry_at(MapImpl *impl, unsigned int index) {
     int bytes_to_move;
 
-    if (!map) {
-        return;
-    }
+    if (index < impl->size - 1) {
+        bytes_to_move = (impl->size - index - 1) * sizeof(MapEntry);
+        memmove(&impl->entries[index], &impl->entries[index + 1], bytes_to_move);
 
-    index = find_entry_index(map, key);
-    if (index != -1) {
-        /* Shift all subsequent elements one position to the left */
-        if ((unsigned int)index < impl->size - 1) {
-            bytes_to_move = (impl->size - index - 1) * sizeof(MapEntry);
-            memmove(&impl->entries[index], &impl->entries[index + 1], bytes_to_move);
+        if (impl->tags) {
+            memmove(&impl->tags[index], &impl->tags[index + 1], impl->size - index - 1);
+        }
+        if (impl->hits) {
+            memmove(&impl->hits[index], &impl->hits[index + 1],
+                    (impl->size - index - 1) * sizeof(unsigned int));
         }
-        impl->size--;
     }
+    impl->size--;
+    impl->generation++;
 }
 
-int map_get_size(Map *map) {
-  MapImpl *impl = (MapImpl *)map;
+/* --- Comparison Kernels --- */
 
-  if (!map) {
-    return -1;
-  }
+/*
+ * The string kernels read whole vectors at a time, possibly past the end
+ * of a string. That is safe as long as a read never crosses into the next
+ * page, which may not be mapped, so vectors are only loaded where the rest
+ * of the page is long enough and bytes are compared one at a time across
+ * page boundaries. Such reads are invisible to AddressSanitizer's notion of
+ * an object's bounds, so it is told to leave the kernels alone.
+ */
+#define MAP_PAGE_SIZE 4096
 
-  return (int)impl->size;
+#if defined(__GNUC__) || defined(__clang__)
+#define MAP_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define MAP_NO_SANITIZE
+#endif
+
+#define MAP_PAGE_ROOM(p, width) \
+    (((size_t)(p) & (MAP_PAGE_SIZE - 1)) <= MAP_PAGE_SIZE - (width))
+
+/*
+ * Compares two NUL terminated strings a byte at a time, optionally folding
+ * ASCII case. Returns the difference of the first differing bytes.
+ */
+static int compare_strings_scalar(const unsigned char *s1, const unsigned char *s2, int ignore_case) {
+    int c1, c2;
+
+    do {
+        c1 = fold_case(*s1++, ignore_case);
+        c2 = fold_case(*s2++, ignore_case);
+    } while (c1 && c1 == c2);
+
+    return c1 - c2;
 }
 
-int map_get_capacity(Map *map) {
-  MapImpl *impl = (MapImpl *)map;
+static int compare_bytes_scalar(const unsigned char *b1, const unsigned char *b2, size_t length) {
+    return memcmp(b1, b2, length);
+}
 
-  if (!map) {
-    return -1;
-  }
+/*
+ * Returns a mask with bit i set for each of the 64 tags starting at tags
+ * that equals tag.
+ */
+static unsigned long long match_tags_scalar(const unsigned char *tags, unsigned char tag) {
+    unsigned long long mask = 0;
+    unsigned int i;
 
-  return (int)impl->capacity;
+    for (i = 0; i < 64; ++i) {
+        if (tags[i] == tag) {
+            mask |= 1ULL << i;
+        }
+    }
+
+    return mask;
 }
 
-Map *map_create(unsigned int initial_capacity, MapKeyCompareFunc compare_func) {
-    MapImpl *impl;
+#ifdef MAP_HAVE_SSE2
+/*
+ * Lower cases the ASCII letters of a vector.
+ */
+static __m128i fold_sse2(__m128i x) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), x));
 
-    /* Defend against a capacity of 0 */
-    if (initial_capacity == 0) {
-        initial_capacity = 10;
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+/*
+ * Compares two strings 16 bytes at a time. A bit is set in the mask for
+ * every position where the strings differ or the first one ends, and the
+ * lowest such position decides the result. Case is only folded for blocks
+ * that differ as they are, which most blocks of keys sharing a prefix don't.
+ */
+MAP_NO_SANITIZE
+static int compare_strings_sse2(const unsigned char *s1, const unsigned char *s2, int ignore_case) {
+    __m128i x, y;
+    unsigned int mask, i;
+    int c1, c2;
+
+    for (;;) {
+        if (MAP_PAGE_ROOM(s1, 16) && MAP_PAGE_ROOM(s2, 16)) {
+            x = _mm_loadu_si128((const __m128i *)s1);
+            y = _mm_loadu_si128((const __m128i *)s2);
+            if (ignore_case && (~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff)) {
+                x = fold_sse2(x);
+                y = fold_sse2(y);
+            }
+
+            mask = (~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff) |
+                   (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()));
+            if (mask) {
+                i = (unsigned int)__builtin_ctz(mask);
+                return fold_case(s1[i], ignore_case) - fold_case(s2[i], ignore_case);
+            }
+
+            s1 += 16;
+            s2 += 16;
+        }
+        else {
+            c1 = fold_case(*s1++, ignore_case);
+            c2 = fold_case(*s2++, ignore_case);
+            if (!c1 || c1 != c2) {
+                return c1 - c2;
+            }
+        }
+    }
+}
+
+/*
+ * Compares length bytes 16 at a time, like memcmp.
+ */
+static int compare_bytes_sse2(const unsigned char *b1, const unsigned char *b2, size_t length) {
+    unsigned int mask, i;
+
+    for (; length >= 16; b1 += 16, b2 += 16, length -= 16) {
+        mask = ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)b1),
+                                                               _mm_loadu_si128((const __m128i *)b2))) & 0xffff;
+        if (mask) {
+            i = (unsigned int)__builtin_ctz(mask);
+            return b1[i] - b2[i];
+        }
+    }
+
+    return length ? memcmp(b1, b2, length) : 0;
+}
+
+static unsigned long long match_tags_sse2(const unsigned char *tags, unsigned char tag) {
+    __m128i needle = _mm_set1_epi8((char)tag);
+    unsigned long long mask = 0;
+    unsigned int i;
+
+    for (i = 0; i < 64; i += 16) {
+        mask |= (unsigned long long)(unsigned int)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(tags + i)), needle)) << i;
+    }
+
+    return mask;
+}
+#endif
+
+#ifdef MAP_HAVE_AVX2
+__attribute__((target("avx2")))
+static __m256i fold_avx2(__m256i x) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+/*
+ * The AVX2 version of compare_strings_sse2, 32 bytes at a time.
+ */
+MAP_NO_SANITIZE __attribute__((target("avx2")))
+static int compare_strings_avx2(const unsigned char *s1, const unsigned char *s2, int ignore_case) {
+    __m256i x, y;
+    unsigned int mask, i;
+    int c1, c2;
+
+    for (;;) {
+        if (MAP_PAGE_ROOM(s1, 32) && MAP_PAGE_ROOM(s2, 32)) {
+            x = _mm256_loadu_si256((const __m256i *)s1);
+            y = _mm256_loadu_si256((const __m256i *)s2);
+            if (ignore_case && ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y))) {
+                x = fold_avx2(x);
+                y = fold_avx2(y);
+            }
+
+            mask = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) |
+                   (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_setzero_si256()));
+            if (mask) {
+                i = (unsigned int)__builtin_ctz(mask);
+                return fold_case(s1[i], ignore_case) - fold_case(s2[i], ignore_case);
+            }
+
+            s1 += 32;
+            s2 += 32;
+        }
+        else {
+            c1 = fold_case(*s1++, ignore_case);
+            c2 = fold_case(*s2++, ignore_case);
+            if (!c1 || c1 != c2) {
+                return c1 - c2;
+            }
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static int compare_bytes_avx2(const unsigned char *b1, const unsigned char *b2, size_t length) {
+    unsigned int mask, i;
+
+    for (; length >= 32; b1 += 32, b2 += 32, length -= 32) {
+        mask = ~(unsigned int)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)b1),
+                              _mm256_loadu_si256((const __m256i *)b2)));
+        if (mask) {
+            i = (unsigned int)__builtin_ctz(mask);
+            return b1[i] - b2[i];
+        }
+    }
+
+    return compare_bytes_sse2(b1, b2, length);
+}
+
+__attribute__((target("avx2")))
+static unsigned long long match_tags_avx2(const unsigned char *tags, unsigned char tag) {
+    __m256i needle = _mm256_set1_epi8((char)tag);
+
+    return (unsigned long long)(unsigned int)_mm256_movemask_epi8(
+               _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)tags), needle)) |
+           (unsigned long long)(unsigned int)_mm256_movemask_epi8(
+               _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(tags + 32)), needle)) << 32;
+}
+#endif
+
+#ifdef MAP_HAVE_AVX512
+/*
+ * AVX-512BW compares produce bit masks directly, so the kernels below work
+ * through 64 bytes per step without any movemask.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static __m512i fold_avx512(__m512i x) {
+    __mmask64 upper = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(x, _mm512_set1_epi8('A')),
+                                             _mm512_set1_epi8(26));
+
+    return _mm512_mask_add_epi8(x, upper, x, _mm512_set1_epi8(0x20));
+}
+
+MAP_NO_SANITIZE __attribute__((target("avx512f,avx512bw")))
+static int compare_strings_avx512(const unsigned char *s1, const unsigned char *s2, int ignore_case) {
+    __m512i x, y;
+    unsigned long long mask;
+    unsigned int i;
+    int c1, c2;
+
+    for (;;) {
+        if (MAP_PAGE_ROOM(s1, 64) && MAP_PAGE_ROOM(s2, 64)) {
+            x = _mm512_loadu_si512((const void *)s1);
+            y = _mm512_loadu_si512((const void *)s2);
+            if (ignore_case && _mm512_cmpneq_epi8_mask(x, y)) {
+                x = fold_avx512(x);
+                y = fold_avx512(y);
+            }
+
+            mask = _mm512_cmpneq_epi8_mask(x, y) | _mm512_testn_epi8_mask(x, x);
+            if (mask) {
+                i = (unsigned int)__builtin_ctzll(mask);
+                return fold_case(s1[i], ignore_case) - fold_case(s2[i], ignore_case);
+            }
+
+            s1 += 64;
+            s2 += 64;
+        }
+        else {
+            c1 = fold_case(*s1++, ignore_case);
+            c2 = fold_case(*s2++, ignore_case);
+            if (!c1 || c1 != c2) {
+                return c1 - c2;
+            }
+        }
+    }
+}
+
+/*
+ * Masked loads never fault on the bytes they leave out, so the tail needs
+ * no separate loop.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static int compare_bytes_avx512(const unsigned char *b1, const unsigned char *b2, size_t length) {
+    __mmask64 load = ~0ULL;
+    unsigned long long mask;
+    unsigned int i;
+
+    for (; length; b1 += 64, b2 += 64, length -= 64) {
+        if (length < 64) {
+            load = (1ULL << length) - 1;
+            length = 64;
+        }
+
+        mask = _mm512_cmpneq_epi8_mask(_mm512_maskz_loadu_epi8(load, b1),
+                                       _mm512_maskz_loadu_epi8(load, b2));
+        if (mask) {
+            i = (unsigned int)__builtin_ctzll(mask);
+            return b1[i] - b2[i];
+        }
+    }
+
+    return 0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static unsigned long long match_tags_avx512(const unsigned char *tags, unsigned char tag) {
+    return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)tags),
+                                  _mm512_set1_epi8((char)tag));
+}
+#endif
+
+/*
+ * Compares two NUL terminated strings with the bound kernel. Returns the
+ * difference of the first differing bytes (after folding ASCII case if
+ * asked to), so the sign orders the strings.
+ */
+static int compare_strings(const void *s1, const void *s2, int ignore_case) {
+    return map_kernels()->compare_strings((const unsigned char *)s1, (const unsigned char *)s2,
+                                          ignore_case);
+}
+
+/*
+ * Compares length bytes with the bound kernel, like memcmp.
+ */
+static int compare_bytes(const void *b1, const void *b2, size_t length) {
+    return map_kernels()->compare_bytes((const unsigned char *)b1, (const unsigned char *)b2, length);
+}
+
+/* --- Parallel Helpers --- */
+
+/* The most threads a bulk operation uses, whatever MAP_THREADS asks for */
+#define MAP_MAX_THREADS 64
+
+/*
+ * A bulk operation split into tasks numbered from 0. Threads take the next
+ * task in turn until none are left, so uneven tasks still balance out.
+ */
+typedef void (*ParallelTaskFunc)(void *context, unsigned int task);
+
+typedef struct ParallelRun {
+    ParallelTaskFunc task_func;
+    void *context;
+    unsigned int tasks;
+    unsigned int next;
+} ParallelRun;
+
+/* The thread count in use, or 0 until it is worked out on first use */
+static unsigned int thread_count = 0;
+
+/*
+ * Returns the number of threads bulk operations use: the MAP_THREADS
+ * environment variable if it is set and otherwise the number of online
+ * processors, at most MAP_MAX_THREADS and always 1 without threads.
+ */
+static unsigned int parallel_threads(void) {
+    unsigned int threads = MAP_ATOMIC_LOAD(&thread_count);
+    long wanted = 1;
+
+    if (threads) {
+        return threads;
+    }
+
+#ifdef MAP_HAVE_THREADS
+    {
+        const char *text = getenv("MAP_THREADS");
+
+        if (text) {
+            wanted = strtol(text, NULL, 10);
+        }
+#ifdef _SC_NPROCESSORS_ONLN
+        else {
+            wanted = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+#endif
+    }
+#endif
+
+    threads = wanted < 1 ? 1 : wanted > MAP_MAX_THREADS ? MAP_MAX_THREADS : (unsigned int)wanted;
+    MAP_ATOMIC_STORE(&thread_count, threads);
+
+    return threads;
+}
+
+static void *parallel_worker(void *arg) {
+    ParallelRun *run = (ParallelRun *)arg;
+    unsigned int task;
+
+    while ((task = MAP_ATOMIC_ADD(&run->next, 1) - 1) < run->tasks) {
+        run->task_func(run->context, task);
+    }
+
+    return NULL;
+}
+
+/*
+ * Runs every task and returns once they have all finished. The calling
+ * thread takes tasks as well, so if no thread can be started the work is
+ * simply done serially.
+ */
+static void run_parallel(ParallelTaskFunc task_func, void *context, unsigned int tasks) {
+    ParallelRun run;
+#ifdef MAP_HAVE_THREADS
+    pthread_t threads[MAP_MAX_THREADS];
+    unsigned int wanted = parallel_threads(), started, i;
+#endif
+
+    run.task_func = task_func;
+    run.context = context;
+    run.tasks = tasks;
+    run.next = 0;
+
+#ifdef MAP_HAVE_THREADS
+    if (wanted > tasks) {
+        wanted = tasks;
+    }
+
+    for (started = 0; started + 1 < wanted; ++started) {
+        if (pthread_create(&threads[started], NULL, parallel_worker, &run) != 0) {
+            break;
+        }
+    }
+
+    parallel_worker(&run);
+
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+#else
+    parallel_worker(&run);
+#endif
+}
+
+/* --- Sorting Helpers --- */
+
+/* Buckets below this size are finished off with an insertion sort */
+#define MAP_RADIX_CUTOFF 32
+
+/* Sorts of fewer entries than this are not worth spreading over threads */
+#define MAP_PARALLEL_SORT_MIN 65536
+
+/*
+ * Compares two strings from the given depth on, optionally ignoring case.
+ */
+static int compare_string_suffix(const MapEntry *a, const MapEntry *b,
+                                 unsigned int depth, int ignore_case) {
+    return compare_strings((const unsigned char *)a->key + depth,
+                           (const unsigned char *)b->key + depth, ignore_case);
+}
+
+/*
+ * Distributes string keyed entries into buckets by their byte at depth,
+ * through tmp, counting how many land in each bucket.
+ */
+static void distribute_strings(MapEntry *entries, MapEntry *tmp, unsigned int count,
+                               unsigned int depth, int ignore_case, unsigned int *counts) {
+    unsigned int starts[256];
+    unsigned int i, total;
+    int c;
+
+    memset(counts, 0, sizeof(unsigned int) * 256);
+    for (i = 0; i < count; ++i) {
+        c = ((const unsigned char *)entries[i].key)[depth];
+        counts[fold_case(c, ignore_case)]++;
+    }
+
+    for (i = 0, total = 0; i < 256; ++i) {
+        starts[i] = total;
+        total += counts[i];
+    }
+
+    for (i = 0; i < count; ++i) {
+        c = ((const unsigned char *)entries[i].key)[depth];
+        tmp[starts[fold_case(c, ignore_case)]++] = entries[i];
+    }
+    memcpy(entries, tmp, sizeof(MapEntry) * count);
+}
+
+/*
+ * Sorts string keyed entries with an MSD radix sort, one byte per level,
+ * distributing through tmp. All keys in the range share their first depth
+ * bytes.
+ */
+static void radix_sort_strings(MapEntry *entries, MapEntry *tmp, unsigned int count,
+                               unsigned int depth, int ignore_case) {
+    unsigned int counts[256];
+    unsigned int i, j, total;
+    MapEntry entry;
+
+    if (count < MAP_RADIX_CUTOFF) {
+        for (i = 1; i < count; ++i) {
+            entry = entries[i];
+            for (j = i; j > 0 &&
+                 compare_string_suffix(&entries[j - 1], &entry, depth, ignore_case) > 0; --j) {
+                entries[j] = entries[j - 1];
+            }
+            entries[j] = entry;
+        }
+        return;
+    }
+
+    distribute_strings(entries, tmp, count, depth, ignore_case, counts);
+
+    /* Bucket 0 holds keys that ended at this depth, which are all equal */
+    for (i = 1, total = counts[0]; i < 256; ++i) {
+        if (counts[i] > 1) {
+            radix_sort_strings(entries + total, tmp, counts[i], depth + 1, ignore_case);
+        }
+        total += counts[i];
+    }
+}
+
+/*
+ * The buckets of a string sort whose first level has been distributed.
+ * Each bucket is sorted on its own, in its own part of the scratch space.
+ */
+typedef struct StringSortJob {
+    MapEntry *entries;
+    MapEntry *tmp;
+    unsigned int starts[257];
+    unsigned int depth;
+    int ignore_case;
+} StringSortJob;
+
+static void sort_string_bucket(void *context, unsigned int task) {
+    StringSortJob *job = (StringSortJob *)context;
+    unsigned int start = job->starts[task + 1];
+    unsigned int count = job->starts[task + 2] - start;
+
+    if (count > 1) {
+        radix_sort_strings(job->entries + start, job->tmp + start, count, job->depth + 1, job->ignore_case);
+    }
+}
+
+/*
+ * Sorts string keyed entries like radix_sort_strings, but distributes the
+ * first level itself and then sorts the buckets on several threads. Keys
+ * that all share a prefix would land in a single bucket, so the first
+ * level is the first byte at which they differ.
+ */
+static void parallel_sort_strings(MapEntry *entries, MapEntry *tmp, unsigned int count,
+                                  int ignore_case) {
+    StringSortJob job;
+    unsigned int counts[256];
+    unsigned int i;
+    int shared;
+
+    job.entries = entries;
+    job.tmp = tmp;
+    job.depth = 0;
+    job.ignore_case = ignore_case;
+
+    for (;;) {
+        distribute_strings(entries, tmp, count, job.depth, ignore_case, counts);
+
+        for (i = 1, shared = 0; i < 256; ++i) {
+            if (counts[i] == count) {
+                shared = 1;
+            }
+        }
+        if (!shared) {
+            break;
+        }
+        job.depth++;
+    }
+
+    for (i = 0, job.starts[0] = 0; i < 256; ++i) {
+        job.starts[i + 1] = job.starts[i] + counts[i];
+    }
+
+    /* Bucket 0 holds keys that ended at this depth, which are all equal */
+    run_parallel(sort_string_bucket, &job, 255);
+}
+
+/*
+ * Maps a numeric key onto an unsigned integer whose natural order matches
+ * the order of the key type.
+ */
+static unsigned int radix_key_bits(const void *key, MapKeyCompareFunc compare_func) {
+    unsigned int bits;
+
+    if (compare_func == map_compare_int_keys) {
+        return (unsigned int)*(const int *)key ^ 0x80000000u;
+    }
+
+    if (compare_func == map_compare_float_keys) {
+        memcpy(&bits, key, sizeof(bits));
+        return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+    }
+
+    return *(const unsigned int *)key;
+}
+
+/*
+ * One LSD radix sort, split into chunks of the entries. Every pass counts
+ * the bytes of each chunk into that chunk's own histogram, turns the
+ * histograms into the position each chunk writes each byte at, and then
+ * scatters the chunks, all of which can happen on separate threads. Taking
+ * chunks in order for every byte keeps each pass stable.
+ */
+typedef struct NumberSortJob {
+    MapEntry *src;
+    MapEntry *dst;
+    unsigned int *bits;
+    unsigned int *bits_tmp;
+    unsigned int (*histograms)[256];
+    MapKeyCompareFunc compare_func;
+    unsigned int count;
+    unsigned int chunks;
+    unsigned int shift;
+} NumberSortJob;
+
+static void count_number_chunk(void *context, unsigned int task) {
+    NumberSortJob *job = (NumberSortJob *)context;
+    unsigned int *counts = job->histograms[task];
+    unsigned int start = (unsigned int)((unsigned long long)job->count * task / job->chunks);
+    unsigned int end = (unsigned int)((unsigned long long)job->count * (task + 1) / job->chunks);
+    unsigned int i;
+
+    /* The first pass works out the key bits as it goes */
+    if (job->shift == 0) {
+        for (i = start; i < end; ++i) {
+            job->bits[i] = radix_key_bits(job->src[i].key, job->compare_func);
+        }
+    }
+
+    memset(counts, 0, sizeof(unsigned int) * 256);
+    for (i = start; i < end; ++i) {
+        counts[(job->bits[i] >> job->shift) & 0xff]++;
+    }
+}
+
+static void scatter_number_chunk(void *context, unsigned int task) {
+    NumberSortJob *job = (NumberSortJob *)context;
+    unsigned int *positions = job->histograms[task];
+    unsigned int start = (unsigned int)((unsigned long long)job->count * task / job->chunks);
+    unsigned int end = (unsigned int)((unsigned long long)job->count * (task + 1) / job->chunks);
+    unsigned int i;
+    unsigned char byte;
+
+    for (i = start; i < end; ++i) {
+        byte = (unsigned char)((job->bits[i] >> job->shift) & 0xff);
+        job->bits_tmp[positions[byte]] = job->bits[i];
+        job->dst[positions[byte]++] = job->src[i];
+    }
+}
+
+/*
+ * Sorts numeric keyed entries with an LSD radix sort, eight bits per pass,
+ * on several threads when there are enough of them.
+ * Returns 0 on success, -1 if the scratch space could not be allocated.
+ */
+static int radix_sort_numbers(MapEntry *entries, unsigned int count,
+                              MapKeyCompareFunc compare_func) {
+    NumberSortJob job;
+    unsigned int *scratch, *swap_bits;
+    MapEntry *tmp, *swap_entries;
+    unsigned int i, chunk, total;
+
+    job.chunks = count >= MAP_PARALLEL_SORT_MIN ? parallel_threads() : 1;
+
+    scratch = (unsigned int *)malloc(sizeof(unsigned int) * count * 2);
+    tmp = (MapEntry *)malloc(sizeof(MapEntry) * count);
+    job.histograms = (unsigned int (*)[256])malloc(sizeof(*job.histograms) * job.chunks);
+    if (!scratch || !tmp || !job.histograms) {
+        free(scratch);
+        free(tmp);
+        free(job.histograms);
+        return -1;
+    }
+
+    job.src = entries;
+    job.dst = tmp;
+    job.bits = scratch;
+    job.bits_tmp = scratch + count;
+    job.compare_func = compare_func;
+    job.count = count;
+
+    for (job.shift = 0; job.shift < 32; job.shift += 8) {
+        run_parallel(count_number_chunk, &job, job.chunks);
+
+        for (i = 0, total = 0; i < 256; ++i) {
+            for (chunk = 0; chunk < job.chunks; ++chunk) {
+                unsigned int counted = job.histograms[chunk][i];
+
+                job.histograms[chunk][i] = total;
+                total += counted;
+            }
+        }
+
+        run_parallel(scatter_number_chunk, &job, job.chunks);
+
+        swap_bits = job.bits; job.bits = job.bits_tmp; job.bits_tmp = swap_bits;
+        swap_entries = job.src; job.src = job.dst; job.dst = swap_entries;
+    }
+
+    /* An even number of passes leaves the result back in entries */
+    free(scratch);
+    free(tmp);
+    free(job.histograms);
+
+    return 0;
+}
+
+/*
+ * Orders two entries the same way sort_entries does, treating the pointer
+ * comparator (which only reports equality) as an ordering on addresses.
+ */
+static int compare_entries(const MapEntry *a, const MapEntry *b,
+                           MapKeyCompareFunc compare_func) {
+    if (compare_func == map_compare_string_keys_ignoring_case) {
+        return compare_string_suffix(a, b, 0, 1);
+    }
+
+    if (compare_func == map_compare_ptr_keys) {
+        return (size_t)a->key < (size_t)b->key ? -1 : ((size_t)a->key > (size_t)b->key);
+    }
+
+    return compare_func(a->key, b->key);
+}
+
+/*
+ * Merges two sorted runs into out, taking from the left run on ties so
+ * that merging stays stable.
+ */
+static void merge_runs(const MapEntry *left, unsigned int left_count,
+                       const MapEntry *right, unsigned int right_count,
+                       MapEntry *out, MapKeyCompareFunc compare_func) {
+    unsigned int i = 0, j = 0, k = 0;
+
+    while (i < left_count && j < right_count) {
+        if (compare_entries(&right[j], &left[i], compare_func) < 0) {
+            out[k++] = right[j++];
+        }
+        else {
+            out[k++] = left[i++];
+        }
+    }
+    while (i < left_count) {
+        out[k++] = left[i++];
+    }
+    while (j < right_count) {
+        out[k++] = right[j++];
+    }
+}
+
+/*
+ * Sorts entries with a top down merge sort using the comparator.
+ */
+static void merge_sort_entries(MapEntry *entries, MapEntry *tmp, unsigned int count,
+                               MapKeyCompareFunc compare_func) {
+    unsigned int middle = count / 2;
+
+    if (count < 2) {
+        return;
+    }
+
+    merge_sort_entries(entries, tmp, middle, compare_func);
+    merge_sort_entries(entries + middle, tmp, count - middle, compare_func);
+
+    merge_runs(entries, middle, entries + middle, count - middle, tmp, compare_func);
+    memcpy(entries, tmp, sizeof(MapEntry) * count);
+}
+
+/*
+ * A merge sort split into runs, each sorted on its own thread and then
+ * merged pairwise, every pair of a round on its own thread, until one run
+ * is left. Runs are the entries split as evenly as possible, so run i of
+ * width w covers the entries from bound(i * w) to bound((i + 1) * w).
+ */
+typedef struct MergeSortJob {
+    MapEntry *src;
+    MapEntry *dst;
+    MapKeyCompareFunc compare_func;
+    unsigned int count;
+    unsigned int runs;
+    unsigned int width;
+} MergeSortJob;
+
+static unsigned int merge_run_bound(const MergeSortJob *job, unsigned int run) {
+    return run >= job->runs ? job->count :
+        (unsigned int)((unsigned long long)job->count * run / job->runs);
+}
+
+static void sort_merge_run(void *context, unsigned int task) {
+    MergeSortJob *job = (MergeSortJob *)context;
+    unsigned int start = merge_run_bound(job, task);
+    unsigned int end = merge_run_bound(job, task + 1);
+
+    merge_sort_entries(job->src + start, job->dst + start, end - start, job->compare_func);
+}
+
+static void merge_run_pair(void *context, unsigned int task) {
+    MergeSortJob *job = (MergeSortJob *)context;
+    unsigned int start = merge_run_bound(job, task * 2 * job->width);
+    unsigned int middle = merge_run_bound(job, (task * 2 + 1) * job->width);
+    unsigned int end = merge_run_bound(job, (task * 2 + 2) * job->width);
+
+    merge_runs(job->src + start, middle - start, job->src + middle, end - middle,
+               job->dst + start, job->compare_func);
+}
+
+/*
+ * Sorts entries like merge_sort_entries, on several threads. Returns with
+ * the result in entries.
+ */
+static void parallel_merge_sort(MapEntry *entries, MapEntry *tmp, unsigned int count,
+                                MapKeyCompareFunc compare_func) {
+    MergeSortJob job;
+    MapEntry *swap;
+
+    job.src = entries;
+    job.dst = tmp;
+    job.compare_func = compare_func;
+    job.count = count;
+    job.runs = parallel_threads();
+
+    run_parallel(sort_merge_run, &job, job.runs);
+
+    for (job.width = 1; job.width < job.runs; job.width *= 2) {
+        run_parallel(merge_run_pair, &job, (job.runs + job.width * 2 - 1) / (job.width * 2));
+        swap = job.src; job.src = job.dst; job.dst = swap;
+    }
+
+    if (job.src != entries) {
+        memcpy(entries, job.src, sizeof(MapEntry) * count);
+    }
+}
+
+/*
+ * Sorts entries in ascending key order, picking a radix sort when the
+ * comparator reveals the key type. Large sorts are spread over threads.
+ * Returns 0 on success, -1 if scratch space could not be allocated.
+ */
+static int sort_entries(MapEntry *entries, unsigned int count,
+                        MapKeyCompareFunc compare_func) {
+    MapEntry *tmp;
+    int parallel;
+
+    if (count < 2) {
+        return 0;
+    }
+
+    if (compare_func == map_compare_int_keys ||
+        compare_func == map_compare_uint_keys ||
+        (compare_func == map_compare_float_keys && sizeof(float) == sizeof(unsigned int))) {
+        return radix_sort_numbers(entries, count, compare_func);
+    }
+
+    tmp = (MapEntry *)malloc(sizeof(MapEntry) * count);
+    if (!tmp) {
+        return -1;
+    }
+
+    parallel = count >= MAP_PARALLEL_SORT_MIN && parallel_threads() > 1;
+
+    if (compare_func == map_compare_string_keys || compare_func == map_compare_string_keys_ignoring_case) {
+        if (parallel) {
+            parallel_sort_strings(entries, tmp, count, compare_func != map_compare_string_keys);
+        }
+        else {
+            radix_sort_strings(entries, tmp, count, 0, compare_func != map_compare_string_keys);
+        }
+    }
+    else if (parallel) {
+        parallel_merge_sort(entries, tmp, count, compare_func);
+    }
+    else {
+        merge_sort_entries(entries, tmp, count, compare_func);
+    }
+
+    free(tmp);
+    return 0;
+}
+
+/*
+ * Matches sorted rows against a sorted copy of a map's entries, whose
+ * values hold their index in the map. The rows are split into partitions,
+ * each finding where it starts among the entries with a binary search and
+ * merging from there on its own thread, so a match is recorded for every
+ * row without any two threads writing to the same place.
+ */
+typedef struct SortedMatchJob {
+    const MapEntry *rows;
+    const MapEntry *entries;
+    MapKeyCompareFunc compare_func;
+    unsigned int count;
+    unsigned int size;
+    unsigned int parts;
+    int *matches;
+} SortedMatchJob;
+
+static void match_sorted_part(void *context, unsigned int task) {
+    SortedMatchJob *job = (SortedMatchJob *)context;
+    unsigned int start = (unsigned int)((unsigned long long)job->count * task / job->parts);
+    unsigned int end = (unsigned int)((unsigned long long)job->count * (task + 1) / job->parts);
+    unsigned int low = 0, high = job->size, middle, i;
+    int order;
+
+    if (start == end) {
+        return;
+    }
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (compare_entries(&job->entries[middle], &job->rows[start], job->compare_func) < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    for (i = start; i < end; ++i) {
+        order = -1;
+        while (low < job->size &&
+               (order = compare_entries(&job->entries[low], &job->rows[i], job->compare_func)) < 0) {
+            low++;
+        }
+        job->matches[i] = low < job->size && order == 0 ? (int)(size_t)job->entries[low].value : -1;
+    }
+}
+
+/*
+ * Sorts rows and finds the index in the map of the entry matching each
+ * of them, or -1, on several threads when there are enough rows.
+ * Returns 0 on success, -1 if memory could not be allocated.
+ */
+static int match_sorted_rows(MapImpl *impl, MapEntry *rows, unsigned int count, int *matches) {
+    SortedMatchJob job;
+    MapEntry *entries;
+    unsigned int i;
+
+    entries = (MapEntry *)malloc(sizeof(MapEntry) * (impl->size ? impl->size : 1));
+    if (!entries) {
+        return -1;
+    }
+
+    for (i = 0; i < impl->size; ++i) {
+        entries[i].key = impl->entries[i].key;
+        entries[i].value = (void *)(size_t)i;
+    }
+
+    if (sort_entries(rows, count, impl->compare_func) != 0 ||
+        sort_entries(entries, impl->size, impl->compare_func) != 0) {
+        free(entries);
+        return -1;
+    }
+
+    job.rows = rows;
+    job.entries = entries;
+    job.compare_func = impl->compare_func;
+    job.count = count;
+    job.size = impl->size;
+    job.parts = count >= MAP_PARALLEL_SORT_MIN ? parallel_threads() : 1;
+    job.matches = matches;
+
+    run_parallel(match_sorted_part, &job, job.parts);
+
+    free(entries);
+    return 0;
+}
+
+/* --- Compression Helpers --- */
+
+/*
+ * The compressor matches runs of at least 4 bytes within the last 64 KiB,
+ * found through a hash table of 2^12 recent positions.
+ */
+#define MAP_LZ_MIN_MATCH  4
+#define MAP_LZ_MAX_OFFSET 65535
+#define MAP_LZ_HASH_BITS  12
+
+static int lz_write_length(unsigned char *dst, unsigned int *position,
+                           unsigned int capacity, unsigned int length) {
+    while (length >= 255) {
+        if (*position >= capacity) {
+            return -1;
+        }
+        dst[(*position)++] = 255;
+        length -= 255;
+    }
+
+    if (*position >= capacity) {
+        return -1;
+    }
+    dst[(*position)++] = (unsigned char)length;
+
+    return 0;
+}
+
+/*
+ * Writes one sequence of the compressed format: a token holding the
+ * literal count and match length (each extended by further bytes when
+ * they reach 15), the literals, then the match offset. The last sequence
+ * has literals only. Returns 0 on success, -1 if it does not fit.
+ */
+static int lz_write_sequence(unsigned char *dst, unsigned int *position, unsigned int capacity,
+                             const unsigned char *literals, unsigned int literal_count,
+                             unsigned int offset, unsigned int match_length) {
+    unsigned int match_code = match_length ? match_length - MAP_LZ_MIN_MATCH : 0;
+
+    if (*position >= capacity) {
+        return -1;
+    }
+    dst[(*position)++] = (unsigned char)(((literal_count < 15 ? literal_count : 15) << 4) |
+                                         (match_code < 15 ? match_code : 15));
+
+    if ((literal_count >= 15 && lz_write_length(dst, position, capacity, literal_count - 15) != 0) ||
+        capacity - *position < literal_count) {
+        return -1;
+    }
+    memcpy(dst + *position, literals, literal_count);
+    *position += literal_count;
+
+    if (!match_length) {
+        return 0;
+    }
+
+    if (capacity - *position < 2) {
+        return -1;
+    }
+    dst[(*position)++] = (unsigned char)(offset & 0xff);
+    dst[(*position)++] = (unsigned char)(offset >> 8);
+
+    if (match_code >= 15 && lz_write_length(dst, position, capacity, match_code - 15) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int lz_read_length(const unsigned char *src, unsigned int *position,
+                          unsigned int length, unsigned int *value) {
+    unsigned char byte;
+
+    do {
+        if (*position >= length) {
+            return -1;
+        }
+        byte = src[(*position)++];
+        *value += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+/* --- Snapshot Helpers --- */
+
+/*
+ * A snapshot is the magic, a format version, the entry count and the block
+ * count, followed by the blocks. Each block is its entry count, payload
+ * length, stored length and the CRC32C of those three and the stored
+ * bytes, followed by the stored bytes. The payload is every entry as a
+ * length prefixed key and a length prefixed value; it is stored compressed
+ * with map_lz_compress when that saves at least an eighth, in which case
+ * the stored length is the shorter one. All integers are 32 bit little
+ * endian so snapshots move between machines.
+ *
+ * Blocks can be verified and loaded independently of each other, which is
+ * what lets map_load_blocks read only part of a snapshot and lets blocks
+ * be compressed, checked and decompressed on several threads at once.
+ */
+#define MAP_SNAPSHOT_MAGIC      "CMAP"
+#define MAP_SNAPSHOT_VERSION    4
+#define MAP_SNAPSHOT_BLOCK_SIZE (1024 * 1024)
+
+/* Payloads shorter than this are always stored as they are */
+#define MAP_SNAPSHOT_COMPRESS_MIN 64
+
+/* The most blocks held in memory at once while saving or loading */
+#define MAP_SNAPSHOT_BATCH 16
+
+typedef struct SnapshotBuffer {
+    unsigned char *data;
+    unsigned int length;
+    size_t capacity;
+} SnapshotBuffer;
+
+/*
+ * One block on its way to or from the file. The payload is in raw and,
+ * when the block is stored compressed, the compressed bytes are in packed;
+ * packed is empty for a block stored as it is.
+ */
+typedef struct SnapshotBlock {
+    SnapshotBuffer raw;
+    SnapshotBuffer packed;
+    unsigned int entries;
+    unsigned int crc;
+    int failed;
+} SnapshotBlock;
+
+/*
+ * The byte at a time table for CRC32C with the reflected polynomial
+ * 0x82f63b78. It is a constant rather than built on first use, so that
+ * threads saving and loading at the same time never race to fill it in.
+ */
+static const unsigned int crc32c_table[256] = {
+    0x00000000u, 0xf26b8303u, 0xe13b70f7u, 0x1350f3f4u, 0xc79a971fu, 0x35f1141cu,
+    0x26a1e7e8u, 0xd4ca64ebu, 0x8ad958cfu, 0x78b2dbccu, 0x6be22838u, 0x9989ab3bu,
+    0x4d43cfd0u, 0xbf284cd3u, 0xac78bf27u, 0x5e133c24u, 0x105ec76fu, 0xe235446cu,
+    0xf165b798u, 0x030e349bu, 0xd7c45070u, 0x25afd373u, 0x36ff2087u, 0xc494a384u,
+    0x9a879fa0u, 0x68ec1ca3u, 0x7bbcef57u, 0x89d76c54u, 0x5d1d08bfu, 0xaf768bbcu,
+    0xbc267848u, 0x4e4dfb4bu, 0x20bd8edeu, 0xd2d60dddu, 0xc186fe29u, 0x33ed7d2au,
+    0xe72719c1u, 0x154c9ac2u, 0x061c6936u, 0xf477ea35u, 0xaa64d611u, 0x580f5512u,
+    0x4b5fa6e6u, 0xb93425e5u, 0x6dfe410eu, 0x9f95c20du, 0x8cc531f9u, 0x7eaeb2fau,
+    0x30e349b1u, 0xc288cab2u, 0xd1d83946u, 0x23b3ba45u, 0xf779deaeu, 0x05125dadu,
+    0x1642ae59u, 0xe4292d5au, 0xba3a117eu, 0x4851927du, 0x5b016189u, 0xa96ae28au,
+    0x7da08661u, 0x8fcb0562u, 0x9c9bf696u, 0x6ef07595u, 0x417b1dbcu, 0xb3109ebfu,
+    0xa0406d4bu, 0x522bee48u, 0x86e18aa3u, 0x748a09a0u, 0x67dafa54u, 0x95b17957u,
+    0xcba24573u, 0x39c9c670u, 0x2a993584u, 0xd8f2b687u, 0x0c38d26cu, 0xfe53516fu,
+    0xed03a29bu, 0x1f682198u, 0x5125dad3u, 0xa34e59d0u, 0xb01eaa24u, 0x42752927u,
+    0x96bf4dccu, 0x64d4cecfu, 0x77843d3bu, 0x85efbe38u, 0xdbfc821cu, 0x2997011fu,
+    0x3ac7f2ebu, 0xc8ac71e8u, 0x1c661503u, 0xee0d9600u, 0xfd5d65f4u, 0x0f36e6f7u,
+    0x61c69362u, 0x93ad1061u, 0x80fde395u, 0x72966096u, 0xa65c047du, 0x5437877eu,
+    0x4767748au, 0xb50cf789u, 0xeb1fcbadu, 0x197448aeu, 0x0a24bb5au, 0xf84f3859u,
+    0x2c855cb2u, 0xdeeedfb1u, 0xcdbe2c45u, 0x3fd5af46u, 0x7198540du, 0x83f3d70eu,
+    0x90a324fau, 0x62c8a7f9u, 0xb602c312u, 0x44694011u, 0x5739b3e5u, 0xa55230e6u,
+    0xfb410cc2u, 0x092a8fc1u, 0x1a7a7c35u, 0xe811ff36u, 0x3cdb9bddu, 0xceb018deu,
+    0xdde0eb2au, 0x2f8b6829u, 0x82f63b78u, 0x709db87bu, 0x63cd4b8fu, 0x91a6c88cu,
+    0x456cac67u, 0xb7072f64u, 0xa457dc90u, 0x563c5f93u, 0x082f63b7u, 0xfa44e0b4u,
+    0xe9141340u, 0x1b7f9043u, 0xcfb5f4a8u, 0x3dde77abu, 0x2e8e845fu, 0xdce5075cu,
+    0x92a8fc17u, 0x60c37f14u, 0x73938ce0u, 0x81f80fe3u, 0x55326b08u, 0xa759e80bu,
+    0xb4091bffu, 0x466298fcu, 0x1871a4d8u, 0xea1a27dbu, 0xf94ad42fu, 0x0b21572cu,
+    0xdfeb33c7u, 0x2d80b0c4u, 0x3ed04330u, 0xccbbc033u, 0xa24bb5a6u, 0x502036a5u,
+    0x4370c551u, 0xb11b4652u, 0x65d122b9u, 0x97baa1bau, 0x84ea524eu, 0x7681d14du,
+    0x2892ed69u, 0xdaf96e6au, 0xc9a99d9eu, 0x3bc21e9du, 0xef087a76u, 0x1d63f975u,
+    0x0e330a81u, 0xfc588982u, 0xb21572c9u, 0x407ef1cau, 0x532e023eu, 0xa145813du,
+    0x758fe5d6u, 0x87e466d5u, 0x94b49521u, 0x66df1622u, 0x38cc2a06u, 0xcaa7a905u,
+    0xd9f75af1u, 0x2b9cd9f2u, 0xff56bd19u, 0x0d3d3e1au, 0x1e6dcdeeu, 0xec064eedu,
+    0xc38d26c4u, 0x31e6a5c7u, 0x22b65633u, 0xd0ddd530u, 0x0417b1dbu, 0xf67c32d8u,
+    0xe52cc12cu, 0x1747422fu, 0x49547e0bu, 0xbb3ffd08u, 0xa86f0efcu, 0x5a048dffu,
+    0x8ecee914u, 0x7ca56a17u, 0x6ff599e3u, 0x9d9e1ae0u, 0xd3d3e1abu, 0x21b862a8u,
+    0x32e8915cu, 0xc083125fu, 0x144976b4u, 0xe622f5b7u, 0xf5720643u, 0x07198540u,
+    0x590ab964u, 0xab613a67u, 0xb831c993u, 0x4a5a4a90u, 0x9e902e7bu, 0x6cfbad78u,
+    0x7fab5e8cu, 0x8dc0dd8fu, 0xe330a81au, 0x115b2b19u, 0x020bd8edu, 0xf0605beeu,
+    0x24aa3f05u, 0xd6c1bc06u, 0xc5914ff2u, 0x37faccf1u, 0x69e9f0d5u, 0x9b8273d6u,
+    0x88d28022u, 0x7ab90321u, 0xae7367cau, 0x5c18e4c9u, 0x4f48173du, 0xbd23943eu,
+    0xf36e6f75u, 0x0105ec76u, 0x12551f82u, 0xe03e9c81u, 0x34f4f86au, 0xc69f7b69u,
+    0xd5cf889du, 0x27a40b9eu, 0x79b737bau, 0x8bdcb4b9u, 0x988c474du, 0x6ae7c44eu,
+    0xbe2da0a5u, 0x4c4623a6u, 0x5f16d052u, 0xad7d5351u
+};
+
+static unsigned int crc32c_software(unsigned int crc, const unsigned char *data, size_t length) {
+    while (length--) {
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MAP_HAVE_CRC32C_SSE42 1
+#include <nmmintrin.h>
+
+/*
+ * The SSE4.2 crc32 instruction computes CRC32C directly, eight bytes per
+ * instruction on 64 bit builds.
+ */
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *data, size_t length) {
+    unsigned int word;
+
+#ifdef __x86_64__
+    unsigned long long quad;
+
+    while (length >= 8) {
+        memcpy(&quad, data, 8);
+        crc = (unsigned int)_mm_crc32_u64(crc, quad);
+        data += 8;
+        length -= 8;
+    }
+#endif
+
+    while (length >= 4) {
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+        data += 4;
+        length -= 4;
+    }
+
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+
+    return crc;
+}
+#endif
+
+static void encode_u32(unsigned char *bytes, unsigned int value) {
+    bytes[0] = (unsigned char)(value & 0xff);
+    bytes[1] = (unsigned char)((value >> 8) & 0xff);
+    bytes[2] = (unsigned char)((value >> 16) & 0xff);
+    bytes[3] = (unsigned char)((value >> 24) & 0xff);
+}
+
+/*
+ * Computes the CRC32C (Castagnoli) checksum of a block with the bound
+ * kernel, covering its entry count and lengths as well as the stored
+ * bytes so that a damaged header is caught too.
+ */
+static unsigned int block_crc(const SnapshotBlock *block) {
+    const SnapshotBuffer *stored = block->packed.length ? &block->packed : &block->raw;
+    unsigned char header[12];
+    unsigned int crc;
+
+    encode_u32(header, block->entries);
+    encode_u32(header + 4, block->raw.length);
+    encode_u32(header + 8, stored->length);
+    crc = map_kernels()->crc32c(~0u, header, 12);
+
+    return ~map_kernels()->crc32c(crc, stored->data, stored->length);
+}
+
+static unsigned int decode_u32(const unsigned char *bytes) {
+    return (unsigned int)bytes[0] | ((unsigned int)bytes[1] << 8) |
+        ((unsigned int)bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+}
+
+static int write_u32(FILE *file, unsigned int value) {
+    unsigned char bytes[4];
+
+    encode_u32(bytes, value);
+    return fwrite(bytes, 1, 4, file) == 4 ? 0 : -1;
+}
+
+static int read_u32(FILE *file, unsigned int *value) {
+    unsigned char bytes[4];
+
+    if (fread(bytes, 1, 4, file) != 4) {
+        return -1;
+    }
+
+    *value = decode_u32(bytes);
+    return 0;
+}
+
+/*
+ * Makes room for length more bytes in the buffer.
+ * Returns 0 on success, -1 if the allocation failed.
+ */
+static int buffer_reserve(SnapshotBuffer *buffer, unsigned int length) {
+    unsigned char *grown;
+    size_t needed = (size_t)buffer->length + length;
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+
+    /* Lengths are 32 bit in snapshots, so a buffer never needs more */
+    if (needed > 0xffffffffUL) {
+        return -1;
+    }
+
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+
+    if (capacity != buffer->capacity) {
+        grown = (unsigned char *)realloc(buffer->data, capacity);
+        if (!grown) {
+            return -1;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+
+    return 0;
+}
+
+/*
+ * Appends one length prefixed item, turned into bytes by serialize.
+ */
+static int buffer_append_item(SnapshotBuffer *buffer, MapSerializeFunc serialize,
+                              const void *item, void *context) {
+    const void *bytes;
+    unsigned int length = 0;
+
+    bytes = serialize(item, &length, context);
+    if ((!bytes && length) || buffer_reserve(buffer, length + 4) != 0) {
+        return -1;
+    }
+
+    encode_u32(buffer->data + buffer->length, length);
+    if (length) {
+        memcpy(buffer->data + buffer->length + 4, bytes, length);
+    }
+    buffer->length += length + 4;
+
+    return 0;
+}
+
+/*
+ * Rebuilds the length prefixed item at *offset through deserialize,
+ * advancing the offset past it. Returns NULL on failure.
+ */
+static void *buffer_read_item(SnapshotBuffer *buffer, unsigned int *offset,
+                              MapDeserializeFunc deserialize, void *context) {
+    unsigned int length;
+    void *item;
+
+    if (buffer->length - *offset < 4) {
+        return NULL;
+    }
+
+    length = decode_u32(buffer->data + *offset);
+    if (buffer->length - *offset - 4 < length) {
+        return NULL;
+    }
+
+    item = deserialize(buffer->data + *offset + 4, length, context);
+    *offset += length + 4;
+
+    return item;
+}
+
+/*
+ * Compresses the payload of one block of a batch when that saves enough,
+ * then checksums what will be stored. Runs on any thread.
+ */
+static void pack_block(void *context, unsigned int task) {
+    SnapshotBlock *block = (SnapshotBlock *)context + task;
+    unsigned int length = block->raw.length;
+
+    block->packed.length = 0;
+    if (length >= MAP_SNAPSHOT_COMPRESS_MIN && buffer_reserve(&block->packed, length) == 0) {
+        block->packed.length = map_lz_compress(block->raw.data, length, block->packed.data,
+                                               length - length / 8);
+    }
+
+    block->crc = block_crc(block);
+}
+
+static int write_block(FILE *file, const SnapshotBlock *block) {
+    const SnapshotBuffer *stored = block->packed.length ? &block->packed : &block->raw;
+
+    if (write_u32(file, block->entries) != 0 ||
+        write_u32(file, block->raw.length) != 0 ||
+        write_u32(file, stored->length) != 0 ||
+        write_u32(file, block->crc) != 0) {
+        return -1;
+    }
+
+    return fwrite(stored->data, 1, stored->length, file) == stored->length ? 0 : -1;
+}
+
+static void free_blocks(SnapshotBlock *blocks, unsigned int count) {
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        free(blocks[i].raw.data);
+        free(blocks[i].packed.data);
+    }
+}
+
+/*
+ * Writes the snapshot a batch of blocks at a time. The entries are turned
+ * into bytes on the calling thread, as codecs need not be thread safe, and
+ * the batch is then compressed and checksummed in parallel before being
+ * written out in order.
+ */
+static int write_snapshot(MapImpl *impl, FILE *file, const MapCodec *codec) {
+    SnapshotBlock batch[MAP_SNAPSHOT_BATCH];
+    unsigned int batch_size = parallel_threads();
+    unsigned int blocks = 0, filled, i = 0, j;
+    SnapshotBlock *block;
+    int result = 0;
+
+    memset(batch, 0, sizeof(batch));
+    if (batch_size > MAP_SNAPSHOT_BATCH) {
+        batch_size = MAP_SNAPSHOT_BATCH;
+    }
+
+    if (fwrite(MAP_SNAPSHOT_MAGIC, 1, 4, file) != 4 ||
+        write_u32(file, MAP_SNAPSHOT_VERSION) != 0 ||
+        write_u32(file, impl->size) != 0 ||
+        write_u32(file, 0) != 0) {
+        return -1;
+    }
+
+    while (result == 0 && i < impl->size) {
+        for (filled = 0; result == 0 && filled < batch_size && i < impl->size; ++filled) {
+            block = &batch[filled];
+            block->raw.length = 0;
+            block->entries = 0;
+
+            while (i < impl->size && block->raw.length < MAP_SNAPSHOT_BLOCK_SIZE) {
+                if (buffer_append_item(&block->raw, codec->serialize_key, impl->entries[i].key, codec->context) != 0 ||
+                    buffer_append_item(&block->raw, codec->serialize_value, impl->entries[i].value, codec->context) != 0) {
+                    result = -1;
+                    break;
+                }
+                block->entries++;
+                i++;
+            }
+        }
+
+        if (result != 0) {
+            break;
+        }
+
+        run_parallel(pack_block, batch, filled);
+
+        for (j = 0; result == 0 && j < filled; ++j) {
+            result = write_block(file, &batch[j]);
+        }
+        blocks += filled;
+    }
+
+    free_blocks(batch, MAP_SNAPSHOT_BATCH);
+
+    /* The block count goes back into the header once it is known */
+    if (result == 0 && (fseek(file, 12, SEEK_SET) != 0 || write_u32(file, blocks) != 0)) {
+        result = -1;
+    }
+
+    return result;
+}
+
+/*
+ * Opens a snapshot and reads its header, leaving the file positioned at
+ * the first block. Returns NULL if the file is missing or not a snapshot.
+ */
+static FILE *open_snapshot(const char *path, unsigned int *count, unsigned int *blocks) {
+    unsigned int version;
+    char magic[4];
+    FILE *file;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, MAP_SNAPSHOT_MAGIC, 4) != 0 ||
+        read_u32(file, &version) != 0 || version != MAP_SNAPSHOT_VERSION ||
+        read_u32(file, count) != 0 || read_u32(file, blocks) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+/*
+ * Reads the stored bytes of one block into the batch, straight into the
+ * payload buffer when the block is not compressed. The lengths have been
+ * checked against the file already.
+ */
+static int read_block(FILE *file, SnapshotBlock *block, unsigned int entries,
+                      unsigned int length, unsigned int stored, unsigned int crc) {
+    SnapshotBuffer *target = stored < length ? &block->packed : &block->raw;
+
+    block->raw.length = 0;
+    block->packed.length = 0;
+    block->entries = entries;
+    block->crc = crc;
+
+    if (buffer_reserve(&block->raw, length) != 0 ||
+        buffer_reserve(&block->packed, stored < length ? stored : 0) != 0 ||
+        (stored && fread(target->data, 1, stored, file) != stored)) {
+        return -1;
+    }
+
+    block->raw.length = length;
+    target->length = stored;
+
+    return 0;
+}
+
+/*
+ * Verifies the checksum of one block of a batch and decompresses its
+ * payload if it was stored compressed. Runs on any thread.
+ */
+static void unpack_block(void *context, unsigned int task) {
+    SnapshotBlock *block = (SnapshotBlock *)context + task;
+
+    block->failed = block_crc(block) != block->crc ||
+        (block->packed.length &&
+         map_lz_decompress(block->packed.data, block->packed.length, block->raw.data, block->raw.length) != 0);
+}
+
+/*
+ * Appends the entries of a verified block to the map. Keys in a snapshot
+ * are already unique, so no lookups are needed.
+ */
+static int load_block(MapImpl *impl, SnapshotBlock *block, const MapCodec *codec) {
+    unsigned int offset = 0;
+    unsigned int i;
+    void *key, *value;
+
+    if (block->failed || grow_entries(impl, impl->size + block->entries) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < block->entries; ++i) {
+        key = buffer_read_item(&block->raw, &offset, codec->deserialize_key, codec->context);
+        value = key ? buffer_read_item(&block->raw, &offset, codec->deserialize_value, codec->context) : NULL;
+
+        if (!key || !value) {
+            free(key);
+            return -1;
+        }
+
+        append_entry(impl, key, value);
+    }
+
+    return 0;
+}
+
+/*
+ * Frees a partly loaded map along with the keys and values rebuilt into
+ * it so far, which nobody else has seen yet.
+ */
+static void discard_loaded(Map *map) {
+    MapImpl *impl = (MapImpl*)map;
+    unsigned int i;
+
+    for (i = 0; i < impl->size; ++i) {
+        free(impl->entries[i].key);
+        free(impl->entries[i].value);
+    }
+
+    map_free(map);
+}
+
+/* --- Trace Helpers --- */
+
+/*
+ * A trace is the magic, a format version and the size of a record, followed
+ * by fixed size records: the operation, three reserved bytes, the key hash
+ * and the nanoseconds since the trace started as two 32 bit halves, low
+ * half first. Integers are little endian, as in snapshots.
+ */
+#define MAP_TRACE_MAGIC       "CMTR"
+#define MAP_TRACE_VERSION     1
+#define MAP_TRACE_RECORD_SIZE 16
+
+/* Records are buffered this many at a time before being written out */
+#define MAP_TRACE_BUFFER_RECORDS 4096
+
+/*
+ * The internal structure behind a MapTracer. Recording threads claim a
+ * record in the buffer by bumping reserved and bump committed once it is
+ * filled in. Whoever claims the first record past the end writes the full
+ * buffer out and resets it, while the others wait for it to do so.
+ */
+struct MapTracer {
+    FILE *file;
+    MapHashFunc hash_func;
+    unsigned long long started;
+    unsigned int reserved;
+    unsigned int committed;
+    int failed;
+    unsigned char *buffer;
+};
+
+/*
+ * A monotonic clock in nanoseconds. Without a POSIX monotonic clock this
+ * falls back to processor time, which is coarse but still ordered. Both
+ * are kept in 64 bits, as an unsigned long wraps within seconds where it
+ * is 32 bits.
+ */
+static unsigned long long trace_clock(void) {
+#if defined(MAP_HAVE_POSIX) && defined(CLOCK_MONOTONIC)
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+#else
+    clock_t now = clock();
+    unsigned long long ticks = now == (clock_t)-1 ? 0 : (unsigned long long)now;
+
+    /* Whole seconds and the rest apart, so nothing is converted out of range */
+    return ticks / CLOCKS_PER_SEC * 1000000000ULL +
+           ticks % CLOCKS_PER_SEC * 1000000000ULL / CLOCKS_PER_SEC;
+#endif
+}
+
+static void trace_flush(MapTracer *tracer, unsigned int records) {
+    if (records && fwrite(tracer->buffer, MAP_TRACE_RECORD_SIZE, records, tracer->file) != records) {
+        tracer->failed = 1;
+    }
+}
+
+/* --- Hash Index Helpers --- */
+
+/*
+ * An open addressing index from hashes to small integer ids, such as
+ * positions in an entry array, probed linearly. Each slot keeps the full
+ * hash so the index can grow without rehashing anything and most probes
+ * are settled without comparing keys. Ids are stored plus one, leaving 0
+ * for empty slots. Several ids may share a hash; callers walk them with
+ * `hash_index_next` and compare the items themselves.
+ */
+typedef struct HashSlot {
+    unsigned int hash;
+    unsigned int id;
+} HashSlot;
+
+typedef struct HashIndex {
+    HashSlot *slots;
+    unsigned int mask;
+    unsigned int used;
+} HashIndex;
+
+/* Indexes start out with this many slots and are kept at most half full */
+#define MAP_HASH_INDEX_MIN_SLOTS 16
+
+static int hash_index_init(HashIndex *index, unsigned int capacity) {
+    unsigned int count = MAP_HASH_INDEX_MIN_SLOTS;
+
+    while (count < capacity * 2) {
+        count *= 2;
+    }
+
+    index->slots = (HashSlot *)calloc(count, sizeof(HashSlot));
+    index->mask = count - 1;
+    index->used = 0;
+
+    return index->slots ? 0 : -1;
+}
+
+static void hash_index_destroy(HashIndex *index) {
+    free(index->slots);
+    index->slots = NULL;
+}
+
+static void hash_index_place(HashSlot *slots, unsigned int mask, unsigned int hash, unsigned int id) {
+    unsigned int i = hash & mask;
+
+    while (slots[i].id) {
+        i = (i + 1) & mask;
+    }
+
+    slots[i].hash = hash;
+    slots[i].id = id + 1;
+}
+
+/*
+ * Grows the index so that count more ids can be inserted without failing.
+ */
+static int hash_index_reserve(HashIndex *index, unsigned int count) {
+    HashSlot *slots;
+    unsigned int mask = index->mask;
+    unsigned int i;
+
+    while ((index->used + count) * 2 > mask + 1) {
+        mask = mask * 2 + 1;
+    }
+
+    if (mask == index->mask) {
+        return 0;
+    }
+
+    slots = (HashSlot *)calloc(mask + 1, sizeof(HashSlot));
+    if (!slots) {
+        return -1;
+    }
+
+    for (i = 0; i <= index->mask; ++i) {
+        if (index->slots[i].id) {
+            hash_index_place(slots, mask, index->slots[i].hash, index->slots[i].id - 1);
+        }
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->mask = mask;
+
+    return 0;
+}
+
+static int hash_index_insert(HashIndex *index, unsigned int hash, unsigned int id) {
+    if (hash_index_reserve(index, 1) != 0) {
+        return -1;
+    }
+
+    hash_index_place(index->slots, index->mask, hash, id);
+    ++index->used;
+
+    return 0;
+}
+
+/*
+ * Returns the next id stored under hash, or -1 when there are no more.
+ * Start a walk with *probe set to 0.
+ */
+static int hash_index_next(const HashIndex *index, unsigned int hash, unsigned int *probe) {
+    unsigned int i;
+
+    for (; *probe <= index->mask; ++*probe) {
+        i = (hash + *probe) & index->mask;
+        if (!index->slots[i].id) {
+            break;
+        }
+        if (index->slots[i].hash == hash) {
+            ++*probe;
+            return (int)index->slots[i].id - 1;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Returns the slot holding id under hash, or -1 if there is none.
+ */
+static int hash_index_slot(const HashIndex *index, unsigned int hash, unsigned int id) {
+    unsigned int i = hash & index->mask;
+
+    while (index->slots[i].id) {
+        if (index->slots[i].id == id + 1) {
+            return (int)i;
+        }
+        i = (i + 1) & index->mask;
+    }
+
+    return -1;
+}
+
+/*
+ * Removes id from under hash, shifting later slots of the probe run back
+ * so that no tombstones are needed.
+ */
+static void hash_index_remove(HashIndex *index, unsigned int hash, unsigned int id) {
+    int found = hash_index_slot(index, hash, id);
+    unsigned int i, j, home;
+
+    if (found < 0) {
+        return;
+    }
+
+    i = j = (unsigned int)found;
+    for (;;) {
+        j = (j + 1) & index->mask;
+        if (!index->slots[j].id) {
+            break;
+        }
+
+        home = index->slots[j].hash & index->mask;
+        if (((j - home) & index->mask) >= ((j - i) & index->mask)) {
+            index->slots[i] = index->slots[j];
+            i = j;
+        }
+    }
+
+    index->slots[i].id = 0;
+    --index->used;
+}
+
+/*
+ * Changes the id stored under hash from old_id to new_id, e.g. after the
+ * item it stands for has moved.
+ */
+static void hash_index_rename(HashIndex *index, unsigned int hash, unsigned int old_id, unsigned int new_id) {
+    int found = hash_index_slot(index, hash, old_id);
+
+    if (found >= 0) {
+        index->slots[found].id = new_id + 1;
+    }
+}
+
+/*
+ * A bimap keeps its pairs in one array, indexed by key hash in one
+ * direction and by value hash in the other. Removing a pair moves the last
+ * one into its place, so only that pair's index slots need updating.
+ */
+typedef struct BimapEntry {
+    void *key;
+    void *value;
+    unsigned int key_hash;
+    unsigned int value_hash;
+} BimapEntry;
+
+struct MapBimap {
+    BimapEntry *entries;
+    unsigned int size;
+    unsigned int capacity;
+    MapKeyCompareFunc key_compare;
+    MapHashFunc key_hash;
+    MapKeyCompareFunc value_compare;
+    MapHashFunc value_hash;
+    HashIndex by_key;
+    HashIndex by_value;
+};
+
+static int bimap_find_key(MapBimap *bimap, const void *key, unsigned int hash) {
+    unsigned int probe = 0;
+    int id;
+
+    while ((id = hash_index_next(&bimap->by_key, hash, &probe)) >= 0) {
+        if (bimap->key_compare(bimap->entries[id].key, key) == 0) {
+            return id;
+        }
+    }
+
+    return -1;
+}
+
+static int bimap_find_value(MapBimap *bimap, const void *value, unsigned int hash) {
+    unsigned int probe = 0;
+    int id;
+
+    while ((id = hash_index_next(&bimap->by_value, hash, &probe)) >= 0) {
+        if (bimap->value_compare(bimap->entries[id].value, value) == 0) {
+            return id;
+        }
+    }
+
+    return -1;
+}
+
+static void bimap_remove_at(MapBimap *bimap, unsigned int index) {
+    BimapEntry *entry = &bimap->entries[index];
+    unsigned int last = bimap->size - 1;
+
+    hash_index_remove(&bimap->by_key, entry->key_hash, index);
+    hash_index_remove(&bimap->by_value, entry->value_hash, index);
+
+    if (index != last) {
+        *entry = bimap->entries[last];
+        hash_index_rename(&bimap->by_key, entry->key_hash, last, index);
+        hash_index_rename(&bimap->by_value, entry->value_hash, last, index);
+    }
+
+    --bimap->size;
+}
+
+/* --- Secondary Index Helpers --- */
+
+/*
+ * A secondary index keeps one record per entry of its map with the field
+ * extracted from the entry's value. Records are found by field through one
+ * hash index and by key through another, hashed on the key pointer the map
+ * stores, so that an entry can be reindexed even after its value was
+ * changed in place. Like bimap pairs, removed records are replaced by the
+ * last one.
+ */
+typedef struct IndexRecord {
+    void *key;
+    void *value;
+    const void *field;
+    unsigned int hash;
+} IndexRecord;
+
+struct MapIndex {
+    MapImpl *impl;
+    MapFieldFunc field_func;
+    void *context;
+    MapKeyCompareFunc compare_func;
+    MapHashFunc hash_func;
+    int unique;
+    IndexRecord *records;
+    unsigned int size;
+    unsigned int capacity;
+    HashIndex by_field;
+    HashIndex by_key;
+    MapIndex *next;
+};
+
+static int index_find_key(MapIndex *index, const void *key) {
+    unsigned int hash = mix_bits((size_t)key);
+    unsigned int probe = 0;
+    int id;
+
+    while ((id = hash_index_next(&index->by_key, hash, &probe)) >= 0) {
+        if (index->records[id].key == key) {
+            return id;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Returns the next record whose field equals field, or -1 when there are
+ * no more. Start a walk with *probe set to 0.
+ */
+static int index_next_match(MapIndex *index, const void *field, unsigned int hash, unsigned int *probe) {
+    int id;
+
+    while ((id = hash_index_next(&index->by_field, hash, probe)) >= 0) {
+        if (index->compare_func(index->records[id].field, field) == 0) {
+            return id;
+        }
+    }
+
+    return -1;
+}
+
+static void index_remove_at(MapIndex *index, unsigned int id) {
+    IndexRecord *record = &index->records[id];
+    unsigned int last = index->size - 1;
+
+    hash_index_remove(&index->by_field, record->hash, id);
+    hash_index_remove(&index->by_key, mix_bits((size_t)record->key), id);
+
+    if (id != last) {
+        *record = index->records[last];
+        hash_index_rename(&index->by_field, record->hash, last, id);
+        hash_index_rename(&index->by_key, mix_bits((size_t)record->key), last, id);
+    }
+
+    --index->size;
+}
+
+/*
+ * Makes sure the entry with the given key and value can be put into the
+ * index without failing: there is room for one more record and, for a
+ * unique index, no other entry has the same field.
+ */
+static int index_prepare(MapIndex *index, const void *key, const void *value) {
+    const void *field = index->field_func(key, value, index->context);
+    unsigned int probe = 0;
+    IndexRecord *records;
+    unsigned int capacity;
+    int id;
+
+    if (index->unique) {
+        while ((id = index_next_match(index, field, index->hash_func(field), &probe)) >= 0) {
+            if (index->records[id].key != key) {
+                return -1;
+            }
+        }
+    }
+
+    if (index->size == index->capacity) {
+        capacity = index->capacity ? index->capacity * 2 : 8;
+        records = (IndexRecord *)realloc(index->records, sizeof(IndexRecord) * capacity);
+        if (!records) {
+            return -1;
+        }
+        index->records = records;
+        index->capacity = capacity;
+    }
+
+    if (hash_index_reserve(&index->by_field, 1) != 0 || hash_index_reserve(&index->by_key, 1) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Records the current value of an entry, replacing any earlier record of
+ * the same key. `index_prepare` must have succeeded first.
+ */
+static void index_put(MapIndex *index, void *key, void *value) {
+    IndexRecord *record;
+    int id = index_find_key(index, key);
+
+    if (id < 0) {
+        id = (int)index->size++;
+        hash_index_insert(&index->by_key, mix_bits((size_t)key), (unsigned int)id);
+    }
+    else {
+        hash_index_remove(&index->by_field, index->records[id].hash, (unsigned int)id);
+    }
+
+    record = &index->records[id];
+    record->key = key;
+    record->value = value;
+    record->field = index->field_func(key, value, index->context);
+    record->hash = index->hash_func(record->field);
+    hash_index_insert(&index->by_field, record->hash, (unsigned int)id);
+}
+
+/*
+ * Brings every index of a map up to date with an entry that is about to be
+ * added or to get a new value. Key must be the pointer the map stores.
+ * Fails without changing anything if memory runs out or a unique index
+ * already holds the entry's field for another key.
+ */
+static int index_entry(MapImpl *impl, void *key, void *value) {
+    MapIndex *index;
+
+    for (index = impl->indexes; index; index = index->next) {
+        if (index_prepare(index, key, value) != 0) {
+            return -1;
+        }
+    }
+
+    for (index = impl->indexes; index; index = index->next) {
+        index_put(index, key, value);
+    }
+
+    return 0;
+}
+
+/*
+ * Drops an entry that is about to be removed from every index of a map.
+ */
+static void unindex_entry(MapImpl *impl, const void *key) {
+    MapIndex *index;
+    int id;
+
+    for (index = impl->indexes; index; index = index->next) {
+        id = index_find_key(index, key);
+        if (id >= 0) {
+            index_remove_at(index, (unsigned int)id);
+        }
+    }
+}
+
+/*
+ * An entry overwritten by a merge, with the value it had before.
+ */
+typedef struct MergeUndo {
+    unsigned int index;
+    void *value;
+} MergeUndo;
+
+/*
+ * Undoes a merge that failed part way: drops the entries it appended and
+ * gives overwritten ones back their old values, latest change first so an
+ * entry overwritten twice ends up as it was. Reindexing only replaces or
+ * removes records, which never allocates, so this cannot fail.
+ */
+static void merge_undo(MapImpl *impl, const MergeUndo *undo, unsigned int changed, unsigned int size) {
+    MapIndex *index;
+    MapEntry *entry;
+
+    while (impl->size > size) {
+        unindex_entry(impl, impl->entries[impl->size - 1].key);
+        impl->size--;
+    }
+
+    while (changed--) {
+        if (undo[changed].index >= size) {
+            continue;
+        }
+
+        entry = &impl->entries[undo[changed].index];
+        entry->value = undo[changed].value;
+        for (index = impl->indexes; index; index = index->next) {
+            index_put(index, entry->key, entry->value);
+        }
+    }
+}
+
+static void index_destroy(MapIndex *index) {
+    hash_index_destroy(&index->by_field);
+    hash_index_destroy(&index->by_key);
+    free(index->records);
+    free(index);
+}
+
+/* --- Sketch Helpers --- */
+
+/* Each row of a sketch takes one 64-bit lane of an AVX-512 register */
+#define MAP_SKETCH_MAX_DEPTH 8
+
+/* Keeps every cell offset of a full depth sketch a positive 32-bit int */
+#define MAP_SKETCH_MAX_WIDTH (1U << 27)
+
+/*
+ * A count-min sketch keeps its counters row after row in one array. A key
+ * has one cell in each row, picked from its hash by double hashing, and
+ * its estimate is the smallest of them. The keys with the highest
+ * estimates are kept in a min-heap of counters, found by hash through an
+ * index, so the coldest of them is always at hand to be pushed out.
+ */
+struct MapSketch {
+    unsigned long long *counters;
+    unsigned int width;
+    unsigned int depth;
+    unsigned long total;
+    MapHashFunc hash_func;
+    SamplerCounter *hitters;
+    unsigned int used;
+    unsigned int capacity;
+    HashIndex by_hash;
+};
+
+/*
+ * Adds amount to the cells of a key the conservative way: a cell is only
+ * raised as far as the key's new estimate, so rarer keys sharing it are
+ * overstated less. Returns the new estimate; adding 0 looks it up.
+ */
+static unsigned long long sketch_add_scalar(unsigned long long *counters, const unsigned int *cells,
+                                            unsigned int depth, unsigned long long amount) {
+    unsigned long long least = counters[cells[0]];
+    unsigned int i;
+
+    for (i = 1; i < depth; ++i) {
+        if (counters[cells[i]] < least) {
+            least = counters[cells[i]];
+        }
+    }
+
+    least += amount;
+    for (i = 0; i < depth; ++i) {
+        if (counters[cells[i]] < least) {
+            counters[cells[i]] = least;
+        }
+    }
+
+    return least;
+}
+
+#ifdef MAP_HAVE_AVX512
+/*
+ * Reads the cells of every row with one gather and writes back those to
+ * raise with one scatter. A key's cells all lie in different rows, so no
+ * two lanes of the scatter ever hit the same counter.
+ */
+__attribute__((target("avx512f")))
+static unsigned long long sketch_add_avx512(unsigned long long *counters, const unsigned int *cells,
+                                            unsigned int depth, unsigned long long amount) {
+    __mmask8 rows = (__mmask8)((1U << depth) - 1);
+    __m256i offsets = _mm256_loadu_si256((const __m256i *)cells);
+    __m512i seen = _mm512_mask_i32gather_epi64(_mm512_setzero_si512(), rows, offsets, counters, 8);
+    unsigned long long least = _mm512_mask_reduce_min_epu64(rows, seen) + amount;
+    __m512i raised = _mm512_set1_epi64((long long)least);
+
+    _mm512_mask_i32scatter_epi64(counters, _mm512_mask_cmplt_epu64_mask(rows, seen, raised),
+                                 offsets, raised, 8);
+
+    return least;
+}
+#endif
+
+/*
+ * Works out the offset of a hash's cell in every row, up to the maximum
+ * depth so the kernels can always load a whole vector of them.
+ */
+static void sketch_cells(const MapSketch *sketch, unsigned int hash, unsigned int *cells) {
+    unsigned int step = mix_bits((size_t)hash) | 1;
+    unsigned int i;
+
+    for (i = 0; i < MAP_SKETCH_MAX_DEPTH; ++i) {
+        cells[i] = i * sketch->width + ((hash + i * step) & (sketch->width - 1));
+    }
+}
+
+/*
+ * Swaps two heap positions, pointing their index slots at each other's
+ * place. Both slots are found before either changes, as a lookup matches
+ * on the id alone.
+ */
+static void sketch_swap(MapSketch *sketch, unsigned int a, unsigned int b) {
+    SamplerCounter held = sketch->hitters[a];
+    int slot_a = hash_index_slot(&sketch->by_hash, sketch->hitters[a].hash, a);
+    int slot_b = hash_index_slot(&sketch->by_hash, sketch->hitters[b].hash, b);
+
+    sketch->by_hash.slots[slot_a].id = b + 1;
+    sketch->by_hash.slots[slot_b].id = a + 1;
+
+    sketch->hitters[a] = sketch->hitters[b];
+    sketch->hitters[b] = held;
+}
+
+static void sketch_sift_up(MapSketch *sketch, unsigned int i) {
+    unsigned int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (sketch->hitters[parent].count <= sketch->hitters[i].count) {
+            break;
+        }
+        sketch_swap(sketch, i, parent);
+        i = parent;
+    }
+}
+
+static void sketch_sift_down(MapSketch *sketch, unsigned int i) {
+    unsigned int child;
+
+    while ((child = 2 * i + 1) < sketch->used) {
+        if (child + 1 < sketch->used &&
+            sketch->hitters[child + 1].count < sketch->hitters[child].count) {
+            ++child;
+        }
+        if (sketch->hitters[i].count <= sketch->hitters[child].count) {
+            break;
+        }
+        sketch_swap(sketch, i, child);
+        i = child;
+    }
+}
+
+/*
+ * Records a key's new estimate among the heavy hitters: updating it if it
+ * is already there, adding it while there is room, and otherwise taking
+ * the place of the coldest one if it now beats it. The index was sized
+ * for every hitter when the sketch was made, so inserting never fails.
+ */
+static void sketch_track(MapSketch *sketch, unsigned int hash, unsigned long estimate) {
+    unsigned int probe = 0;
+    int id = hash_index_next(&sketch->by_hash, hash, &probe);
+
+    if (id >= 0) {
+        /* Estimates only grow, so a hitter can only sink in a min-heap */
+        sketch->hitters[id].count = estimate;
+        sketch_sift_down(sketch, (unsigned int)id);
+    }
+    else if (sketch->used < sketch->capacity) {
+        sketch->hitters[sketch->used].hash = hash;
+        sketch->hitters[sketch->used].count = estimate;
+        hash_index_insert(&sketch->by_hash, hash, sketch->used);
+        sketch_sift_up(sketch, sketch->used++);
+    }
+    else if (sketch->used && estimate > sketch->hitters[0].count) {
+        hash_index_remove(&sketch->by_hash, sketch->hitters[0].hash, 0);
+        sketch->hitters[0].hash = hash;
+        sketch->hitters[0].count = estimate;
+        hash_index_insert(&sketch->by_hash, hash, 0);
+        sketch_sift_down(sketch, 0);
+    }
+}
+
+/* --- CPU Dispatch --- */
+
+static const char *const cpu_level_names[] = { "scalar", "sse2", "sse4.2", "avx2", "avx512" };
+
+static MapKernels kernels;
+static int kernels_level = -1;
+
+/*
+ * Works out the highest level of vector instructions the CPU (and the
+ * operating system, for the wider registers) supports.
+ */
+static MapCpuLevel detect_cpu_level(void) {
+    MapCpuLevel level = MAP_CPU_SCALAR;
+
+#ifdef MAP_HAVE_CRC32C_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        level = MAP_CPU_SSE2;
+        if (__builtin_cpu_supports("sse4.2")) {
+            level = MAP_CPU_SSE42;
+            if (__builtin_cpu_supports("avx2")) {
+                level = MAP_CPU_AVX2;
+                if (__builtin_cpu_supports("avx512bw")) {
+                    level = MAP_CPU_AVX512;
+                }
+            }
+        }
+    }
+#endif
+
+    return level;
+}
+
+/*
+ * Points every kernel at the best version available at the given level,
+ * falling back to plain C for those with nothing faster.
+ */
+static void bind_kernels(MapCpuLevel level) {
+    kernels.compare_strings = compare_strings_scalar;
+    kernels.compare_bytes = compare_bytes_scalar;
+    kernels.match_tags = match_tags_scalar;
+    kernels.crc32c = crc32c_software;
+    kernels.sketch_add = sketch_add_scalar;
+
+#ifdef MAP_HAVE_SSE2
+    if (level >= MAP_CPU_SSE2) {
+        kernels.compare_strings = compare_strings_sse2;
+        kernels.compare_bytes = compare_bytes_sse2;
+        kernels.match_tags = match_tags_sse2;
+    }
+#endif
+#ifdef MAP_HAVE_CRC32C_SSE42
+    if (level >= MAP_CPU_SSE42) {
+        kernels.crc32c = crc32c_sse42;
+    }
+#endif
+#ifdef MAP_HAVE_AVX2
+    if (level >= MAP_CPU_AVX2) {
+        kernels.compare_strings = compare_strings_avx2;
+        kernels.compare_bytes = compare_bytes_avx2;
+        kernels.match_tags = match_tags_avx2;
+    }
+#endif
+#ifdef MAP_HAVE_AVX512
+    if (level >= MAP_CPU_AVX512) {
+        kernels.compare_strings = compare_strings_avx512;
+        kernels.compare_bytes = compare_bytes_avx512;
+        kernels.match_tags = match_tags_avx512;
+        kernels.sketch_add = sketch_add_avx512;
+    }
+#endif
+
+    MAP_ATOMIC_STORE(&kernels_level, (int)level);
+}
+
+/*
+ * Binds the kernels for the detected level, capped by the MAP_CPU_LEVEL
+ * environment variable if it names a lower one. This runs when the
+ * library is loaded where the compiler allows, so that threads never race
+ * to do it, and otherwise on first use.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor))
+#endif
+static void init_kernels(void) {
+    MapCpuLevel level = detect_cpu_level();
+    const char *name = getenv("MAP_CPU_LEVEL");
+    int i;
+
+    for (i = 0; name && i <= (int)level; ++i) {
+        if (strcmp(name, cpu_level_names[i]) == 0) {
+            level = (MapCpuLevel)i;
+        }
+    }
+
+    bind_kernels(level);
+}
+
+static const MapKernels *map_kernels(void) {
+    if (MAP_ATOMIC_LOAD(&kernels_level) < 0) {
+        init_kernels();
+    }
+
+    return &kernels;
+}
+
+/* --- Public API Functions --- */
+
+int map_compare_string_keys(const void *key1, const void *key2) {
+  return compare_strings(key1, key2, 0);
+}
+
+int map_compare_string_keys_ignoring_case(const void *key1, const void *key2) {
+  return compare_strings(key1, key2, 1);
+}
+
+int map_compare_sized_keys(const void *key1, const void *key2) {
+  const MapSizedKey *sized1 = (const MapSizedKey *)key1;
+  const MapSizedKey *sized2 = (const MapSizedKey *)key2;
+  unsigned int shorter = sized1->length < sized2->length ? sized1->length : sized2->length;
+  int result = compare_bytes(sized1->bytes, sized2->bytes, shorter);
+
+  if (result != 0) {
+    return result < 0 ? -1 : 1;
+  }
+
+  return sized1->length < sized2->length ? -1 : (sized1->length > sized2->length);
+}
+
+int map_compare_int_keys(const void *intPtr1, const void *intPtr2) {
+  int int1 = *((const int *)intPtr1);
+  int int2 = *((const int *)intPtr2);
+
+  return int1 < int2 ? -1 : (int1 > int2 ? 1 : 0);
+}
+
+int map_compare_uint_keys(const void *uintPtr1, const void *uintPtr2) {
+  unsigned int int1 = *((const unsigned int *)uintPtr1);
+  unsigned int int2 = *((const unsigned int *)uintPtr2);
+
+  return int1 < int2 ? -1 : (int1 > int2 ? 1 : 0);
+}
+
+int map_compare_float_keys(const void *floatPtr1, const void *floatPtr2) {
+  float float1 = *((const float *)floatPtr1);
+  float float2 = *((const float *)floatPtr2);
+
+  if (float1 == float2) {
+    return 0;
+  }
+
+  /* NaN matches nothing, not even itself, and orders after every number */
+  return float1 < float2 || float2 != float2 ? -1 : 1;
+}
+
+int map_compare_double_keys(const void *doublePtr1, const void *doublePtr2) {
+  double double1 = *((const double *)doublePtr1);
+  double double2 = *((const double *)doublePtr2);
+
+  if (double1 == double2) {
+    return 0;
+  }
+
+  /* NaN matches nothing, not even itself, and orders after every number */
+  return double1 < double2 || double2 != double2 ? -1 : 1;
+}
+
+int map_compare_ptr_keys(const void *ptrKey1, const void *ptrKey2) {
+  return ptrKey1 == ptrKey2;
+}
+
+unsigned int map_hash_string(const void *key) {
+  const unsigned char *s = (const unsigned char *)key;
+  unsigned int hash = 2166136261u;
+
+  while (*s) {
+    hash = (hash ^ *s++) * 16777619u;
+  }
+
+  return hash;
+}
+
+unsigned int map_hash_sized_key(const void *key) {
+  const MapSizedKey *sized = (const MapSizedKey *)key;
+  const unsigned char *bytes = (const unsigned char *)sized->bytes;
+  unsigned int hash = 2166136261u;
+  unsigned int i;
+
+  for (i = 0; i < sized->length; ++i) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+unsigned int map_hash_int(const void *intPtr) {
+  return mix_bits((size_t)*(const unsigned int *)intPtr);
+}
+
+unsigned int map_hash_ptr(const void *ptrKey) {
+  return mix_bits((size_t)ptrKey);
+}
+
+void map_free(Map *map) {
+    MapImpl *impl = (MapImpl*)map;
+    MapIndex *index;
+
+    if (!map) {
+        return;
+    }
+
+    while (impl->indexes) {
+        index = impl->indexes;
+        impl->indexes = index->next;
+        index_destroy(index);
+    }
+
+    release_account(impl->account, table_bytes(impl));
+    free(impl->entries);
+    free(impl->tags);
+    free(impl->hits);
+    free(impl);
+}
+
+int map_set(Map *map, void *key, void *value) {
+    int index;
+    MapImpl *impl;
+
+    if (!map) {
+        return -1;
+    }
+
+    impl = (MapImpl*)map;
+
+    if (impl->sampler) {
+        map_sampler_record(impl->sampler, key);
+    }
+    if (impl->tracer) {
+        map_tracer_record(impl->tracer, MAP_TRACE_SET, key);
+    }
+
+    /* First, check if the key already exists and update it */
+    index = find_entry_index(map, key);
+    if (index != -1) {
+        if (impl->indexes && index_entry(impl, impl->entries[index].key, value) != 0) {
+            return -1;
+        }
+        impl->entries[index].value = value;
+        return 0;
+    }
+
+    /* If the map is full, resize it */
+    if (impl->size >= impl->capacity) {
+        if (grow_entries(impl, impl->capacity * 2) != 0) {
+            return -1;
+        }
+    }
+
+    if (impl->indexes && index_entry(impl, key, value) != 0) {
+        return -1;
+    }
+
+    /* Add the new key-value pair */
+    append_entry(impl, key, value);
+
+    return 0;
+}
+
+void *map_get(Map *map, const void *key) {
+    MapImpl *impl = (MapImpl*)map;
+    int index;
+
+    if (!map) {
+        return NULL;
+    }
+
+    if (impl->sampler) {
+        map_sampler_record(impl->sampler, key);
+    }
+    if (impl->tracer) {
+        map_tracer_record(impl->tracer, MAP_TRACE_GET, key);
+    }
+
+    index = find_entry_index(map, key);
+
+    if (index != -1) {
+        if (impl->organize > MAP_ORGANIZE_TAGS) {
+            index = organize_hit(impl, index);
+        }
+        return impl->entries[index].value;
+    }
+
+    return NULL;
+}
+
+void map_delete(Map *map, const void *key) {
+    MapImpl *impl = (MapImpl*)map;
+    int index;
+
+    if (!map) {
+        return;
+    }
+
+    if (impl->tracer) {
+        map_tracer_record(impl->tracer, MAP_TRACE_DELETE, key);
+    }
+
+    index = find_entry_index(map, key);
+    if (index != -1) {
+        if (impl->indexes) {
+            unindex_entry(impl, impl->entries[index].key);
+        }
+        remove_entry_at(impl, index);
+    }
+}
+
+int map_reserve(Map *map, unsigned int capacity) {
+    if (!map) {
+        return -1;
+    }
+
+    return grow_entries((MapImpl*)map, capacity);
+}
+
+Map *map_clone(Map *map) {
+    MapImpl *impl = (MapImpl*)map;
+    MapImpl *copy;
+
+    if (!map) {
+        return NULL;
+    }
+
+    copy = (MapImpl *)malloc(sizeof(MapImpl));
+    if (!copy) {
+        return NULL;
+    }
+
+    memcpy(copy, impl, sizeof(MapImpl));
+    copy->generation = 0;
+    copy->sampler = NULL;
+    copy->tracer = NULL;
+
+    /* Organization is set up afresh for the copy once it has its entries */
+    copy->organize = MAP_ORGANIZE_NONE;
+    copy->tags = NULL;
+    copy->hits = NULL;
+    copy->indexes = NULL;
+
+    /* The copy belongs to the same account as the original */
+    if (charge_account(copy->account, table_bytes(copy)) != 0) {
+        free(copy);
+        return NULL;
+    }
+
+    copy->entries = (MapEntry *)malloc(sizeof(MapEntry) * impl->capacity);
+    if (!copy->entries) {
+        release_account(copy->account, table_bytes(copy));
+        free(copy);
+        return NULL;
+    }
+
+    memcpy(copy->entries, impl->entries, sizeof(MapEntry) * impl->size);
+
+    if (map_organize((Map*)copy, impl->organize, impl->threshold) != 0) {
+        map_free((Map*)copy);
+        return NULL;
+    }
+
+    return (struct Map*)copy;
+}
+
+int map_merge(Map *dst, Map *src, MapMergePolicy policy) {
+    MapImpl *to = (MapImpl*)dst;
+    MapImpl *from = (MapImpl*)src;
+    MergeUndo *undo = NULL;
+    unsigned int limit, size, changed = 0;
+    unsigned int i;
+    int index, same;
+
+    if (!dst || !src) {
+        return -1;
+    }
+
+    if (dst == src) {
+        return 0;
+    }
+
+    /* The combined size must be countable before room is made for it */
+    if (from->size > (unsigned int)-1 - to->size) {
+        return -1;
+    }
+
+    if (to->size + from->size > to->capacity &&
+        grow_entries(to, to->size + from->size) != 0) {
+        return -1;
+    }
+
+    /* Overwrites are logged so that a unique index clash can undo them */
+    if (to->indexes) {
+        undo = (MergeUndo *)malloc(sizeof(MergeUndo) * (from->size ? from->size : 1));
+        if (!undo) {
+            return -1;
+        }
+    }
+    size = to->size;
+
+    /*
+     * Keys within src are distinct under its comparator, so when dst uses the
+     * same one a src key can only collide with an entry dst already had.
+     */
+    same = to->compare_func == from->compare_func;
+    limit = same ? to->size : 0;
+
+    for (i = 0; i < from->size; ++i) {
+        /* With nothing to collide with, an empty dst needs no lookups at all */
+        index = same && !limit ? -1
+            : find_entry_index_below(to, from->entries[i].key, same ? limit : to->size);
+
+        if (index != -1) {
+            if (policy == MAP_MERGE_OVERWRITE) {
+                if (to->indexes) {
+                    if (index_entry(to, to->entries[index].key, from->entries[i].value) != 0) {
+                        break;
+                    }
+                    undo[changed].index = (unsigned int)index;
+                    undo[changed].value = to->entries[index].value;
+                    changed++;
+                }
+                to->entries[index].value = from->entries[i].value;
+            }
+            continue;
+        }
+
+        if (to->indexes && index_entry(to, from->entries[i].key, from->entries[i].value) != 0) {
+            break;
+        }
+        append_entry(to, from->entries[i].key, from->entries[i].value);
+    }
+
+    if (i < from->size) {
+        merge_undo(to, undo, changed, size);
+    }
+
+    free(undo);
+
+    return i < from->size ? -1 : 0;
+}
+
+int map_diff(Map *a, Map *b, const MapDiffCallbacks *callbacks, void *context) {
+    return map_diff_hashed(a, b, NULL, callbacks, context);
+}
+
+int map_diff_hashed(Map *a, Map *b, MapHashFunc hash_func,
+                    const MapDiffCallbacks *callbacks, void *context) {
+    MapImpl *old_impl = (MapImpl*)a;
+    MapImpl *new_impl = (MapImpl*)b;
+    MapEntry *entry;
+    HashIndex index;
+    unsigned char *seen = NULL;
+    unsigned int i, hash, probe;
+    int offset;
+    int found;
+    int differences = 0;
+
+    if (!a || !b || !callbacks) {
+        return -1;
+    }
+
+    /*
+     * With a hash function every key of b is looked up through a temporary
+     * index over a, and the entries of a that were found are marked. The
+     * index is over a rather than b so that differences are reported in
+     * the same order as without one.
+     */
+    if (hash_func) {
+        if (hash_index_init(&index, old_impl->size) != 0) {
+            return -1;
+        }
+
+        seen = (unsigned char *)calloc(old_impl->size ? old_impl->size : 1, 1);
+        for (i = 0; seen && i < old_impl->size; ++i) {
+            if (hash_index_insert(&index, hash_func(old_impl->entries[i].key), i) != 0) {
+                free(seen);
+                seen = NULL;
+            }
+        }
+
+        if (!seen) {
+            hash_index_destroy(&index);
+            return -1;
+        }
+    }
+
+    /*
+     * Walk b looking each key up in a. Without a hash function the offset
+     * tracks how far apart the previous match was, so shifted runs of
+     * entries keep hitting the hint.
+     */
+    offset = 0;
+    for (i = 0; i < new_impl->size; ++i) {
+        entry = &new_impl->entries[i];
+
+        if (seen) {
+            hash = hash_func(entry->key);
+            probe = 0;
+            do {
+                found = hash_index_next(&index, hash, &probe);
+            } while (found != -1 && old_impl->compare_func(old_impl->entries[found].key, entry->key) != 0);
+        }
+        else {
+            found = find_entry_index_near(old_impl, entry->key, (int)i + offset);
+        }
+
+        if (found == -1) {
+            differences++;
+            if (callbacks->added) {
+                callbacks->added(entry->key, entry->value, context);
+            }
+            continue;
+        }
+
+        if (seen) {
+            seen[found] = 1;
+        }
+        else {
+            offset = found - (int)i;
+        }
+
+        if (old_impl->entries[found].value != entry->value) {
+            differences++;
+            if (callbacks->changed) {
+                callbacks->changed(entry->key, old_impl->entries[found].value,
+                                   entry->value, context);
+            }
+        }
+    }
+
+    /* Anything in a that b lacks has been removed */
+    offset = 0;
+    for (i = 0; i < old_impl->size; ++i) {
+        entry = &old_impl->entries[i];
+
+        if (seen) {
+            found = seen[i] ? (int)i : -1;
+        }
+        else {
+            found = find_entry_index_near(new_impl, entry->key, (int)i + offset);
+            if (found != -1) {
+                offset = found - (int)i;
+            }
+        }
+
+        if (found == -1) {
+            differences++;
+            if (callbacks->removed) {
+                callbacks->removed(entry->key, entry->value, context);
+            }
+        }
+    }
+
+    if (seen) {
+        free(seen);
+        hash_index_destroy(&index);
+    }
+
+    return differences;
+}
+
+int map_export_sorted(Map *map, void **out_keys, void **out_values,
+                      MapSortOrder order) {
+    MapImpl *impl = (MapImpl*)map;
+    MapEntry *sorted;
+    unsigned int i, at;
+
+    if (!map) {
+        return -1;
+    }
+
+    if (impl->size == 0) {
+        return 0;
+    }
+
+    sorted = (MapEntry *)malloc(sizeof(MapEntry) * impl->size);
+    if (!sorted) {
+        return -1;
+    }
+
+    memcpy(sorted, impl->entries, sizeof(MapEntry) * impl->size);
+    if (sort_entries(sorted, impl->size, impl->compare_func) != 0) {
+        free(sorted);
+        return -1;
+    }
+
+    for (i = 0; i < impl->size; ++i) {
+        at = order == MAP_SORT_DESCENDING ? impl->size - 1 - i : i;
+
+        if (out_keys) {
+            out_keys[i] = sorted[at].key;
+        }
+        if (out_values) {
+            out_values[i] = sorted[at].value;
+        }
+    }
+
+    free(sorted);
+    return (int)impl->size;
+}
+
+int map_join(Map *map, void **keys, unsigned int count,
+             MapJoinFunc callback, void *context) {
+    MapImpl *impl = (MapImpl*)map;
+    MapEntry *rows;
+    unsigned int i;
+    int *found;
+    int index;
+    int matches = 0;
+
+    if (!map || (!keys && count) || !callback) {
+        return -1;
+    }
+
+    /* Small inputs are cheaper to probe directly than to sort */
+    if (count < MAP_RADIX_CUTOFF || impl->size < MAP_RADIX_CUTOFF) {
+        for (i = 0; i < count; ++i) {
+            index = find_entry_index(map, keys[i]);
+            if (index != -1) {
+                matches++;
+                callback(i, impl->entries[index].key, impl->entries[index].value, context);
+            }
+        }
+        return matches;
+    }
+
+    rows = (MapEntry *)malloc(sizeof(MapEntry) * count);
+    found = (int *)malloc(sizeof(int) * count);
+    if (!rows || !found) {
+        free(rows);
+        free(found);
+        return -1;
+    }
+
+    /* Each row remembers where it came from through its value pointer */
+    for (i = 0; i < count; ++i) {
+        rows[i].key = keys[i];
+        rows[i].value = &keys[i];
+    }
+
+    if (match_sorted_rows(impl, rows, count, found) != 0) {
+        free(rows);
+        free(found);
+        return -1;
+    }
+
+    /* The callback only ever runs here, on the calling thread, in key order */
+    for (i = 0; i < count; ++i) {
+        if (found[i] != -1) {
+            matches++;
+            callback((unsigned int)((void **)rows[i].value - keys),
+                     impl->entries[found[i]].key, impl->entries[found[i]].value, context);
+        }
+    }
+
+    free(rows);
+    free(found);
+    return matches;
+}
+
+int map_group_by(Map *map, void **keys, void **rows, unsigned int count,
+                 MapAggregateFunc aggregate, void *context) {
+    MapImpl *impl = (MapImpl*)map;
+    MapEntry *sorted;
+    void *accumulator;
+    unsigned int i, end;
+    int *found;
+    int index;
+    int groups = 0;
+
+    if (!map || (count && (!keys || !rows)) || !aggregate) {
+        return -1;
+    }
+
+    sorted = (MapEntry *)malloc(sizeof(MapEntry) * (count ? count : 1));
+    found = (int *)malloc(sizeof(int) * (count ? count : 1));
+    if (!sorted || !found) {
+        free(sorted);
+        free(found);
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        sorted[i].key = keys[i];
+        sorted[i].value = rows[i];
+    }
+
+    /*
+     * Every row is matched to its entry up front. Entries never move while
+     * groups are stored below, as existing ones are updated in place and
+     * new ones appended, so the matches stay valid throughout.
+     */
+    if (match_sorted_rows(impl, sorted, count, found) != 0) {
+        free(sorted);
+        free(found);
+        return -1;
+    }
+
+    /* Fold each run of equal keys locally, touching the map once per run */
+    for (i = 0; i < count; i = end) {
+        index = found[i];
+        accumulator = index != -1 ? impl->entries[index].value : NULL;
+
+        for (end = i; end < count &&
+             compare_entries(&sorted[i], &sorted[end], impl->compare_func) == 0; ++end) {
+            accumulator = aggregate(accumulator, sorted[end].value, context);
+        }
+
+        if (index != -1) {
+            if (impl->indexes && index_entry(impl, impl->entries[index].key, accumulator) != 0) {
+                break;
+            }
+            impl->entries[index].value = accumulator;
+        }
+        else if ((impl->size >= impl->capacity && grow_entries(impl, impl->capacity * 2) != 0) ||
+                 (impl->indexes && index_entry(impl, sorted[i].key, accumulator) != 0)) {
+            break;
+        }
+        else {
+            /* The key is known to be missing, so it is appended without a lookup */
+            append_entry(impl, sorted[i].key, accumulator);
+        }
+        groups++;
+    }
+
+    free(sorted);
+    free(found);
+    return i < count ? -1 : groups;
+}
+
+const void *map_serialize_string(const void *item, unsigned int *length, void *context) {
+    (void)context;
+
+    *length = item ? (unsigned int)strlen((const char *)item) + 1 : 0;
+    return item;
+}
+
+void *map_deserialize_string(const void *bytes, unsigned int length, void *context) {
+    char *string;
+
+    (void)context;
+
+    string = (char *)malloc(length + 1);
+    if (!string) {
+        return NULL;
+    }
+
+    memcpy(string, bytes, length);
+    string[length] = '\0';
+
+    return string;
+}
+
+int map_save(Map *map, const char *path, const MapCodec *codec) {
+    char *temp_path;
+    FILE *file;
+    int result;
+
+    if (!map || !path || !codec || !codec->serialize_key || !codec->serialize_value) {
+        return -1;
+    }
+
+    temp_path = (char *)malloc(strlen(path) + 5);
+    if (!temp_path) {
+        return -1;
+    }
+    strcpy(temp_path, path);
+    strcat(temp_path, ".tmp");
+
+    file = fopen(temp_path, "wb");
+    if (!file) {
+        free(temp_path);
+        return -1;
+    }
+
+    result = write_snapshot((MapImpl*)map, file, codec);
+    if (fclose(file) != 0) {
+        result = -1;
+    }
+
+    if (result == 0 && rename(temp_path, path) != 0) {
+        result = -1;
+    }
+
+    if (result != 0) {
+        remove(temp_path);
+    }
+
+    free(temp_path);
+    return result;
+}
+
+int map_snapshot_block_count(const char *path) {
+    unsigned int count, blocks;
+    FILE *file;
+
+    if (!path) {
+        return -1;
+    }
+
+    file = open_snapshot(path, &count, &blocks);
+    if (!file) {
+        return -1;
+    }
+
+    fclose(file);
+    return (int)blocks;
+}
+
+Map *map_load_blocks(const char *path, MapKeyCompareFunc compare_func, const MapCodec *codec,
+                     unsigned int first_block, unsigned int block_count) {
+    SnapshotBlock batch[MAP_SNAPSHOT_BATCH];
+    unsigned int batch_size = parallel_threads();
+    unsigned int count, blocks, entries, length, stored, crc, filled = 0, i, j;
+    long end, here;
+    int whole;
+    Map *map;
+    FILE *file;
+
+    if (!path || !codec || !codec->deserialize_key || !codec->deserialize_value) {
+        return NULL;
+    }
+
+    file = open_snapshot(path, &count, &blocks);
+    if (!file) {
+        return NULL;
+    }
+
+    /* The headers are not trusted until checked, so know where the file ends */
+    here = ftell(file);
+    if (here < 0 || fseek(file, 0, SEEK_END) != 0 || (end = ftell(file)) < here ||
+        fseek(file, here, SEEK_SET) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    /* The entry count sizes the map, so it must fit in the file too */
+    if (count > (unsigned long)(end - here) / 8) {
+        fclose(file);
+        return NULL;
+    }
+
+    memset(batch, 0, sizeof(batch));
+    if (batch_size > MAP_SNAPSHOT_BATCH) {
+        batch_size = MAP_SNAPSHOT_BATCH;
+    }
+
+    whole = first_block == 0 && block_count >= blocks;
+    map = map_create(whole ? count : 0, compare_func);
+
+    for (i = 0; map && i < blocks && (i < first_block || i - first_block < block_count); ++i) {
+        /*
+         * Every entry takes at least its two length prefixes, and no
+         * compressed payload expands more than 255 fold.
+         */
+        if (read_u32(file, &entries) != 0 || read_u32(file, &length) != 0 ||
+            read_u32(file, &stored) != 0 || read_u32(file, &crc) != 0 || (here = ftell(file)) < 0 ||
+            stored > (unsigned long)(end - here) || stored > length || length / 255 > stored ||
+            entries > length / 8) {
+            discard_loaded(map);
+            map = NULL;
+            break;
+        }
+
+        /* Blocks before the requested range are skipped without reading */
+        if (i < first_block) {
+            if (fseek(file, (long)stored, SEEK_CUR) != 0) {
+                discard_loaded(map);
+                map = NULL;
+            }
+            continue;
+        }
+
+        if (read_block(file, &batch[filled], entries, length, stored, crc) != 0) {
+            discard_loaded(map);
+            map = NULL;
+            break;
+        }
+        filled++;
+
+        /* Check and decompress a full batch at once, then load it in order */
+        if (filled == batch_size || i + 1 == blocks || i + 1 - first_block == block_count) {
+            run_parallel(unpack_block, batch, filled);
+
+            for (j = 0; map && j < filled; ++j) {
+                if (load_block((MapImpl*)map, &batch[j], codec) != 0) {
+                    discard_loaded(map);
+                    map = NULL;
+                }
+            }
+            filled = 0;
+        }
+    }
+
+    /* The header's count is not checksummed, so hold it to the blocks */
+    if (map && whole && ((MapImpl*)map)->size != count) {
+        discard_loaded(map);
+        map = NULL;
+    }
+
+    free_blocks(batch, MAP_SNAPSHOT_BATCH);
+    fclose(file);
+
+    return map;
+}
+
+Map *map_load(const char *path, MapKeyCompareFunc compare_func, const MapCodec *codec) {
+    return map_load_blocks(path, compare_func, codec, 0, (unsigned int)-1);
+}
+
+#ifdef MAP_HAVE_BGSAVE
+long map_bgsave(Map *map, const char *path, const MapCodec *codec) {
+    pid_t pid;
+
+    if (!map || !path || !codec) {
+        return -1;
+    }
+
+#ifdef MADV_NOHUGEPAGE
+    {
+        /*
+         * Only whole pages inside the table can be advised. Tables big enough
+         * to be backed by huge pages are big enough for this to cover them.
+         */
+        MapImpl *impl = (MapImpl*)map;
+        long page_size = sysconf(_SC_PAGESIZE);
+        size_t start = (size_t)impl->entries;
+        size_t end = start + sizeof(MapEntry) * impl->capacity;
+
+        if (page_size > 0) {
+            start = (start + page_size - 1) & ~((size_t)page_size - 1);
+            end &= ~((size_t)page_size - 1);
+            if (end > start) {
+                madvise((void *)start, end - start, MADV_NOHUGEPAGE);
+            }
+        }
+    }
+#endif
+
+    fflush(NULL);
+    pid = fork();
+    if (pid == 0) {
+        _exit(map_save(map, path, codec) == 0 ? 0 : 1);
+    }
+
+    return pid > 0 ? (long)pid : -1;
+}
+
+int map_bgsave_status(long pid) {
+    int status;
+    pid_t result;
+
+    if (pid <= 0) {
+        return -1;
+    }
+
+    result = waitpid((pid_t)pid, &status, WNOHANG);
+    if (result == 0) {
+        return 1;
+    }
+
+    if (result != (pid_t)pid) {
+        return -1;
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+#endif
+
+MapRef *map_ref_create(Map *map) {
+    MapRef *ref;
+
+    if (map_reorders(map)) {
+        return NULL;
+    }
+
+    ref = (MapRef *)calloc(1, sizeof(MapRef));
+    if (!ref) {
+        return NULL;
+    }
+
+    ref->current = map;
+
+    return ref;
+}
+
+Map *map_ref_free(MapRef *ref) {
+    Map *map;
+
+    if (!ref) {
+        return NULL;
+    }
+
+    map = ref->current;
+    free(ref);
+
+    return map;
+}
+
+Map *map_ref_enter(MapRef *ref, MapRefGuard *guard) {
+    unsigned int epoch;
+
+    if (!ref || !guard) {
+        return NULL;
+    }
+
+    /*
+     * Once counted in, the epoch must still be the one that was read;
+     * otherwise a swap may already have stopped waiting on that slot.
+     */
+    for (;;) {
+        epoch = MAP_ATOMIC_LOAD(&ref->epoch);
+        MAP_ATOMIC_ADD(&ref->readers[epoch & 1].count, 1);
+
+        if (MAP_ATOMIC_LOAD(&ref->epoch) == epoch) {
+            break;
+        }
+
+        MAP_ATOMIC_SUB(&ref->readers[epoch & 1].count, 1);
+    }
+
+    guard->ref = ref;
+    guard->slot = epoch & 1;
+
+    return MAP_ATOMIC_LOAD(&ref->current);
+}
+
+void map_ref_leave(MapRefGuard *guard) {
+    if (!guard || !guard->ref) {
+        return;
+    }
+
+    MAP_ATOMIC_SUB(&guard->ref->readers[guard->slot].count, 1);
+    guard->ref = NULL;
+}
+
+Map *map_swap(MapRef *ref, Map *map) {
+    unsigned int expected = 0;
+    unsigned int epoch;
+    Map *old;
+
+    if (!ref || map_reorders(map)) {
+        return NULL;
+    }
+
+    /* Swaps are serialized so that only one grace period runs at a time */
+    while (!MAP_ATOMIC_CAS(&ref->swapping, &expected, 1)) {
+        expected = 0;
+        MAP_YIELD();
+    }
+
+    old = (Map *)MAP_ATOMIC_EXCHANGE(&ref->current, map);
+
+    /*
+     * Readers entering from here on count into the other slot and can only
+     * see the new map, so once the old slot drains the old map is unused.
+     */
+    epoch = MAP_ATOMIC_LOAD(&ref->epoch);
+    MAP_ATOMIC_STORE(&ref->epoch, epoch + 1);
+
+    /* Wait for the readers of the previous epoch to leave */
+    while (MAP_ATOMIC_LOAD(&ref->readers[epoch & 1].count) != 0) {
+        MAP_YIELD();
+    }
+
+    MAP_ATOMIC_STORE(&ref->swapping, 0);
+
+    return old;
+}
+
+MapAccount *map_account_create(const char *name, unsigned long soft_limit, unsigned long hard_limit,
+                               MapBudgetFunc over_soft_limit, void *context) {
+    MapAccount *account;
+
+    if (!name) {
+        return NULL;
+    }
+
+    account = (MapAccount *)calloc(1, sizeof(MapAccount));
+    if (!account) {
+        return NULL;
+    }
+
+    account->name = (char *)malloc(strlen(name) + 1);
+    if (!account->name) {
+        free(account);
+        return NULL;
+    }
+
+    strcpy(account->name, name);
+    account->soft_limit = soft_limit;
+    account->hard_limit = hard_limit;
+    account->over_soft_limit = over_soft_limit;
+    account->context = context;
+
+    return account;
+}
+
+void map_account_free(MapAccount *account) {
+    if (!account) {
+        return;
+    }
+
+    free(account->name);
+    free(account);
+}
+
+int map_account_attach(Map *map, MapAccount *account) {
+    MapImpl *impl = (MapImpl*)map;
+
+    if (!map) {
+        return -1;
+    }
+
+    if (impl->account == account) {
+        return 0;
+    }
+
+    if (charge_account(account, table_bytes(impl)) != 0) {
+        return -1;
+    }
+
+    release_account(impl->account, table_bytes(impl));
+    impl->account = account;
+
+    return 0;
+}
+
+MapAccount *map_account_of(Map *map) {
+    if (!map) {
+        return NULL;
+    }
+
+    return ((MapImpl*)map)->account;
+}
+
+int map_account_charge(MapAccount *account, unsigned long bytes) {
+    if (!account) {
+        return -1;
+    }
+
+    return charge_account(account, bytes);
+}
+
+void map_account_release(MapAccount *account, unsigned long bytes) {
+    release_account(account, bytes);
+}
+
+unsigned long map_account_bytes(MapAccount *account) {
+    if (!account) {
+        return 0;
+    }
+
+    return MAP_ATOMIC_LOAD(&account->bytes);
+}
+
+const char *map_account_name(MapAccount *account) {
+    if (!account) {
+        return NULL;
+    }
+
+    return account->name;
+}
+
+MapSampler *map_sampler_create(unsigned int rate, unsigned int capacity, MapHashFunc hash_func) {
+    MapSampler *sampler;
+    unsigned int i;
+
+    if (!hash_func || capacity == 0) {
+        return NULL;
+    }
+
+    sampler = (MapSampler *)calloc(1, sizeof(MapSampler));
+    if (!sampler) {
+        return NULL;
+    }
+
+    sampler->hash_func = hash_func;
+    sampler->rate = rate ? rate : 1;
+    sampler->capacity = capacity;
+
+    for (i = 0; i < MAP_SAMPLER_STRIPES; ++i) {
+        sampler->stripes[i].counters = (SamplerCounter *)malloc(sizeof(SamplerCounter) * capacity);
+        if (!sampler->stripes[i].counters) {
+            map_sampler_free(sampler);
+            return NULL;
+        }
+    }
+
+    return sampler;
+}
+
+void map_sampler_free(MapSampler *sampler) {
+    unsigned int i;
+
+    if (!sampler) {
+        return;
+    }
+
+    for (i = 0; i < MAP_SAMPLER_STRIPES; ++i) {
+        free(sampler->stripes[i].counters);
+    }
+    free(sampler);
+}
+
+int map_sampler_attach(Map *map, MapSampler *sampler) {
+    if (!map) {
+        return -1;
+    }
+
+    ((MapImpl*)map)->sampler = sampler;
+
+    return 0;
+}
+
+void map_sampler_record(MapSampler *sampler, const void *key) {
+    unsigned int tick, stripe, expected = 0;
+
+    if (!sampler) {
+        return;
+    }
+
+    tick = MAP_ATOMIC_ADD(&sampler->ticks, 1);
+    if (tick % sampler->rate != 0) {
+        return;
+    }
+
+    /* Consecutive samples go to different stripes; a busy one drops it */
+    stripe = (tick / sampler->rate) % MAP_SAMPLER_STRIPES;
+    if (!MAP_ATOMIC_CAS(&sampler->stripes[stripe].busy, &expected, 1)) {
+        return;
+    }
+
+    sampler_count(sampler->stripes[stripe].counters, &sampler->stripes[stripe].used,
+                  sampler->capacity, sampler->hash_func(key));
+
+    sampler_unlock(sampler, stripe);
+}
+
+int map_sampler_top(MapSampler *sampler, MapHotKey *keys, unsigned int count) {
+    SamplerCounter *merged;
+    unsigned long floor, floors = 0;
+    unsigned int total = 0, distinct = 0, used, i, j;
+
+    if (!sampler || (!keys && count)) {
+        return -1;
+    }
+
+    merged = (SamplerCounter *)malloc(sizeof(SamplerCounter) * sampler->capacity * MAP_SAMPLER_STRIPES);
+    if (!merged) {
+        return -1;
+    }
+
+    for (i = 0; i < MAP_SAMPLER_STRIPES; ++i) {
+        sampler_lock(sampler, i);
+        used = sampler->stripes[i].used;
+        memcpy(merged + total, sampler->stripes[i].counters, sizeof(SamplerCounter) * used);
+        sampler_unlock(sampler, i);
+
+        /*
+         * A full stripe may have evicted any hash it lacks after counting
+         * it up to its smallest count. Every hash is charged that floor
+         * below, so the stripe's own counters give it back here first; the
+         * error may wrap below zero until then, which unsigned arithmetic
+         * undoes exactly.
+         */
+        if (used && used == sampler->capacity) {
+            floor = merged[total].count;
+            for (j = 1; j < used; ++j) {
+                if (merged[total + j].count < floor) {
+                    floor = merged[total + j].count;
+                }
+            }
+            for (j = 0; j < used; ++j) {
+                merged[total + j].count -= floor;
+                merged[total + j].error -= floor;
+            }
+            floors += floor;
+        }
+
+        total += used;
+    }
+
+    /* Summaries merge by adding up the counts and errors of each hash */
+    qsort(merged, total, sizeof(SamplerCounter), compare_counter_hashes);
+    for (i = 0; i < total; ++i) {
+        if (distinct && merged[distinct - 1].hash == merged[i].hash) {
+            merged[distinct - 1].count += merged[i].count;
+            merged[distinct - 1].error += merged[i].error;
+        }
+        else {
+            merged[distinct++] = merged[i];
+        }
+    }
+
+    for (i = 0; i < distinct; ++i) {
+        merged[i].count += floors;
+        merged[i].error += floors;
+    }
+
+    qsort(merged, distinct, sizeof(SamplerCounter), compare_counter_counts);
+
+    for (j = 0; j < distinct && j < count; ++j) {
+        keys[j].hash = merged[j].hash;
+        keys[j].count = merged[j].count * sampler->rate;
+        keys[j].error = merged[j].error * sampler->rate;
+    }
+
+    free(merged);
+
+    return (int)j;
+}
+
+void map_sampler_reset(MapSampler *sampler) {
+    unsigned int i;
+
+    if (!sampler) {
+        return;
+    }
+
+    for (i = 0; i < MAP_SAMPLER_STRIPES; ++i) {
+        sampler_lock(sampler, i);
+        sampler->stripes[i].used = 0;
+        sampler_unlock(sampler, i);
+    }
+}
+
+MapTracer *map_tracer_create(const char *path, MapHashFunc hash_func) {
+    MapTracer *tracer;
+
+    if (!path || !hash_func) {
+        return NULL;
+    }
+
+    tracer = (MapTracer *)calloc(1, sizeof(MapTracer));
+    if (!tracer) {
+        return NULL;
+    }
+
+    tracer->buffer = (unsigned char *)calloc(MAP_TRACE_BUFFER_RECORDS, MAP_TRACE_RECORD_SIZE);
+    tracer->file = fopen(path, "wb");
+    if (!tracer->buffer || !tracer->file ||
+        fwrite(MAP_TRACE_MAGIC, 1, 4, tracer->file) != 4 ||
+        write_u32(tracer->file, MAP_TRACE_VERSION) != 0 ||
+        write_u32(tracer->file, MAP_TRACE_RECORD_SIZE) != 0) {
+        if (tracer->file) {
+            fclose(tracer->file);
+        }
+        free(tracer->buffer);
+        free(tracer);
+        return NULL;
+    }
+
+    tracer->hash_func = hash_func;
+    tracer->started = trace_clock();
+
+    return tracer;
+}
+
+int map_tracer_attach(Map *map, MapTracer *tracer) {
+    if (!map) {
+        return -1;
+    }
+
+    ((MapImpl*)map)->tracer = tracer;
+
+    return 0;
+}
+
+void map_tracer_record(MapTracer *tracer, MapTraceOp op, const void *key) {
+    unsigned long long elapsed;
+    unsigned char *record;
+    unsigned int index;
+
+    if (!tracer) {
+        return;
+    }
+
+    for (;;) {
+        index = MAP_ATOMIC_ADD(&tracer->reserved, 1) - 1;
+
+        if (index < MAP_TRACE_BUFFER_RECORDS) {
+            break;
+        }
+
+        if (index == MAP_TRACE_BUFFER_RECORDS) {
+            /* Write the buffer once every claimed record is filled in */
+            while (MAP_ATOMIC_LOAD(&tracer->committed) != MAP_TRACE_BUFFER_RECORDS) {
+                MAP_YIELD();
+            }
+            trace_flush(tracer, MAP_TRACE_BUFFER_RECORDS);
+            MAP_ATOMIC_STORE(&tracer->committed, 0);
+            MAP_ATOMIC_STORE(&tracer->reserved, 0);
+        }
+        else {
+            while (MAP_ATOMIC_LOAD(&tracer->reserved) > MAP_TRACE_BUFFER_RECORDS) {
+                MAP_YIELD();
+            }
+        }
+    }
+
+    elapsed = trace_clock() - tracer->started;
+    record = tracer->buffer + (size_t)index * MAP_TRACE_RECORD_SIZE;
+    record[0] = (unsigned char)op;
+    encode_u32(record + 4, tracer->hash_func(key));
+    encode_u32(record + 8, (unsigned int)(elapsed & 0xffffffffUL));
+    encode_u32(record + 12, (unsigned int)(elapsed >> 32));
+
+    MAP_ATOMIC_ADD(&tracer->committed, 1);
+}
+
+int map_tracer_close(MapTracer *tracer) {
+    unsigned int records;
+    int result;
+
+    if (!tracer) {
+        return -1;
+    }
+
+    records = MAP_ATOMIC_LOAD(&tracer->committed);
+    trace_flush(tracer, records);
+
+    result = (fclose(tracer->file) == 0 && !tracer->failed) ? 0 : -1;
+    free(tracer->buffer);
+    free(tracer);
+
+    return result;
+}
+
+long map_trace_load(const char *path, MapTraceRecord **records) {
+    unsigned char header[4], bytes[MAP_TRACE_RECORD_SIZE];
+    unsigned int version, record_size;
+    MapTraceRecord *loaded = NULL, *grown;
+    unsigned long capacity = 0, count = 0;
+    FILE *file;
+
+    if (!path || !records) {
+        return -1;
+    }
+
+    file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    if (fread(header, 1, 4, file) != 4 || memcmp(header, MAP_TRACE_MAGIC, 4) != 0 ||
+        read_u32(file, &version) != 0 || version != MAP_TRACE_VERSION ||
+        read_u32(file, &record_size) != 0 || record_size != MAP_TRACE_RECORD_SIZE) {
+        fclose(file);
+        return -1;
+    }
+
+    while (fread(bytes, 1, MAP_TRACE_RECORD_SIZE, file) == MAP_TRACE_RECORD_SIZE) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            grown = (MapTraceRecord *)realloc(loaded, sizeof(MapTraceRecord) * capacity);
+            if (!grown) {
+                free(loaded);
+                fclose(file);
+                return -1;
+            }
+            loaded = grown;
+        }
+
+        loaded[count].op = (MapTraceOp)bytes[0];
+        loaded[count].hash = decode_u32(bytes + 4);
+        loaded[count].time = (unsigned long long)decode_u32(bytes + 8) |
+                             ((unsigned long long)decode_u32(bytes + 12) << 32);
+        count++;
+    }
+
+    fclose(file);
+    *records = loaded;
+
+    return (long)count;
+}
+
+int map_organize(Map *map, MapOrganizePolicy policy, unsigned int threshold) {
+    MapImpl *impl = (MapImpl*)map;
+    unsigned long before, after;
+    unsigned char *tags = NULL;
+    unsigned int *hits = NULL;
+    unsigned int i;
+
+    if (!map) {
+        return -1;
+    }
+
+    /* Work out which arrays the new policy needs before touching anything */
+    if (policy != MAP_ORGANIZE_NONE && taggable(impl->compare_func)) {
+        tags = (unsigned char *)malloc(impl->capacity);
+        if (!tags) {
+            return -1;
+        }
+        for (i = 0; i < impl->size; ++i) {
+            key_tag(impl->compare_func, impl->entries[i].key, &tags[i]);
+        }
+    }
+
+    if (policy == MAP_ORGANIZE_MOVE_TO_FRONT && threshold > 1) {
+        hits = (unsigned int *)calloc(impl->capacity, sizeof(unsigned int));
+        if (!hits) {
+            free(tags);
+            return -1;
+        }
+    }
+
+    before = slot_bytes(impl);
+    after = sizeof(MapEntry) + (tags ? 1 : 0) + (hits ? sizeof(unsigned int) : 0);
+    if (after > before && charge_account(impl->account, (after - before) * impl->capacity) != 0) {
+        free(tags);
+        free(hits);
+        return -1;
+    }
+    if (after < before) {
+        release_account(impl->account, (before - after) * impl->capacity);
+    }
+
+    free(impl->tags);
+    free(impl->hits);
+    impl->tags = tags;
+    impl->hits = hits;
+    impl->organize = policy;
+    impl->threshold = threshold;
+
+    return 0;
+}
+
+MapCpuLevel map_cpu_level(void) {
+    map_kernels();
+
+    return (MapCpuLevel)MAP_ATOMIC_LOAD(&kernels_level);
+}
+
+int map_set_cpu_level(MapCpuLevel level) {
+    if (level < MAP_CPU_SCALAR || level > detect_cpu_level()) {
+        return -1;
+    }
+
+    bind_kernels(level);
+
+    return 0;
+}
+
+const char *map_cpu_level_name(MapCpuLevel level) {
+    if (level < MAP_CPU_SCALAR || level > MAP_CPU_AVX512) {
+        return NULL;
+    }
+
+    return cpu_level_names[level];
+}
+
+unsigned int map_threads(void) {
+    return parallel_threads();
+}
+
+int map_set_threads(unsigned int threads) {
+#ifdef MAP_HAVE_THREADS
+    if (threads > MAP_MAX_THREADS) {
+        return -1;
+    }
+#else
+    if (threads > 1) {
+        return -1;
+    }
+#endif
+
+    MAP_ATOMIC_STORE(&thread_count, threads);
+
+    return 0;
+}
+
+unsigned int map_lz_compress(const void *src, unsigned int length, void *dst, unsigned int capacity) {
+    const unsigned char *bytes = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+    unsigned int table[1 << MAP_LZ_HASH_BITS];
+    unsigned int position = 0, anchor = 0, output = 0;
+    unsigned int sequence, hash, candidate, match_length;
+
+    if ((!src && length) || (!dst && capacity)) {
+        return 0;
+    }
+
+    memset(table, 0, sizeof(table));
+
+    while (length - position >= MAP_LZ_MIN_MATCH) {
+        memcpy(&sequence, bytes + position, sizeof(sequence));
+        hash = (sequence * 2654435761u) >> (32 - MAP_LZ_HASH_BITS);
+        candidate = table[hash];
+        table[hash] = position;
+
+        if (candidate >= position || position - candidate > MAP_LZ_MAX_OFFSET ||
+            memcmp(bytes + candidate, bytes + position, MAP_LZ_MIN_MATCH) != 0) {
+            position++;
+            continue;
+        }
+
+        match_length = MAP_LZ_MIN_MATCH;
+        while (length - position > match_length && bytes[candidate + match_length] == bytes[position + match_length]) {
+            match_length++;
+        }
+
+        if (lz_write_sequence(out, &output, capacity, bytes + anchor, position - anchor,
+                              position - candidate, match_length) != 0) {
+            return 0;
+        }
+
+        position += match_length;
+        anchor = position;
+    }
+
+    if (lz_write_sequence(out, &output, capacity, bytes + anchor, length - anchor, 0, 0) != 0) {
+        return 0;
+    }
+
+    return output;
+}
+
+int map_lz_decompress(const void *src, unsigned int src_length, void *dst, unsigned int length) {
+    const unsigned char *bytes = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+    unsigned int position = 0, output = 0;
+    unsigned int literal_count, match_length, offset;
+    unsigned char token;
+
+    if ((!src && src_length) || (!dst && length)) {
+        return -1;
+    }
+
+    while (position < src_length) {
+        token = bytes[position++];
+
+        literal_count = token >> 4;
+        if ((literal_count == 15 && lz_read_length(bytes, &position, src_length, &literal_count) != 0) ||
+            src_length - position < literal_count || length - output < literal_count) {
+            return -1;
+        }
+        if (literal_count) {
+            memcpy(out + output, bytes + position, literal_count);
+        }
+        position += literal_count;
+        output += literal_count;
+
+        if (position == src_length) {
+            break;
+        }
+
+        if (src_length - position < 2) {
+            return -1;
+        }
+        offset = bytes[position] | (bytes[position + 1] << 8);
+        position += 2;
+
+        match_length = token & 15;
+        if ((match_length == 15 && lz_read_length(bytes, &position, src_length, &match_length) != 0) ||
+            offset == 0 || offset > output) {
+            return -1;
+        }
+
+        match_length += MAP_LZ_MIN_MATCH;
+        if (length - output < match_length) {
+            return -1;
+        }
+
+        /* Matches may overlap what they produce, so copy byte by byte */
+        while (match_length--) {
+            out[output] = out[output - offset];
+            output++;
+        }
+    }
+
+    return output == length ? 0 : -1;
+}
+
+MapBimap *map_bimap_create(MapKeyCompareFunc key_compare, MapHashFunc key_hash,
+                           MapKeyCompareFunc value_compare, MapHashFunc value_hash) {
+    MapBimap *bimap;
+
+    if (!key_compare || !key_hash || !value_compare || !value_hash) {
+        return NULL;
+    }
+
+    bimap = (MapBimap *)calloc(1, sizeof(MapBimap));
+    if (!bimap) {
+        return NULL;
+    }
+
+    if (hash_index_init(&bimap->by_key, 0) != 0 || hash_index_init(&bimap->by_value, 0) != 0) {
+        hash_index_destroy(&bimap->by_key);
+        free(bimap);
+        return NULL;
+    }
+
+    bimap->key_compare = key_compare;
+    bimap->key_hash = key_hash;
+    bimap->value_compare = value_compare;
+    bimap->value_hash = value_hash;
+
+    return bimap;
+}
+
+void map_bimap_free(MapBimap *bimap) {
+    if (!bimap) {
+        return;
+    }
+
+    hash_index_destroy(&bimap->by_key);
+    hash_index_destroy(&bimap->by_value);
+    free(bimap->entries);
+    free(bimap);
+}
+
+int map_bimap_set(MapBimap *bimap, void *key, void *value) {
+    BimapEntry *entries;
+    unsigned int key_hash, value_hash, capacity;
+    int key_index, value_index;
+
+    if (!bimap) {
+        return -1;
+    }
+
+    key_hash = bimap->key_hash(key);
+    value_hash = bimap->value_hash(value);
+    key_index = bimap_find_key(bimap, key, key_hash);
+    value_index = bimap_find_value(bimap, value, value_hash);
+
+    /* Already paired; like map_set, the new value pointer is still stored */
+    if (key_index >= 0 && key_index == value_index) {
+        bimap->entries[key_index].value = value;
+        return 0;
+    }
+
+    /* Make room first so that nothing below can fail halfway */
+    if (bimap->size == bimap->capacity) {
+        capacity = bimap->capacity ? bimap->capacity * 2 : 8;
+        entries = (BimapEntry *)realloc(bimap->entries, sizeof(BimapEntry) * capacity);
+        if (!entries) {
+            return -1;
+        }
+        bimap->entries = entries;
+        bimap->capacity = capacity;
+    }
+
+    if (hash_index_reserve(&bimap->by_key, 1) != 0 || hash_index_reserve(&bimap->by_value, 1) != 0) {
+        return -1;
+    }
+
+    /* The value may only belong to one key, so drop its old pair */
+    if (value_index >= 0) {
+        bimap_remove_at(bimap, (unsigned int)value_index);
+        if (key_index == (int)bimap->size) {
+            key_index = value_index;
+        }
+    }
+
+    if (key_index >= 0) {
+        hash_index_remove(&bimap->by_value, bimap->entries[key_index].value_hash, key_index);
+        hash_index_insert(&bimap->by_value, value_hash, key_index);
+        bimap->entries[key_index].value = value;
+        bimap->entries[key_index].value_hash = value_hash;
+        return 0;
+    }
+
+    hash_index_insert(&bimap->by_key, key_hash, bimap->size);
+    hash_index_insert(&bimap->by_value, value_hash, bimap->size);
+    bimap->entries[bimap->size].key = key;
+    bimap->entries[bimap->size].value = value;
+    bimap->entries[bimap->size].key_hash = key_hash;
+    bimap->entries[bimap->size].value_hash = value_hash;
+    ++bimap->size;
+
+    return 0;
+}
+
+void *map_bimap_get(MapBimap *bimap, const void *key) {
+    int index;
+
+    if (!bimap) {
+        return NULL;
+    }
+
+    index = bimap_find_key(bimap, key, bimap->key_hash(key));
+
+    return index >= 0 ? bimap->entries[index].value : NULL;
+}
+
+void *map_bimap_get_key(MapBimap *bimap, const void *value) {
+    int index;
+
+    if (!bimap) {
+        return NULL;
+    }
+
+    index = bimap_find_value(bimap, value, bimap->value_hash(value));
+
+    return index >= 0 ? bimap->entries[index].key : NULL;
+}
+
+void map_bimap_delete(MapBimap *bimap, const void *key) {
+    int index;
+
+    if (!bimap) {
+        return;
+    }
+
+    index = bimap_find_key(bimap, key, bimap->key_hash(key));
+    if (index >= 0) {
+        bimap_remove_at(bimap, (unsigned int)index);
+    }
+}
+
+void map_bimap_delete_value(MapBimap *bimap, const void *value) {
+    int index;
+
+    if (!bimap) {
+        return;
+    }
+
+    index = bimap_find_value(bimap, value, bimap->value_hash(value));
+    if (index >= 0) {
+        bimap_remove_at(bimap, (unsigned int)index);
+    }
+}
+
+int map_bimap_get_size(MapBimap *bimap) {
+    if (!bimap) {
+        return -1;
+    }
+
+    return (int)bimap->size;
+}
+
+MapIndex *map_index_create(Map *map, MapFieldFunc field_func, void *context,
+                           MapKeyCompareFunc compare_func, MapHashFunc hash_func, int unique) {
+    MapImpl *impl = (MapImpl*)map;
+    MapIndex *index;
+    unsigned int i;
+
+    if (!map || !field_func || !compare_func || !hash_func) {
+        return NULL;
+    }
+
+    index = (MapIndex *)calloc(1, sizeof(MapIndex));
+    if (!index) {
+        return NULL;
+    }
+
+    index->impl = impl;
+    index->field_func = field_func;
+    index->context = context;
+    index->compare_func = compare_func;
+    index->hash_func = hash_func;
+    index->unique = unique;
+
+    if (hash_index_init(&index->by_field, impl->size) != 0 ||
+        hash_index_init(&index->by_key, impl->size) != 0) {
+        index_destroy(index);
+        return NULL;
+    }
+
+    for (i = 0; i < impl->size; ++i) {
+        if (index_prepare(index, impl->entries[i].key, impl->entries[i].value) != 0) {
+            index_destroy(index);
+            return NULL;
+        }
+        index_put(index, impl->entries[i].key, impl->entries[i].value);
+    }
+
+    index->next = impl->indexes;
+    impl->indexes = index;
+
+    return index;
+}
+
+void map_index_free(MapIndex *index) {
+    MapIndex **link;
+
+    if (!index) {
+        return;
+    }
+
+    for (link = &index->impl->indexes; *link; link = &(*link)->next) {
+        if (*link == index) {
+            *link = index->next;
+            break;
+        }
+    }
+
+    index_destroy(index);
+}
+
+void *map_index_get(MapIndex *index, const void *field) {
+    unsigned int probe = 0;
+    int id;
+
+    if (!index) {
+        return NULL;
+    }
+
+    id = index_next_match(index, field, index->hash_func(field), &probe);
+
+    return id >= 0 ? index->records[id].value : NULL;
+}
+
+int map_index_find(MapIndex *index, const void *field, void **keys, void **values,
+                   unsigned int count) {
+    unsigned int hash, probe = 0;
+    int id, found = 0;
+
+    if (!index) {
+        return -1;
+    }
+
+    hash = index->hash_func(field);
+    while ((id = index_next_match(index, field, hash, &probe)) >= 0) {
+        if ((unsigned int)found < count) {
+            if (keys) {
+                keys[found] = index->records[id].key;
+            }
+            if (values) {
+                values[found] = index->records[id].value;
+            }
+        }
+        found++;
+    }
+
+    return found;
+}
+
+MapSketch *map_sketch_create(unsigned int width, unsigned int depth, unsigned int top,
+                             MapHashFunc hash_func) {
+    MapSketch *sketch;
+    unsigned int columns = 1;
+
+    if (!hash_func || width == 0 || width > MAP_SKETCH_MAX_WIDTH ||
+        depth == 0 || depth > MAP_SKETCH_MAX_DEPTH) {
+        return NULL;
+    }
+
+    while (columns < width) {
+        columns *= 2;
+    }
+
+    sketch = (MapSketch *)calloc(1, sizeof(MapSketch));
+    if (!sketch) {
+        return NULL;
+    }
+
+    sketch->width = columns;
+    sketch->depth = depth;
+    sketch->hash_func = hash_func;
+    sketch->capacity = top;
+    sketch->counters = (unsigned long long *)calloc((size_t)columns * depth,
+                                                    sizeof(unsigned long long));
+    sketch->hitters = (SamplerCounter *)calloc(top ? top : 1, sizeof(SamplerCounter));
+
+    if (!sketch->counters || !sketch->hitters || hash_index_init(&sketch->by_hash, top) != 0) {
+        map_sketch_free(sketch);
+        return NULL;
+    }
+
+    return sketch;
+}
+
+void map_sketch_free(MapSketch *sketch) {
+    if (!sketch) {
+        return;
+    }
+
+    hash_index_destroy(&sketch->by_hash);
+    free(sketch->hitters);
+    free(sketch->counters);
+    free(sketch);
+}
+
+unsigned long map_sketch_increment(MapSketch *sketch, const void *key, unsigned long amount) {
+    unsigned int cells[MAP_SKETCH_MAX_DEPTH];
+    unsigned int hash;
+    unsigned long estimate;
+
+    if (!sketch) {
+        return 0;
+    }
+
+    hash = sketch->hash_func(key);
+    sketch_cells(sketch, hash, cells);
+    estimate = (unsigned long)map_kernels()->sketch_add(sketch->counters, cells, sketch->depth, amount);
+    sketch->total += amount;
+
+    if (amount) {
+        sketch_track(sketch, hash, estimate);
+    }
+
+    return estimate;
+}
+
+unsigned long map_sketch_get(MapSketch *sketch, const void *key) {
+    unsigned int cells[MAP_SKETCH_MAX_DEPTH];
+
+    if (!sketch) {
+        return 0;
+    }
+
+    sketch_cells(sketch, sketch->hash_func(key), cells);
+
+    return (unsigned long)map_kernels()->sketch_add(sketch->counters, cells, sketch->depth, 0);
+}
+
+int map_sketch_top(MapSketch *sketch, MapHotKey *keys, unsigned int count) {
+    SamplerCounter *sorted;
+    unsigned long error;
+    unsigned int i;
+
+    if (!sketch || (!keys && count)) {
+        return -1;
+    }
+
+    sorted = (SamplerCounter *)malloc(sizeof(SamplerCounter) * (sketch->used ? sketch->used : 1));
+    if (!sorted) {
+        return -1;
+    }
+
+    memcpy(sorted, sketch->hitters, sizeof(SamplerCounter) * sketch->used);
+    qsort(sorted, sketch->used, sizeof(SamplerCounter), compare_counter_counts);
+
+    /* The usual count-min bound, e / width of everything counted */
+    error = (unsigned long)(2.718281828 * (double)sketch->total / sketch->width);
+
+    for (i = 0; i < sketch->used && i < count; ++i) {
+        keys[i].hash = sorted[i].hash;
+        keys[i].count = sorted[i].count;
+        keys[i].error = error < sorted[i].count ? error : sorted[i].count;
+    }
+
+    free(sorted);
+
+    return (int)i;
+}
+
+void map_sketch_reset(MapSketch *sketch) {
+    if (!sketch) {
+        return;
+    }
+
+    memset(sketch->counters, 0, sizeof(unsigned long long) * sketch->width * sketch->depth);
+    memset(sketch->by_hash.slots, 0, sizeof(HashSlot) * (sketch->by_hash.mask + 1));
+    sketch->by_hash.used = 0;
+    sketch->used = 0;
+    sketch->total = 0;
+}
+
+MapEntryHandle map_find(Map *map, const void *key) {
+    MapEntryHandle handle;
+
+    handle.index = -1;
+    handle.generation = 0;
+
+    if (!map) {
+        return handle;
+    }
+
+    handle.index = find_entry_index(map, key);
+    handle.generation = ((MapImpl*)map)->generation;
+
+    return handle;
+}
+
+int map_handle_valid(Map *map, MapEntryHandle handle) {
+    MapImpl *impl = (MapImpl*)map;
+
+    if (!map || handle.index < 0) {
+        return 0;
+    }
+
+    return handle.generation == impl->generation &&
+        (unsigned int)handle.index < impl->size;
+}
+
+void *map_handle_value(Map *map, MapEntryHandle handle) {
+    if (!map_handle_valid(map, handle)) {
+        return NULL;
+    }
+
+    return ((MapImpl*)map)->entries[handle.index].value;
+}
+
+int map_handle_set(Map *map, MapEntryHandle handle, void *value) {
+    MapImpl *impl = (MapImpl*)map;
+
+    if (!map_handle_valid(map, handle)) {
+        return -1;
+    }
+
+    if (impl->indexes && index_entry(impl, impl->entries[handle.index].key, value) != 0) {
+        return -1;
+    }
+
+    impl->entries[handle.index].value = value;
+    return 0;
+}
+
+int map_handle_erase(Map *map, MapEntryHandle handle) {
+    MapImpl *impl = (MapImpl*)map;
+
+    if (!map_handle_valid(map, handle)) {
+        return -1;
+    }
+
+    if (impl->indexes) {
+        unindex_entry(impl, impl->entries[handle.index].key);
+    }
+    remove_entry_at(impl, handle.index);
+    return 0;
+}
+
+unsigned int map_scan(Map *map, unsigned int cursor, unsigned int count,
+                      MapScanFunc callback, void *context) {
+    MapImpl *impl = (MapImpl*)map;
+    unsigned int index;
+
+    if (!map || !callback) {
+        return 0;
+    }
+
+    if (count == 0) {
+        count = 10;
+    }
+
+    /*
+     * The cursor is the number of entries at the front of the table that
+     * have yet to be visited. Deletes may have shrunk the table below it
+     * since the last call, in which case only what is left gets walked.
+     */
+    index = (cursor == 0 || cursor > impl->size) ? impl->size : cursor;
+
+    while (index > 0 && count > 0) {
+        --index;
+        --count;
+        callback(impl->entries[index].key, impl->entries[index].value, context);
+    }
+
+    return index;
+}
+
+int map_get_size(Map *map) {
+  MapImpl *impl = (MapImpl *)map;
+
+  if (!map) {
+    return -1;
+  }
+
+  return (int)impl->size;
+}
+
+int map_get_capacity(Map *map) {
+  MapImpl *impl = (MapImpl *)map;
+
+  if (!map) {
+    return -1;
+  }
+
+  return (int)impl->capacity;
+}
+
+Map *map_create(unsigned int initial_capacity, MapKeyCompareFunc compare_func) {
+    MapImpl *impl;
+
+    /* Defend against a capacity of 0, or one whose size does not fit */
+    if (initial_capacity == 0) {
+        initial_capacity = 10;
+    }
+    if (initial_capacity > (size_t)-1 / sizeof(MapEntry)) {
+        return NULL;
     }
 
     impl = (MapImpl *)malloc(sizeof(MapImpl));
@@ -238,7 +4988,16 @@ Map *map_create(unsigned int initial_capacity, MapKeyCompareFunc compare_func) {
 
     impl->size = 0;
     impl->capacity = initial_capacity;
+    impl->generation = 0;
     impl->compare_func = compare_func;
+    impl->account = NULL;
+    impl->sampler = NULL;
+    impl->tracer = NULL;
+    impl->organize = MAP_ORGANIZE_NONE;
+    impl->threshold = 0;
+    impl->tags = NULL;
+    impl->hits = NULL;
+    impl->indexes = NULL;
     impl->map.set = map_set;
     impl->map.get = map_get;
     impl->map.delete = map_delete;
@@ -0,0 +1,398 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "map_limiter.h"
+
+/*
+ * What a slot holds, kept in the low two bits of its state. The rest of
+ * the state counts how often the slot has been given to a new key.
+ */
+#define LIMITER_EMPTY   0 /* never used since it last ended a probe run */
+#define LIMITER_CLAIMED 1 /* being filled in by an insert               */
+#define LIMITER_LIVE    2 /* holds a key                                */
+#define LIMITER_FREE    3 /* held a key that was swept out              */
+
+#define STATE(generation, kind) (((generation) << 2) | (kind))
+#define STATE_KIND(state)       ((state) & 3)
+#define STATE_GENERATION(state) ((state) >> 2)
+
+/*
+ * A slot's word packs the low 16 bits of its generation above a 48 bit
+ * time in microseconds since the limiter was created, so a compare-and-
+ * swap against a slot that has meanwhile gone to another key fails. A
+ * swept slot's time is all ones.
+ */
+#define LIMITER_TIME_MASK ((1ULL << 48) - 1)
+#define LIMITER_DEAD      LIMITER_TIME_MASK
+
+#define WORD(generation, time) \
+    (((unsigned long long)((generation) & 0xffff) << 48) | (time))
+#define WORD_GENERATION(word)  ((unsigned int)((word) >> 48))
+#define WORD_TIME(word)        ((word) & LIMITER_TIME_MASK)
+
+/* Returned by apply_request when the slot went to another key */
+#define LIMITER_RETRY -2
+
+/*
+ * The header of each slot; the key's bytes follow it. Besides the word,
+ * the fields only change while the slot is claimed, so a reader that sees
+ * the same state before and after reading them has read them whole.
+ */
+typedef struct LimiterSlot {
+    unsigned long long word;
+    unsigned int state;
+    unsigned int hash;
+    unsigned int key_len;
+    unsigned int padding;
+} LimiterSlot;
+
+struct MapLimiter {
+    unsigned char *slots;
+    unsigned int slot_size;
+    unsigned int mask;
+    unsigned int capacity;
+    unsigned int key_size;
+    unsigned int limit;
+    unsigned long long interval;
+    unsigned long long tolerance;
+    int size;
+    unsigned int sweep_hand;
+    struct timespec started;
+    pthread_mutex_t lock;
+};
+
+/* --- Private Helper Function --- */
+
+static LimiterSlot *slot_at(MapLimiter *limiter, unsigned int index) {
+    return (LimiterSlot *)(limiter->slots + (size_t)index * limiter->slot_size);
+}
+
+static unsigned char *slot_key(LimiterSlot *slot) {
+    return (unsigned char *)(slot + 1);
+}
+
+/*
+ * Hashes a key with FNV-1a, finished off with the MurmurHash3 mixer so
+ * that the low bits used to pick a slot depend on every byte.
+ */
+static unsigned int hash_key(const void *key, unsigned int key_len) {
+    const unsigned char *bytes = (const unsigned char *)key;
+    unsigned int hash = 2166136261u;
+    unsigned int i;
+
+    for (i = 0; i < key_len; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+static unsigned long long now_us(MapLimiter *limiter) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long long)((long long)(now.tv_sec - limiter->started.tv_sec) * 1000000LL +
+                                (now.tv_nsec - limiter->started.tv_nsec) / 1000);
+}
+
+/*
+ * Finds the slot holding key without taking the lock. Returns NULL if the
+ * key is not in the table, otherwise the slot and the state it was found
+ * in.
+ */
+static LimiterSlot *find_slot(MapLimiter *limiter, const void *key, unsigned int key_len,
+                              unsigned int hash, unsigned int *state) {
+    LimiterSlot *slot;
+    unsigned int i = hash & limiter->mask;
+    unsigned int probes, seen;
+
+    for (probes = 0; probes <= limiter->mask; ++probes, i = (i + 1) & limiter->mask) {
+        slot = slot_at(limiter, i);
+        seen = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        if (STATE_KIND(seen) == LIMITER_EMPTY) {
+            return NULL;
+        }
+
+        if (STATE_KIND(seen) == LIMITER_LIVE &&
+            __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == hash &&
+            __atomic_load_n(&slot->key_len, __ATOMIC_RELAXED) == key_len &&
+            memcmp(slot_key(slot), key, key_len) == 0 &&
+            (__atomic_thread_fence(__ATOMIC_ACQUIRE),
+             __atomic_load_n(&slot->state, __ATOMIC_RELAXED) == seen)) {
+            *state = seen;
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Gives key a slot, holding the lock. The first swept slot along its probe
+ * run is reused if there is one, otherwise the empty slot ending it.
+ * Returns NULL if the table is full.
+ */
+static LimiterSlot *insert_slot(MapLimiter *limiter, const void *key, unsigned int key_len,
+                                unsigned int hash, unsigned int *state) {
+    LimiterSlot *slot, *target = NULL;
+    unsigned int i = hash & limiter->mask;
+    unsigned int probes, seen, generation;
+
+    for (probes = 0; probes <= limiter->mask; ++probes, i = (i + 1) & limiter->mask) {
+        slot = slot_at(limiter, i);
+        seen = slot->state;
+
+        if (STATE_KIND(seen) == LIMITER_EMPTY) {
+            if (!target) {
+                target = slot;
+            }
+            break;
+        }
+
+        /* Another thread may have added the key while this one waited */
+        if (STATE_KIND(seen) == LIMITER_LIVE && slot->hash == hash && slot->key_len == key_len &&
+            memcmp(slot_key(slot), key, key_len) == 0) {
+            *state = seen;
+            return slot;
+        }
+
+        if (STATE_KIND(seen) == LIMITER_FREE && !target) {
+            target = slot;
+        }
+    }
+
+    if (!target || limiter->size >= (int)limiter->capacity) {
+        return NULL;
+    }
+
+    generation = STATE_GENERATION(target->state) + 1;
+    __atomic_store_n(&target->state, STATE(generation, LIMITER_CLAIMED), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&target->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&target->key_len, key_len, __ATOMIC_RELAXED);
+    memcpy(slot_key(target), key, key_len);
+    __atomic_store_n(&target->word, WORD(generation, 0), __ATOMIC_RELAXED);
+    __atomic_store_n(&target->state, STATE(generation, LIMITER_LIVE), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&limiter->size, 1, __ATOMIC_RELAXED);
+
+    *state = STATE(generation, LIMITER_LIVE);
+    return target;
+}
+
+/*
+ * Runs the cell rate algorithm for one request against a slot: the
+ * request is allowed if, after moving the key's theoretical arrival time
+ * on by its cost, that time is no more than one period ahead of now.
+ * Returns 1 if allowed, 0 if not, or LIMITER_RETRY if the slot no longer
+ * holds the key found in it.
+ */
+static int apply_request(MapLimiter *limiter, LimiterSlot *slot, unsigned int state,
+                         unsigned long long now, unsigned int cost, unsigned long *retry_us) {
+    unsigned int generation = STATE_GENERATION(state) & 0xffff;
+    unsigned long long word = __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE);
+    unsigned long long arrival;
+
+    for (;;) {
+        if (WORD_GENERATION(word) != generation || WORD_TIME(word) == LIMITER_DEAD) {
+            return LIMITER_RETRY;
+        }
+
+        arrival = WORD_TIME(word) > now ? WORD_TIME(word) : now;
+        arrival += cost * limiter->interval;
+
+        if (arrival - now > limiter->tolerance) {
+            *retry_us = (unsigned long)(arrival - now - limiter->tolerance);
+            return 0;
+        }
+
+        if (__atomic_compare_exchange_n(&slot->word, &word, WORD(generation, arrival), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *retry_us = 0;
+            return 1;
+        }
+    }
+}
+
+/*
+ * Turns swept slots back into empty ones, going backwards from index, as
+ * long as they end a probe run. No key can lie beyond the end of a run,
+ * so this never cuts a key off from its home slot.
+ */
+static void release_run_end(MapLimiter *limiter, unsigned int index) {
+    LimiterSlot *slot;
+    unsigned int probes, state;
+
+    for (probes = 0; probes < limiter->mask; ++probes, index = (index - 1) & limiter->mask) {
+        slot = slot_at(limiter, index);
+        state = slot->state;
+
+        if (STATE_KIND(state) != LIMITER_FREE ||
+            STATE_KIND(slot_at(limiter, (index + 1) & limiter->mask)->state) != LIMITER_EMPTY) {
+            return;
+        }
+
+        __atomic_store_n(&slot->state, STATE(STATE_GENERATION(state), LIMITER_EMPTY), __ATOMIC_RELEASE);
+    }
+}
+
+/* --- Public API Functions --- */
+
+MapLimiter *map_limiter_create(unsigned int capacity, unsigned int key_size,
+                               unsigned int limit, unsigned long period_us) {
+    MapLimiter *limiter;
+    unsigned int slots = 16;
+
+    if (capacity == 0 || limit == 0 || period_us == 0) {
+        return NULL;
+    }
+
+    /* Keep the table at most half full so probe runs stay short */
+    while (slots < capacity * 2) {
+        slots *= 2;
+    }
+
+    limiter = (MapLimiter *)calloc(1, sizeof(MapLimiter));
+    if (!limiter) {
+        return NULL;
+    }
+
+    limiter->slot_size = (unsigned int)((sizeof(LimiterSlot) + key_size + 7) & ~(size_t)7);
+    limiter->slots = (unsigned char *)calloc(slots, limiter->slot_size);
+    if (!limiter->slots || pthread_mutex_init(&limiter->lock, NULL) != 0) {
+        free(limiter->slots);
+        free(limiter);
+        return NULL;
+    }
+
+    limiter->mask = slots - 1;
+    limiter->capacity = capacity;
+    limiter->key_size = key_size;
+    limiter->limit = limit;
+    limiter->interval = period_us / limit ? period_us / limit : 1;
+    limiter->tolerance = limiter->interval * limit;
+    clock_gettime(CLOCK_MONOTONIC, &limiter->started);
+
+    return limiter;
+}
+
+void map_limiter_free(MapLimiter *limiter) {
+    if (!limiter) {
+        return;
+    }
+
+    pthread_mutex_destroy(&limiter->lock);
+    free(limiter->slots);
+    free(limiter);
+}
+
+int map_limiter_check(MapLimiter *limiter, const void *key, unsigned int key_len,
+                      unsigned int cost, unsigned long *retry_us) {
+    LimiterSlot *slot;
+    unsigned long long now;
+    unsigned long retry = 0;
+    unsigned int hash, state = 0;
+    int result;
+
+    if (!limiter || (!key && key_len) || key_len > limiter->key_size) {
+        return -1;
+    }
+
+    if (cost > limiter->limit) {
+        if (retry_us) {
+            *retry_us = 0;
+        }
+        return 0;
+    }
+
+    hash = hash_key(key, key_len);
+    now = now_us(limiter);
+
+    do {
+        slot = find_slot(limiter, key, key_len, hash, &state);
+        if (!slot) {
+            pthread_mutex_lock(&limiter->lock);
+            slot = insert_slot(limiter, key, key_len, hash, &state);
+            pthread_mutex_unlock(&limiter->lock);
+
+            if (!slot) {
+                return -1;
+            }
+        }
+
+        result = apply_request(limiter, slot, state, now, cost, &retry);
+    } while (result == LIMITER_RETRY);
+
+    if (retry_us) {
+        *retry_us = retry;
+    }
+
+    return result;
+}
+
+int map_limiter_sweep(MapLimiter *limiter, unsigned int count) {
+    LimiterSlot *slot;
+    unsigned long long now, word;
+    unsigned int i, state, index;
+    int removed = 0;
+
+    if (!limiter) {
+        return -1;
+    }
+
+    if (count > limiter->mask + 1) {
+        count = limiter->mask + 1;
+    }
+
+    pthread_mutex_lock(&limiter->lock);
+    now = now_us(limiter);
+
+    for (i = 0; i < count; ++i) {
+        index = limiter->sweep_hand;
+        limiter->sweep_hand = (index + 1) & limiter->mask;
+        slot = slot_at(limiter, index);
+        state = slot->state;
+
+        /*
+         * A key whose allowance has fully refilled is in the same state
+         * as one never seen. The swap fails if a request came in since.
+         */
+        if (STATE_KIND(state) == LIMITER_LIVE) {
+            word = __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE);
+            if (WORD_TIME(word) <= now &&
+                __atomic_compare_exchange_n(&slot->word, &word,
+                                            WORD(STATE_GENERATION(state), LIMITER_DEAD), 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&slot->state, STATE(STATE_GENERATION(state), LIMITER_FREE),
+                                 __ATOMIC_RELEASE);
+                __atomic_sub_fetch(&limiter->size, 1, __ATOMIC_RELAXED);
+                removed++;
+            }
+        }
+
+        release_run_end(limiter, index);
+    }
+
+    pthread_mutex_unlock(&limiter->lock);
+
+    return removed;
+}
+
+int map_limiter_get_size(MapLimiter *limiter) {
+    if (!limiter) {
+        return -1;
+    }
+
+    return __atomic_load_n(&limiter->size, __ATOMIC_RELAXED);
+}
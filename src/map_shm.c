@@ -0,0 +1,426 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "map_shm.h"
+
+#define MAP_SHM_MAGIC   0x434d5348 /* "CMSH" */
+#define MAP_SHM_VERSION 1
+
+/*
+ * The header at the very start of the segment. Nothing in the segment is a
+ * pointer; slots are found by their offset from the start of the mapping.
+ */
+typedef struct MapShmHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int capacity;
+    unsigned int key_size;
+    unsigned int value_size;
+    unsigned int slot_size;
+    unsigned int slots_offset;
+    unsigned int size;
+    unsigned int sequence;
+    pthread_mutex_t lock;
+} MapShmHeader;
+
+/*
+ * Each slot holds the lengths of its key and value followed by room for
+ * the largest key and value the map accepts.
+ */
+typedef struct MapShmSlot {
+    unsigned int key_len;
+    unsigned int value_len;
+} MapShmSlot;
+
+/*
+ * The per process view of a shared map.
+ */
+struct MapShm {
+    MapShmHeader *header;
+    size_t length;
+};
+
+/* --- Private Helper Functions --- */
+
+static MapShmSlot *slot_at(MapShm *shm, unsigned int index) {
+    return (MapShmSlot *)((unsigned char *)shm->header +
+        shm->header->slots_offset + (size_t)index * shm->header->slot_size);
+}
+
+static unsigned char *slot_key(MapShmSlot *slot) {
+    return (unsigned char *)(slot + 1);
+}
+
+static unsigned char *slot_value(MapShm *shm, MapShmSlot *slot) {
+    return slot_key(slot) + shm->header->key_size;
+}
+
+/*
+ * Takes the writer lock. Should a writer have died while holding it, the
+ * sequence counter is made even again so readers do not spin forever.
+ */
+static int lock_writers(MapShmHeader *header) {
+    int result = pthread_mutex_lock(&header->lock);
+
+#ifdef PTHREAD_MUTEX_ROBUST
+    if (result == EOWNERDEAD) {
+        if (header->sequence & 1) {
+            __atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_consistent(&header->lock);
+        result = 0;
+    }
+#endif
+
+    return result;
+}
+
+/*
+ * Marks the start of an update; readers seeing an odd sequence will retry.
+ */
+static void begin_update(MapShmHeader *header) {
+    __atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_update(MapShmHeader *header) {
+    __atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Finds the index of a slot by its key while holding the writer lock.
+ * Returns -1 if the key is not found.
+ */
+static int find_slot_index(MapShm *shm, const void *key, unsigned int key_len) {
+    MapShmSlot *slot;
+    unsigned int i;
+
+    for (i = 0; i < shm->header->size; ++i) {
+        slot = slot_at(shm, i);
+        if (slot->key_len == key_len && memcmp(slot_key(slot), key, key_len) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Checks that the slots a segment's header describes lie within the
+ * mapping, so that a damaged or foreign segment is refused rather than
+ * read out of bounds.
+ */
+static int valid_geometry(MapShm *shm) {
+    MapShmHeader *header = shm->header;
+    size_t slot_needs = sizeof(MapShmSlot) + (size_t)header->key_size + header->value_size;
+
+    return header->slots_offset >= sizeof(MapShmHeader) &&
+        header->slots_offset <= shm->length &&
+        header->slot_size >= slot_needs &&
+        (shm->length - header->slots_offset) / header->slot_size >= header->capacity &&
+        header->size <= header->capacity;
+}
+
+static MapShm *attach(int fd, size_t length) {
+    MapShm *shm;
+    void *base;
+
+    base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                fd == -1 ? MAP_SHARED | MAP_ANONYMOUS : MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    shm = (MapShm *)malloc(sizeof(MapShm));
+    if (!shm) {
+        munmap(base, length);
+        return NULL;
+    }
+
+    shm->header = (MapShmHeader *)base;
+    shm->length = length;
+
+    return shm;
+}
+
+/* --- Public API Functions --- */
+
+MapShm *map_shm_create(const char *name, unsigned int capacity,
+                       unsigned int key_size, unsigned int value_size) {
+    pthread_mutexattr_t attributes;
+    MapShmHeader *header;
+    MapShm *shm;
+    unsigned int slot_size, slots_offset;
+    size_t length;
+    int fd = -1;
+
+    if (capacity == 0 || key_size == 0) {
+        return NULL;
+    }
+
+    /* Keep every slot, and the slots as a whole, suitably aligned */
+    slot_size = (sizeof(MapShmSlot) + key_size + value_size + 7) & ~7u;
+    slots_offset = (sizeof(MapShmHeader) + 63) & ~63u;
+    length = slots_offset + (size_t)capacity * slot_size;
+
+    if (name) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1) {
+            return NULL;
+        }
+
+        if (ftruncate(fd, (off_t)length) != 0) {
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+    }
+
+    shm = attach(fd, length);
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (!shm) {
+        if (name) {
+            shm_unlink(name);
+        }
+        return NULL;
+    }
+
+    header = shm->header;
+    header->version = MAP_SHM_VERSION;
+    header->capacity = capacity;
+    header->key_size = key_size;
+    header->value_size = value_size;
+    header->slot_size = slot_size;
+    header->slots_offset = slots_offset;
+    header->size = 0;
+    header->sequence = 0;
+
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+#ifdef PTHREAD_MUTEX_ROBUST
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(&header->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    /* Publishing the magic last means a half built segment is never opened */
+    __atomic_store_n(&header->magic, MAP_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return shm;
+}
+
+MapShm *map_shm_open(const char *name) {
+    struct stat info;
+    MapShm *shm;
+    int fd;
+
+    if (!name) {
+        return NULL;
+    }
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(MapShmHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    shm = attach(fd, (size_t)info.st_size);
+    close(fd);
+
+    if (!shm) {
+        return NULL;
+    }
+
+    if (__atomic_load_n(&shm->header->magic, __ATOMIC_ACQUIRE) != MAP_SHM_MAGIC ||
+        shm->header->version != MAP_SHM_VERSION || !valid_geometry(shm)) {
+        map_shm_close(shm);
+        return NULL;
+    }
+
+    return shm;
+}
+
+void map_shm_close(MapShm *shm) {
+    if (!shm) {
+        return;
+    }
+
+    munmap(shm->header, shm->length);
+    free(shm);
+}
+
+int map_shm_unlink(const char *name) {
+    if (!name) {
+        return -1;
+    }
+
+    return shm_unlink(name) == 0 ? 0 : -1;
+}
+
+int map_shm_set(MapShm *shm, const void *key, unsigned int key_len,
+                const void *value, unsigned int value_len) {
+    MapShmHeader *header;
+    MapShmSlot *slot;
+    int index;
+
+    if (!shm || !key) {
+        return -1;
+    }
+
+    header = shm->header;
+    if (key_len > header->key_size || value_len > header->value_size ||
+        (value_len && !value)) {
+        return -1;
+    }
+
+    if (lock_writers(header) != 0) {
+        return -1;
+    }
+
+    index = find_slot_index(shm, key, key_len);
+    if (index == -1 && header->size >= header->capacity) {
+        pthread_mutex_unlock(&header->lock);
+        return -1;
+    }
+
+    begin_update(header);
+
+    if (index != -1) {
+        slot = slot_at(shm, index);
+    }
+    else {
+        slot = slot_at(shm, header->size);
+        slot->key_len = key_len;
+        memcpy(slot_key(slot), key, key_len);
+    }
+
+    slot->value_len = value_len;
+    if (value_len) {
+        memcpy(slot_value(shm, slot), value, value_len);
+    }
+
+    if (index == -1) {
+        header->size++;
+    }
+
+    end_update(header);
+    pthread_mutex_unlock(&header->lock);
+
+    return 0;
+}
+
+int map_shm_get(MapShm *shm, const void *key, unsigned int key_len,
+                void *value, unsigned int *value_len) {
+    MapShmHeader *header;
+    MapShmSlot *slot;
+    unsigned int sequence, size, i;
+    unsigned int length = 0;
+    int found = 0;
+
+    if (!shm || !key || !value) {
+        return -1;
+    }
+
+    header = shm->header;
+    if (key_len > header->key_size) {
+        return -1;
+    }
+
+    /*
+     * Read optimistically and start over if a writer was active. Anything
+     * read may be torn until the sequence check passes, so lengths are
+     * clamped before they are used.
+     */
+    do {
+        sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            continue;
+        }
+
+        found = 0;
+        length = 0;
+        size = __atomic_load_n(&header->size, __ATOMIC_RELAXED);
+        if (size > header->capacity) {
+            size = header->capacity;
+        }
+
+        for (i = 0; i < size; ++i) {
+            slot = slot_at(shm, i);
+            if (slot->key_len == key_len && memcmp(slot_key(slot), key, key_len) == 0) {
+                length = slot->value_len;
+                if (length > header->value_size) {
+                    length = header->value_size;
+                }
+                memcpy(value, slot_value(shm, slot), length);
+                found = 1;
+                break;
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) ||
+             sequence != __atomic_load_n(&header->sequence, __ATOMIC_RELAXED));
+
+    if (found && value_len) {
+        *value_len = length;
+    }
+
+    return found ? 0 : -1;
+}
+
+int map_shm_delete(MapShm *shm, const void *key, unsigned int key_len) {
+    MapShmHeader *header;
+    int index;
+
+    if (!shm || !key) {
+        return -1;
+    }
+
+    header = shm->header;
+    if (lock_writers(header) != 0) {
+        return -1;
+    }
+
+    index = find_slot_index(shm, key, key_len);
+    if (index == -1) {
+        pthread_mutex_unlock(&header->lock);
+        return -1;
+    }
+
+    begin_update(header);
+
+    /* Shift all subsequent slots one position to the left */
+    if ((unsigned int)index < header->size - 1) {
+        memmove(slot_at(shm, index), slot_at(shm, index + 1),
+                (size_t)(header->size - index - 1) * header->slot_size);
+    }
+    header->size--;
+
+    end_update(header);
+    pthread_mutex_unlock(&header->lock);
+
+    return 0;
+}
+
+int map_shm_get_size(MapShm *shm) {
+    if (!shm) {
+        return -1;
+    }
+
+    return (int)__atomic_load_n(&shm->header->size, __ATOMIC_ACQUIRE);
+}
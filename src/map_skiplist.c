@@ -0,0 +1,564 @@
+#include <stdlib.h>
+#include <string.h>
+#include "map_skiplist.h"
+
+#define MAP_SKIPLIST_MAX_LEVEL 24
+
+/* Keeps the epoch counters on separate cache lines */
+#define MAP_CACHE_LINE 64
+
+/*
+ * Atomic operations, as in map.c. Without GCC style builtins these become
+ * plain accesses and the list is only safe on one thread, as the header
+ * says.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define MAP_ATOMIC_LOAD(p)        __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define MAP_ATOMIC_STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define MAP_ATOMIC_EXCHANGE(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define MAP_ATOMIC_ADD(p, v)      __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define MAP_ATOMIC_SUB(p, v)      __atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define MAP_ATOMIC_CAS(p, e, v)   \
+    __atomic_compare_exchange_n((p), (e), (v), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#else
+#define MAP_ATOMIC_LOAD(p)        (*(p))
+#define MAP_ATOMIC_STORE(p, v)    (*(p) = (v))
+#define MAP_ATOMIC_EXCHANGE(p, v) map_plain_exchange((void **)(p), (v))
+#define MAP_ATOMIC_ADD(p, v)      (*(p) += (v))
+#define MAP_ATOMIC_SUB(p, v)      (*(p) -= (v))
+#define MAP_ATOMIC_CAS(p, e, v)   \
+    (*(p) == *(e) ? (*(p) = (v), 1) : (*(e) = *(p), 0))
+
+static void *map_plain_exchange(void **p, void *v) {
+    void *old = *p;
+    *p = v;
+    return old;
+}
+#endif
+
+/*
+ * A node is removed by setting the lowest bit of its own next pointers,
+ * which nodes are aligned well enough to never use. A marked pointer can
+ * no longer be changed, so nothing can be linked in after a node that is
+ * being removed.
+ */
+#define MARKED(p)  (((size_t)(p) & 1) != 0)
+#define MARK(p)    ((SkipNode *)((size_t)(p) | 1))
+#define UNMARK(p)  ((SkipNode *)((size_t)(p) & ~(size_t)1))
+
+/*
+ * One entry of the list, linked into levels 0 up to level - 1. Pending
+ * counts down the two parties that may still touch the node's links: the
+ * thread inserting it, until it has finished linking the upper levels, and
+ * the thread removing it. Whichever finishes last unlinks it for good and
+ * retires it.
+ */
+typedef struct SkipNode {
+    void *key;
+    void *value;
+    struct SkipNode *retired_next;
+    unsigned int level;
+    int pending;
+    struct SkipNode *next[1];
+} SkipNode;
+
+/*
+ * A count of the operations that entered in one epoch, padded out to a
+ * cache line of its own.
+ */
+typedef struct EpochSlot {
+    int active;
+    char padding[MAP_CACHE_LINE - sizeof(int)];
+} EpochSlot;
+
+/*
+ * The structure behind a skip list map. Retired nodes wait on the list of
+ * the epoch they were retired in; the global epoch only moves on once no
+ * operation is left in the epoch before it, at which point nothing can
+ * reach the nodes retired two epochs ago and they are freed.
+ */
+typedef struct SkipList {
+    struct Map map;
+    MapKeyCompareFunc compare_func;
+    SkipNode *head;
+    int size;
+    unsigned int seed;
+    unsigned int epoch;
+    EpochSlot slots[3];
+    SkipNode *retired[3];
+} SkipList;
+
+/* --- Epoch Helpers --- */
+
+/*
+ * Counts the calling thread into the current epoch, which it stays in
+ * until the matching `leave_epoch`. Returns the epoch entered.
+ */
+static unsigned int enter_epoch(SkipList *list) {
+    unsigned int epoch;
+
+    for (;;) {
+        epoch = MAP_ATOMIC_LOAD(&list->epoch);
+        MAP_ATOMIC_ADD(&list->slots[epoch % 3].active, 1);
+        if (MAP_ATOMIC_LOAD(&list->epoch) == epoch) {
+            return epoch;
+        }
+        MAP_ATOMIC_SUB(&list->slots[epoch % 3].active, 1);
+    }
+}
+
+static void leave_epoch(SkipList *list, unsigned int epoch) {
+    MAP_ATOMIC_SUB(&list->slots[epoch % 3].active, 1);
+}
+
+static void free_chain(SkipNode *node) {
+    SkipNode *next;
+
+    while (node) {
+        next = node->retired_next;
+        free(node);
+        node = next;
+    }
+}
+
+/*
+ * Moves the global epoch on if no operation is still in the previous one,
+ * and frees the nodes that were retired in it. Every operation then
+ * running entered after those nodes were unlinked.
+ */
+static void try_advance_epoch(SkipList *list) {
+    unsigned int epoch = MAP_ATOMIC_LOAD(&list->epoch);
+    unsigned int expected = epoch;
+
+    if (MAP_ATOMIC_LOAD(&list->slots[(epoch + 2) % 3].active) != 0) {
+        return;
+    }
+
+    if (MAP_ATOMIC_CAS(&list->epoch, &expected, epoch + 1)) {
+        free_chain((SkipNode *)MAP_ATOMIC_EXCHANGE(&list->retired[(epoch + 2) % 3], NULL));
+    }
+}
+
+/*
+ * Hands an unlinked node over to be freed once no operation can still be
+ * looking at it. Must be called from within an epoch.
+ */
+static void retire_node(SkipList *list, SkipNode *node) {
+    SkipNode **retired = &list->retired[MAP_ATOMIC_LOAD(&list->epoch) % 3];
+    SkipNode *head = MAP_ATOMIC_LOAD(retired);
+
+    do {
+        node->retired_next = head;
+    } while (!MAP_ATOMIC_CAS(retired, &head, node));
+
+    try_advance_epoch(list);
+}
+
+/* --- Private Helper Function --- */
+
+static SkipNode *create_node(void *key, void *value, unsigned int level) {
+    SkipNode *node = (SkipNode *)malloc(sizeof(SkipNode) + (level - 1) * sizeof(SkipNode *));
+
+    if (!node) {
+        return NULL;
+    }
+
+    node->key = key;
+    node->value = value;
+    node->retired_next = NULL;
+    node->level = level;
+    node->pending = 2;
+
+    return node;
+}
+
+/*
+ * Picks the level of a new node, each level being half as likely as the
+ * one below it.
+ */
+static unsigned int random_level(SkipList *list) {
+    unsigned int x = MAP_ATOMIC_ADD(&list->seed, 0x9e3779b9u);
+    unsigned int level = 1;
+
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+
+    while ((x & 1) && level < MAP_SKIPLIST_MAX_LEVEL) {
+        ++level;
+        x >>= 1;
+    }
+
+    return level;
+}
+
+/*
+ * Finds, on every level, the last node before key and the first node at
+ * or after it, unlinking any removed nodes met on the way. Returns
+ * non-zero if the node found on level 0 holds key.
+ */
+static int find_nodes(SkipList *list, const void *key, SkipNode **preds, SkipNode **succs) {
+    SkipNode *pred, *curr, *succ, *expected;
+    int level;
+
+retry:
+    pred = list->head;
+    for (level = MAP_SKIPLIST_MAX_LEVEL - 1; level >= 0; --level) {
+        curr = UNMARK(MAP_ATOMIC_LOAD(&pred->next[level]));
+
+        while (curr) {
+            succ = MAP_ATOMIC_LOAD(&curr->next[level]);
+            if (MARKED(succ)) {
+                expected = curr;
+                if (!MAP_ATOMIC_CAS(&pred->next[level], &expected, UNMARK(succ))) {
+                    goto retry;
+                }
+                curr = UNMARK(succ);
+                continue;
+            }
+
+            if (list->compare_func(curr->key, key) >= 0) {
+                break;
+            }
+
+            pred = curr;
+            curr = succ;
+        }
+
+        preds[level] = pred;
+        succs[level] = curr;
+    }
+
+    return succs[0] && list->compare_func(succs[0]->key, key) == 0;
+}
+
+/*
+ * Finds the node holding key without changing the list, stepping over
+ * removed nodes rather than unlinking them. A node's upper levels are
+ * marked before level 0, so one seen unmarked on any level was still in
+ * the list at that moment. Returns NULL if there is none.
+ */
+static SkipNode *search_node(SkipList *list, const void *key) {
+    SkipNode *pred = list->head;
+    SkipNode *curr;
+    SkipNode *succ;
+    int level, result;
+
+    for (level = MAP_SKIPLIST_MAX_LEVEL - 1; level >= 0; --level) {
+        curr = UNMARK(MAP_ATOMIC_LOAD(&pred->next[level]));
+
+        while (curr) {
+            succ = MAP_ATOMIC_LOAD(&curr->next[level]);
+            if (MARKED(succ)) {
+                curr = UNMARK(succ);
+                continue;
+            }
+
+            result = list->compare_func(curr->key, key);
+            if (result == 0) {
+                return curr;
+            }
+            if (result > 0) {
+                break;
+            }
+
+            pred = curr;
+            curr = succ;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Finds the first node at or after key, or the first node of all if key
+ * is NULL, stepping over removed nodes.
+ */
+static SkipNode *search_from(SkipList *list, const void *key) {
+    SkipNode *pred = list->head;
+    SkipNode *curr = NULL;
+    SkipNode *succ;
+    int level;
+
+    for (level = MAP_SKIPLIST_MAX_LEVEL - 1; level >= 0; --level) {
+        curr = UNMARK(MAP_ATOMIC_LOAD(&pred->next[level]));
+
+        while (curr && key) {
+            succ = MAP_ATOMIC_LOAD(&curr->next[level]);
+            if (MARKED(succ)) {
+                curr = UNMARK(succ);
+                continue;
+            }
+
+            if (list->compare_func(curr->key, key) >= 0) {
+                break;
+            }
+
+            pred = curr;
+            curr = succ;
+        }
+    }
+
+    return curr;
+}
+
+/*
+ * Called by the inserting and the removing thread once each is done with
+ * a node. The second to get here unlinks the node from every level it is
+ * still linked into and retires it.
+ */
+static void finish_node(SkipList *list, SkipNode *node) {
+    SkipNode *preds[MAP_SKIPLIST_MAX_LEVEL];
+    SkipNode *succs[MAP_SKIPLIST_MAX_LEVEL];
+
+    if (MAP_ATOMIC_SUB(&node->pending, 1) == 0) {
+        find_nodes(list, node->key, preds, succs);
+        retire_node(list, node);
+    }
+}
+
+/*
+ * Links the upper levels of a node already linked into level 0, stopping
+ * early if the node gets removed meanwhile.
+ */
+static void link_upper_levels(SkipList *list, SkipNode *node, SkipNode **preds, SkipNode **succs) {
+    SkipNode *next, *expected;
+    unsigned int level;
+
+    for (level = 1; level < node->level; ++level) {
+        for (;;) {
+            next = MAP_ATOMIC_LOAD(&node->next[level]);
+            if (MARKED(next)) {
+                return;
+            }
+            if (next != succs[level] && !MAP_ATOMIC_CAS(&node->next[level], &next, succs[level])) {
+                return;
+            }
+
+            expected = succs[level];
+            if (MAP_ATOMIC_CAS(&preds[level]->next[level], &expected, node)) {
+                break;
+            }
+
+            find_nodes(list, node->key, preds, succs);
+            if (succs[0] != node) {
+                return;
+            }
+        }
+    }
+}
+
+/* --- Map Functions --- */
+
+static int skiplist_set(Map *map, void *key, void *value) {
+    SkipList *list = (SkipList *)map;
+    SkipNode *preds[MAP_SKIPLIST_MAX_LEVEL];
+    SkipNode *succs[MAP_SKIPLIST_MAX_LEVEL];
+    SkipNode *node = NULL;
+    SkipNode *expected;
+    unsigned int epoch, level;
+
+    if (!map) {
+        return -1;
+    }
+
+    epoch = enter_epoch(list);
+    for (;;) {
+        if (find_nodes(list, key, preds, succs)) {
+            MAP_ATOMIC_STORE(&succs[0]->value, value);
+            free(node);
+            leave_epoch(list, epoch);
+            return 0;
+        }
+
+        if (!node) {
+            node = create_node(key, value, random_level(list));
+            if (!node) {
+                leave_epoch(list, epoch);
+                return -1;
+            }
+        }
+
+        for (level = 0; level < node->level; ++level) {
+            node->next[level] = succs[level];
+        }
+
+        expected = succs[0];
+        if (MAP_ATOMIC_CAS(&preds[0]->next[0], &expected, node)) {
+            break;
+        }
+    }
+
+    MAP_ATOMIC_ADD(&list->size, 1);
+    link_upper_levels(list, node, preds, succs);
+    finish_node(list, node);
+    leave_epoch(list, epoch);
+
+    return 0;
+}
+
+static void *skiplist_get(Map *map, const void *key) {
+    SkipList *list = (SkipList *)map;
+    SkipNode *node;
+    void *value = NULL;
+    unsigned int epoch;
+
+    if (!map) {
+        return NULL;
+    }
+
+    epoch = enter_epoch(list);
+    node = search_node(list, key);
+    if (node) {
+        value = MAP_ATOMIC_LOAD(&node->value);
+    }
+    leave_epoch(list, epoch);
+
+    return value;
+}
+
+static void skiplist_delete(Map *map, const void *key) {
+    SkipList *list = (SkipList *)map;
+    SkipNode *preds[MAP_SKIPLIST_MAX_LEVEL];
+    SkipNode *succs[MAP_SKIPLIST_MAX_LEVEL];
+    SkipNode *node, *next;
+    unsigned int epoch, level;
+
+    if (!map) {
+        return;
+    }
+
+    epoch = enter_epoch(list);
+    if (!find_nodes(list, key, preds, succs)) {
+        leave_epoch(list, epoch);
+        return;
+    }
+
+    /* Mark the upper levels first so that searches stop using them */
+    node = succs[0];
+    for (level = node->level - 1; level > 0; --level) {
+        next = MAP_ATOMIC_LOAD(&node->next[level]);
+        while (!MARKED(next) && !MAP_ATOMIC_CAS(&node->next[level], &next, MARK(next))) {
+        }
+    }
+
+    /* Whoever marks level 0 is the one that removed the key */
+    next = MAP_ATOMIC_LOAD(&node->next[0]);
+    for (;;) {
+        if (MARKED(next)) {
+            leave_epoch(list, epoch);
+            return;
+        }
+        if (MAP_ATOMIC_CAS(&node->next[0], &next, MARK(next))) {
+            break;
+        }
+    }
+
+    MAP_ATOMIC_SUB(&list->size, 1);
+    finish_node(list, node);
+    leave_epoch(list, epoch);
+}
+
+static int skiplist_get_size(Map *map) {
+    if (!map) {
+        return -1;
+    }
+
+    return MAP_ATOMIC_LOAD(&((SkipList *)map)->size);
+}
+
+/*
+ * Nodes are allocated one per entry, so the capacity is always the size.
+ */
+static int skiplist_get_capacity(Map *map) {
+    return skiplist_get_size(map);
+}
+
+/* --- Public API Functions --- */
+
+Map *map_skiplist_create(MapKeyCompareFunc compare_func) {
+    SkipList *list;
+    unsigned int level;
+
+    if (!compare_func) {
+        return NULL;
+    }
+
+    list = (SkipList *)calloc(1, sizeof(SkipList));
+    if (!list) {
+        return NULL;
+    }
+
+    list->head = create_node(NULL, NULL, MAP_SKIPLIST_MAX_LEVEL);
+    if (!list->head) {
+        free(list);
+        return NULL;
+    }
+
+    for (level = 0; level < MAP_SKIPLIST_MAX_LEVEL; ++level) {
+        list->head->next[level] = NULL;
+    }
+
+    list->compare_func = compare_func;
+    list->map.set = skiplist_set;
+    list->map.get = skiplist_get;
+    list->map.delete = skiplist_delete;
+    list->map.getSize = skiplist_get_size;
+    list->map.getCapacity = skiplist_get_capacity;
+
+    return (struct Map *)list;
+}
+
+void map_skiplist_free(Map *map) {
+    SkipList *list = (SkipList *)map;
+    SkipNode *node, *next;
+    int i;
+
+    if (!map) {
+        return;
+    }
+
+    /* Removed nodes are unlinked before being retired, so these are all live */
+    node = list->head->next[0];
+    while (node) {
+        next = node->next[0];
+        free(node);
+        node = next;
+    }
+
+    for (i = 0; i < 3; ++i) {
+        free_chain(list->retired[i]);
+    }
+
+    free(list->head);
+    free(list);
+}
+
+int map_skiplist_range(Map *map, const void *from, const void *to,
+                       MapScanFunc callback, void *context) {
+    SkipList *list = (SkipList *)map;
+    SkipNode *node, *next;
+    unsigned int epoch;
+    int visited = 0;
+
+    if (!map || !callback) {
+        return -1;
+    }
+
+    epoch = enter_epoch(list);
+    for (node = search_from(list, from); node; node = UNMARK(next)) {
+        next = MAP_ATOMIC_LOAD(&node->next[0]);
+        if (to && list->compare_func(node->key, to) >= 0) {
+            break;
+        }
+        if (!MARKED(next)) {
+            callback(node->key, MAP_ATOMIC_LOAD(&node->value), context);
+            ++visited;
+        }
+    }
+    leave_epoch(list, epoch);
+
+    return visited;
+}
@@ -0,0 +1,909 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "map_tiered.h"
+
+#define MAP_TIERED_PARTITIONS  16
+#define MAP_TIERED_EVICT_BATCH 64
+
+/* Partitions are only compacted once they have this much dead space */
+#define MAP_TIERED_COMPACT_MIN (1024UL * 1024UL)
+
+/* Spilled records start with the lengths of their key and value */
+#define MAP_TIERED_RECORD_HEADER 8
+
+/*
+ * Values shorter than this are never compressed, and compression must
+ * save at least an eighth of a value for it to be kept.
+ */
+#define MAP_TIERED_COMPRESS_MIN 64
+
+/*
+ * What the in-memory map stores as the value of each entry. The key is
+ * kept alongside so it can be freed when the entry goes away. A cold
+ * value may be held compressed instead, in which case value is NULL and
+ * length is the size of its serialized form.
+ */
+typedef struct TieredValue {
+    void *key;
+    void *value;
+    unsigned char *compressed;
+    unsigned int compressed_length;
+    unsigned int length;
+    unsigned long bytes;
+    unsigned int accesses;
+    int referenced;
+} TieredValue;
+
+/*
+ * One slot of a partition's index, mapping the hash of a spilled key to
+ * the offset of its record. Slots are open addressed by hash.
+ */
+typedef struct SpillSlot {
+    unsigned long offset;
+    unsigned int hash;
+    unsigned int used;
+} SpillSlot;
+
+typedef struct Partition {
+    FILE *file;
+    char *path;
+    unsigned long end;
+    unsigned long dead;
+    SpillSlot *slots;
+    unsigned int slot_count;
+    unsigned int used;
+} Partition;
+
+struct MapTiered {
+    Map *hot;
+    MapCodec codec;
+    MapFreeFunc free_key;
+    MapFreeFunc free_value;
+    unsigned long budget;
+    unsigned long hot_bytes;
+    unsigned int clock_hand;
+    unsigned int compress_hand;
+    unsigned int spilled;
+    unsigned int compressed;
+    Partition partitions[MAP_TIERED_PARTITIONS];
+    unsigned char *key_bytes;
+    unsigned long key_bytes_size;
+    unsigned char *record;
+    unsigned long record_size;
+};
+
+/*
+ * What a pass of map_tiered_compress_cold needs to see in each entry.
+ */
+typedef struct CompressPass {
+    MapTiered *tiered;
+    unsigned int threshold;
+    int result;
+} CompressPass;
+
+/*
+ * The entries picked for spilling by one sweep of the clock hand.
+ */
+typedef struct Victims {
+    TieredValue *entries[MAP_TIERED_EVICT_BATCH];
+    unsigned int count;
+} Victims;
+
+/* --- Private Helper Functions --- */
+
+static unsigned int hash_bytes(const unsigned char *data, unsigned int length) {
+    unsigned int hash = 2166136261u;
+
+    while (length--) {
+        hash = (hash ^ *data++) * 16777619u;
+    }
+
+    return hash;
+}
+
+static int ensure_size(unsigned char **buffer, unsigned long *size, unsigned long needed) {
+    unsigned char *grown;
+
+    if (needed <= *size) {
+        return 0;
+    }
+
+    grown = (unsigned char *)realloc(*buffer, needed);
+    if (!grown) {
+        return -1;
+    }
+
+    *buffer = grown;
+    *size = needed;
+
+    return 0;
+}
+
+static Partition *partition_for(MapTiered *tiered, unsigned int hash) {
+    /* The top bits pick the partition; the low bits pick the index slot */
+    return &tiered->partitions[hash >> 28];
+}
+
+/*
+ * Serializes a key into the map's key scratch buffer, so that serializing
+ * a value afterwards does not clobber it. Returns NULL on failure.
+ */
+static unsigned char *serialize_key(MapTiered *tiered, const void *key, unsigned int *length) {
+    const void *bytes;
+
+    bytes = tiered->codec.serialize_key(key, length, tiered->codec.context);
+    if ((!bytes && *length) ||
+        ensure_size(&tiered->key_bytes, &tiered->key_bytes_size, *length + 1) != 0) {
+        return NULL;
+    }
+
+    memcpy(tiered->key_bytes, bytes, *length);
+    return tiered->key_bytes;
+}
+
+/*
+ * Reads the spilled record at offset into the record buffer.
+ * Returns 0 on success, -1 on an I/O error.
+ */
+static int read_record(MapTiered *tiered, Partition *partition, unsigned long offset,
+                       unsigned int *key_length, unsigned int *value_length) {
+    unsigned int lengths[2];
+
+    if (fseek(partition->file, (long)offset, SEEK_SET) != 0 ||
+        fread(lengths, sizeof(unsigned int), 2, partition->file) != 2 ||
+        ensure_size(&tiered->record, &tiered->record_size,
+                    (unsigned long)lengths[0] + lengths[1] + 1) != 0) {
+        return -1;
+    }
+
+    if (fread(tiered->record, 1, lengths[0] + lengths[1], partition->file) != lengths[0] + lengths[1]) {
+        return -1;
+    }
+
+    *key_length = lengths[0];
+    *value_length = lengths[1];
+
+    return 0;
+}
+
+/*
+ * Finds the index slot of a spilled key, reading back the record of every
+ * slot with a matching hash to rule out collisions. On success the record
+ * is left in the record buffer. Returns -1 if the key is not spilled.
+ */
+static int find_slot(MapTiered *tiered, Partition *partition, unsigned int hash,
+                     const unsigned char *key, unsigned int key_length,
+                     unsigned int *value_length) {
+    unsigned int mask = partition->slot_count - 1;
+    unsigned int index, found_key_length;
+
+    if (!partition->used) {
+        return -1;
+    }
+
+    for (index = hash & mask; partition->slots[index].used; index = (index + 1) & mask) {
+        if (partition->slots[index].hash != hash) {
+            continue;
+        }
+
+        if (read_record(tiered, partition, partition->slots[index].offset,
+                        &found_key_length, value_length) == 0 &&
+            found_key_length == key_length &&
+            memcmp(tiered->record, key, key_length) == 0) {
+            return (int)index;
+        }
+    }
+
+    return -1;
+}
+
+static int insert_slot(Partition *partition, unsigned int hash, unsigned long offset) {
+    SpillSlot *old_slots = partition->slots;
+    unsigned int old_count = partition->slot_count;
+    unsigned int mask, index, i;
+
+    /* Keep the index at most three quarters full */
+    if ((partition->used + 1) * 4 > partition->slot_count * 3) {
+        partition->slot_count = old_count ? old_count * 2 : 64;
+        partition->slots = (SpillSlot *)calloc(partition->slot_count, sizeof(SpillSlot));
+        if (!partition->slots) {
+            partition->slots = old_slots;
+            partition->slot_count = old_count;
+            return -1;
+        }
+
+        mask = partition->slot_count - 1;
+        for (i = 0; i < old_count; ++i) {
+            if (old_slots[i].used) {
+                for (index = old_slots[i].hash & mask; partition->slots[index].used;
+                     index = (index + 1) & mask) {
+                }
+                partition->slots[index] = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+
+    mask = partition->slot_count - 1;
+    for (index = hash & mask; partition->slots[index].used; index = (index + 1) & mask) {
+    }
+
+    partition->slots[index].hash = hash;
+    partition->slots[index].offset = offset;
+    partition->slots[index].used = 1;
+    partition->used++;
+
+    return 0;
+}
+
+/*
+ * Empties an index slot, shifting back any later slot of the same probe
+ * run that would otherwise become unreachable.
+ */
+static void remove_slot(Partition *partition, unsigned int index) {
+    unsigned int mask = partition->slot_count - 1;
+    unsigned int next, home;
+
+    for (next = (index + 1) & mask; partition->slots[next].used; next = (next + 1) & mask) {
+        home = partition->slots[next].hash & mask;
+
+        /* Move the slot back unless its home lies cyclically in (index, next] */
+        if ((index <= next) ? (home <= index || home > next) : (home <= index && home > next)) {
+            partition->slots[index] = partition->slots[next];
+            index = next;
+        }
+    }
+
+    partition->slots[index].used = 0;
+    partition->used--;
+}
+
+/*
+ * Rewrites a partition file with only the records its index still refers
+ * to, once removed records take up most of it.
+ */
+static void compact_partition(MapTiered *tiered, Partition *partition) {
+    unsigned int lengths[2], i;
+    unsigned long *offsets, end = 0;
+    char *compact_path;
+    FILE *compact;
+
+    if (partition->dead < MAP_TIERED_COMPACT_MIN || partition->dead * 2 < partition->end) {
+        return;
+    }
+
+    compact_path = (char *)malloc(strlen(partition->path) + 9);
+    offsets = (unsigned long *)malloc(partition->slot_count * sizeof(unsigned long));
+    compact = NULL;
+    if (compact_path && offsets) {
+        strcpy(compact_path, partition->path);
+        strcat(compact_path, ".compact");
+        compact = fopen(compact_path, "w+b");
+    }
+
+    if (!compact) {
+        free(compact_path);
+        free(offsets);
+        return;
+    }
+
+    for (i = 0; i < partition->slot_count; ++i) {
+        if (!partition->slots[i].used) {
+            continue;
+        }
+
+        if (read_record(tiered, partition, partition->slots[i].offset, &lengths[0], &lengths[1]) != 0 ||
+            fwrite(lengths, sizeof(unsigned int), 2, compact) != 2 ||
+            fwrite(tiered->record, 1, lengths[0] + lengths[1], compact) != lengths[0] + lengths[1]) {
+            break;
+        }
+
+        offsets[i] = end;
+        end += MAP_TIERED_RECORD_HEADER + lengths[0] + lengths[1];
+    }
+
+    /* The old file stays in use unless the new one was written in full */
+    if (i < partition->slot_count || fflush(compact) != 0) {
+        fclose(compact);
+        remove(compact_path);
+        free(compact_path);
+        free(offsets);
+        return;
+    }
+
+    fclose(partition->file);
+    partition->file = compact;
+    if (rename(compact_path, partition->path) != 0) {
+        remove(partition->path);
+        strcpy(partition->path, compact_path);
+    }
+
+    for (i = 0; i < partition->slot_count; ++i) {
+        if (partition->slots[i].used) {
+            partition->slots[i].offset = offsets[i];
+        }
+    }
+
+    partition->end = end;
+    partition->dead = 0;
+
+    free(compact_path);
+    free(offsets);
+}
+
+/*
+ * Finds the spilled record of a key, leaving it in the record buffer.
+ * Returns its index slot, -1 if the key is not spilled, or -2 on failure.
+ */
+static int find_spilled(MapTiered *tiered, const void *key, Partition **partition,
+                        unsigned int *key_length, unsigned int *value_length) {
+    unsigned int hash;
+    unsigned char *key_bytes;
+
+    key_bytes = serialize_key(tiered, key, key_length);
+    if (!key_bytes) {
+        return -2;
+    }
+
+    hash = hash_bytes(key_bytes, *key_length);
+    *partition = partition_for(tiered, hash);
+
+    return find_slot(tiered, *partition, hash, key_bytes, *key_length, value_length);
+}
+
+/*
+ * Rebuilds a spilled key and value from disk, leaving the record in place
+ * so nothing is lost if the caller cannot take them in.
+ * Returns 1 if the key was spilled, 0 if not, -1 on failure.
+ */
+static int read_spilled(MapTiered *tiered, const void *key, void **restored_key, void **restored_value) {
+    unsigned int key_length, value_length;
+    Partition *partition;
+    int index;
+
+    index = find_spilled(tiered, key, &partition, &key_length, &value_length);
+    if (index < 0) {
+        return index == -1 ? 0 : -1;
+    }
+
+    *restored_key = tiered->codec.deserialize_key(tiered->record, key_length,
+                                                  tiered->codec.context);
+    *restored_value = *restored_key
+        ? tiered->codec.deserialize_value(tiered->record + key_length, value_length,
+                                          tiered->codec.context)
+        : NULL;
+
+    if (!*restored_value) {
+        if (*restored_key && tiered->free_key) {
+            tiered->free_key(*restored_key);
+        }
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * Removes a key from disk if it was spilled.
+ * Returns 1 if the key was spilled, 0 if not, -1 on failure.
+ */
+static int unspill(MapTiered *tiered, const void *key) {
+    unsigned int key_length, value_length;
+    Partition *partition;
+    int index;
+
+    index = find_spilled(tiered, key, &partition, &key_length, &value_length);
+    if (index < 0) {
+        return index == -1 ? 0 : -1;
+    }
+
+    partition->dead += MAP_TIERED_RECORD_HEADER + key_length + value_length;
+    remove_slot(partition, (unsigned int)index);
+    tiered->spilled--;
+
+    compact_partition(tiered, partition);
+
+    return 1;
+}
+
+/*
+ * Replaces the value of an entry with its compressed serialized form.
+ * Returns 1 if it was compressed, 0 if it was not worth it, -1 on failure.
+ */
+static int compress_entry(MapTiered *tiered, TieredValue *entry) {
+    const void *bytes;
+    unsigned char *compressed, *shrunk;
+    unsigned int length, compressed_length;
+
+    bytes = tiered->codec.serialize_value(entry->value, &length, tiered->codec.context);
+    if (!bytes && length) {
+        return -1;
+    }
+
+    if (length < MAP_TIERED_COMPRESS_MIN) {
+        return 0;
+    }
+
+    compressed = (unsigned char *)malloc(length);
+    if (!compressed) {
+        return -1;
+    }
+
+    compressed_length = map_lz_compress(bytes, length, compressed, length - length / 8);
+    if (!compressed_length) {
+        free(compressed);
+        return 0;
+    }
+
+    shrunk = (unsigned char *)realloc(compressed, compressed_length);
+    if (shrunk) {
+        compressed = shrunk;
+    }
+
+    if (tiered->free_value) {
+        tiered->free_value(entry->value);
+    }
+
+    entry->value = NULL;
+    entry->compressed = compressed;
+    entry->compressed_length = compressed_length;
+    entry->length = length;
+    entry->bytes -= length - compressed_length;
+    tiered->hot_bytes -= length - compressed_length;
+    tiered->compressed++;
+
+    return 1;
+}
+
+/*
+ * Decompresses the value of an entry into the record buffer.
+ * Returns 0 on success, -1 on failure.
+ */
+static int inflate_value(MapTiered *tiered, TieredValue *entry) {
+    if (ensure_size(&tiered->record, &tiered->record_size, (unsigned long)entry->length + 1) != 0) {
+        return -1;
+    }
+
+    return map_lz_decompress(entry->compressed, entry->compressed_length, tiered->record, entry->length);
+}
+
+/*
+ * Brings a compressed value back into its deserialized form. The memory
+ * budget is not enforced here, as that could spill the very entry being
+ * read; it catches up when entries are next added to memory.
+ * Returns 0 on success, -1 on failure.
+ */
+static int decompress_entry(MapTiered *tiered, TieredValue *entry) {
+    void *value;
+
+    if (inflate_value(tiered, entry) != 0) {
+        return -1;
+    }
+
+    value = tiered->codec.deserialize_value(tiered->record, entry->length, tiered->codec.context);
+    if (!value) {
+        return -1;
+    }
+
+    free(entry->compressed);
+
+    entry->value = value;
+    entry->compressed = NULL;
+    entry->bytes += entry->length - entry->compressed_length;
+    tiered->hot_bytes += entry->length - entry->compressed_length;
+    tiered->compressed--;
+
+    return 0;
+}
+
+/*
+ * Appends an in-memory entry to its partition file and indexes it.
+ * Returns 0 on success, -1 on failure.
+ */
+static int spill(MapTiered *tiered, TieredValue *entry) {
+    unsigned int lengths[2], hash;
+    unsigned char *key_bytes;
+    const void *value_bytes;
+    Partition *partition;
+
+    key_bytes = serialize_key(tiered, entry->key, &lengths[0]);
+    if (!key_bytes) {
+        return -1;
+    }
+
+    /* Compressed values are written out in their serialized form */
+    if (entry->compressed) {
+        if (inflate_value(tiered, entry) != 0) {
+            return -1;
+        }
+        value_bytes = tiered->record;
+        lengths[1] = entry->length;
+    }
+    else {
+        value_bytes = tiered->codec.serialize_value(entry->value, &lengths[1], tiered->codec.context);
+        if (!value_bytes && lengths[1]) {
+            return -1;
+        }
+    }
+
+    hash = hash_bytes(key_bytes, lengths[0]);
+    partition = partition_for(tiered, hash);
+
+    if (fseek(partition->file, (long)partition->end, SEEK_SET) != 0 ||
+        fwrite(lengths, sizeof(unsigned int), 2, partition->file) != 2 ||
+        fwrite(key_bytes, 1, lengths[0], partition->file) != lengths[0] ||
+        (lengths[1] && fwrite(value_bytes, 1, lengths[1], partition->file) != lengths[1]) ||
+        insert_slot(partition, hash, partition->end) != 0) {
+        return -1;
+    }
+
+    partition->end += MAP_TIERED_RECORD_HEADER + lengths[0] + lengths[1];
+    tiered->spilled++;
+
+    return 0;
+}
+
+static void release_value(MapTiered *tiered, TieredValue *entry) {
+    if (entry->compressed) {
+        free(entry->compressed);
+        entry->compressed = NULL;
+        tiered->compressed--;
+    }
+    else if (tiered->free_value) {
+        tiered->free_value(entry->value);
+    }
+}
+
+static void release_entry(MapTiered *tiered, TieredValue *entry) {
+    if (tiered->free_key) {
+        tiered->free_key(entry->key);
+    }
+    release_value(tiered, entry);
+    free(entry);
+}
+
+/*
+ * Compresses the values of entries used fewer times than the threshold
+ * since the last pass, then halves every access count so that only
+ * recent use keeps an entry warm.
+ */
+static void compress_if_cold(void *key, void *value, void *context) {
+    TieredValue *entry = (TieredValue *)value;
+    CompressPass *pass = (CompressPass *)context;
+    int result;
+
+    (void)key;
+
+    if (!entry->compressed && entry->accesses < pass->threshold && pass->result >= 0) {
+        result = compress_entry(pass->tiered, entry);
+        pass->result = result < 0 ? -1 : pass->result + result;
+    }
+
+    entry->accesses >>= 1;
+}
+
+/*
+ * The clock hand: entries used since it last passed are spared once, the
+ * others are picked for spilling.
+ */
+static void pick_victim(void *key, void *value, void *context) {
+    TieredValue *entry = (TieredValue *)value;
+    Victims *victims = (Victims *)context;
+
+    (void)key;
+
+    if (entry->referenced) {
+        entry->referenced = 0;
+    }
+    else if (victims->count < MAP_TIERED_EVICT_BATCH) {
+        victims->entries[victims->count++] = entry;
+    }
+}
+
+/*
+ * Spills entries until an entry of incoming bytes fits within the budget.
+ * Returns 0 on success, -1 on failure.
+ */
+static int make_room(MapTiered *tiered, unsigned long incoming) {
+    Victims victims;
+    unsigned int i;
+
+    while (tiered->hot_bytes + incoming > tiered->budget && map_get_size(tiered->hot) > 0) {
+        victims.count = 0;
+        tiered->clock_hand = map_scan(tiered->hot, tiered->clock_hand,
+                                      MAP_TIERED_EVICT_BATCH, pick_victim, &victims);
+
+        for (i = 0; i < victims.count && tiered->hot_bytes + incoming > tiered->budget; ++i) {
+            if (spill(tiered, victims.entries[i]) != 0) {
+                return -1;
+            }
+
+            map_delete(tiered->hot, victims.entries[i]->key);
+            tiered->hot_bytes -= victims.entries[i]->bytes;
+            release_entry(tiered, victims.entries[i]);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Estimates what an entry costs in memory from its serialized size.
+ */
+static int entry_bytes(MapTiered *tiered, const void *key, const void *value, unsigned long *bytes) {
+    unsigned int key_length = 0, value_length = 0;
+
+    if ((!tiered->codec.serialize_key(key, &key_length, tiered->codec.context) && key_length) ||
+        (!tiered->codec.serialize_value(value, &value_length, tiered->codec.context) && value_length)) {
+        return -1;
+    }
+
+    *bytes = (unsigned long)key_length + value_length + sizeof(TieredValue) + 2 * sizeof(void *);
+    return 0;
+}
+
+/*
+ * Adds an entry that is in neither tier to memory, making room for it.
+ * Returns the entry, or NULL on failure.
+ */
+static TieredValue *add_hot(MapTiered *tiered, void *key, void *value) {
+    TieredValue *entry;
+    unsigned long bytes;
+
+    if (entry_bytes(tiered, key, value, &bytes) != 0 || make_room(tiered, bytes) != 0) {
+        return NULL;
+    }
+
+    entry = (TieredValue *)malloc(sizeof(TieredValue));
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->key = key;
+    entry->value = value;
+    entry->compressed = NULL;
+    entry->compressed_length = 0;
+    entry->length = 0;
+    entry->bytes = bytes;
+    entry->accesses = 1;
+    entry->referenced = 1;
+
+    if (map_set(tiered->hot, key, entry) != 0) {
+        free(entry);
+        return NULL;
+    }
+
+    tiered->hot_bytes += bytes;
+    return entry;
+}
+
+/* --- Public API Functions --- */
+
+MapTiered *map_tiered_create(MapKeyCompareFunc compare_func, const MapCodec *codec,
+                             MapFreeFunc free_key, MapFreeFunc free_value,
+                             unsigned long memory_budget, const char *directory) {
+    MapTiered *tiered;
+    Partition *partition;
+    unsigned long stamp = (unsigned long)time(NULL);
+    unsigned int i;
+
+    if (!codec || !codec->serialize_key || !codec->serialize_value ||
+        !codec->deserialize_key || !codec->deserialize_value || !directory) {
+        return NULL;
+    }
+
+    tiered = (MapTiered *)calloc(1, sizeof(MapTiered));
+    if (!tiered) {
+        return NULL;
+    }
+
+    tiered->hot = map_create(0, compare_func);
+    tiered->codec = *codec;
+    tiered->free_key = free_key;
+    tiered->free_value = free_value;
+    tiered->budget = memory_budget;
+
+    for (i = 0; tiered->hot && i < MAP_TIERED_PARTITIONS; ++i) {
+        partition = &tiered->partitions[i];
+        partition->path = (char *)malloc(strlen(directory) + 64);
+        if (!partition->path) {
+            break;
+        }
+
+        sprintf(partition->path, "%s/cmap-%lx-%p-%02u.spill", directory, stamp, (void *)tiered, i);
+        partition->file = fopen(partition->path, "w+b");
+        if (!partition->file) {
+            break;
+        }
+    }
+
+    if (!tiered->hot || i < MAP_TIERED_PARTITIONS) {
+        map_tiered_free(tiered);
+        return NULL;
+    }
+
+    return tiered;
+}
+
+static void release_hot(void *key, void *value, void *context) {
+    (void)key;
+    release_entry((MapTiered *)context, (TieredValue *)value);
+}
+
+void map_tiered_free(MapTiered *tiered) {
+    Partition *partition;
+    unsigned int cursor = 0;
+    unsigned int i;
+
+    if (!tiered) {
+        return;
+    }
+
+    if (tiered->hot) {
+        do {
+            cursor = map_scan(tiered->hot, cursor, 1024, release_hot, tiered);
+        } while (cursor);
+        map_free(tiered->hot);
+    }
+
+    for (i = 0; i < MAP_TIERED_PARTITIONS; ++i) {
+        partition = &tiered->partitions[i];
+        if (partition->file) {
+            fclose(partition->file);
+        }
+        if (partition->path) {
+            remove(partition->path);
+        }
+        free(partition->path);
+        free(partition->slots);
+    }
+
+    free(tiered->key_bytes);
+    free(tiered->record);
+    free(tiered);
+}
+
+int map_tiered_set(MapTiered *tiered, void *key, void *value) {
+    TieredValue *entry;
+    unsigned long bytes;
+
+    if (!tiered) {
+        return -1;
+    }
+
+    entry = (TieredValue *)map_get(tiered->hot, key);
+    if (entry) {
+        if (entry_bytes(tiered, entry->key, value, &bytes) != 0) {
+            return -1;
+        }
+
+        if (tiered->free_key && key != entry->key) {
+            tiered->free_key(key);
+        }
+        if (entry->compressed || value != entry->value) {
+            release_value(tiered, entry);
+        }
+
+        tiered->hot_bytes = tiered->hot_bytes - entry->bytes + bytes;
+        entry->value = value;
+        entry->bytes = bytes;
+        entry->referenced = 1;
+
+        return make_room(tiered, 0);
+    }
+
+    if (!add_hot(tiered, key, value)) {
+        return -1;
+    }
+
+    /*
+     * A spilled copy would otherwise come back in place of the new value.
+     * It goes only once the new entry is in, so a failure loses nothing;
+     * until then the hot entry hides it.
+     */
+    unspill(tiered, key);
+
+    return 0;
+}
+
+void *map_tiered_get(MapTiered *tiered, const void *key) {
+    TieredValue *entry;
+    void *restored_key, *restored_value;
+
+    if (!tiered) {
+        return NULL;
+    }
+
+    entry = (TieredValue *)map_get(tiered->hot, key);
+    if (entry) {
+        if (entry->compressed && decompress_entry(tiered, entry) != 0) {
+            return NULL;
+        }
+
+        if (entry->accesses < (unsigned int)-1) {
+            entry->accesses++;
+        }
+        entry->referenced = 1;
+        return entry->value;
+    }
+
+    if (read_spilled(tiered, key, &restored_key, &restored_value) != 1) {
+        return NULL;
+    }
+
+    /* The record stays on disk until the entry is safely back in memory */
+    entry = add_hot(tiered, restored_key, restored_value);
+    if (!entry) {
+        if (tiered->free_key) {
+            tiered->free_key(restored_key);
+        }
+        if (tiered->free_value) {
+            tiered->free_value(restored_value);
+        }
+        return NULL;
+    }
+
+    unspill(tiered, entry->key);
+
+    return entry->value;
+}
+
+void map_tiered_delete(MapTiered *tiered, const void *key) {
+    TieredValue *entry;
+
+    if (!tiered) {
+        return;
+    }
+
+    entry = (TieredValue *)map_get(tiered->hot, key);
+    if (entry) {
+        map_delete(tiered->hot, key);
+        tiered->hot_bytes -= entry->bytes;
+        release_entry(tiered, entry);
+        return;
+    }
+
+    unspill(tiered, key);
+}
+
+int map_tiered_get_size(MapTiered *tiered) {
+    if (!tiered) {
+        return -1;
+    }
+
+    return map_get_size(tiered->hot) + (int)tiered->spilled;
+}
+
+int map_tiered_get_spilled_size(MapTiered *tiered) {
+    if (!tiered) {
+        return -1;
+    }
+
+    return (int)tiered->spilled;
+}
+
+int map_tiered_compress_cold(MapTiered *tiered, unsigned int threshold, unsigned int count) {
+    CompressPass pass;
+
+    if (!tiered) {
+        return -1;
+    }
+
+    pass.tiered = tiered;
+    pass.threshold = threshold;
+    pass.result = 0;
+
+    tiered->compress_hand = map_scan(tiered->hot, tiered->compress_hand, count, compress_if_cold, &pass);
+
+    return pass.result;
+}
+
+int map_tiered_get_compressed_size(MapTiered *tiered) {
+    if (!tiered) {
+        return -1;
+    }
+
+    return (int)tiered->compressed;
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "map.h"
+
+/*
+ * Checks the LZ codec shared by snapshots and tiered maps.
+ *
+ * Inputs of many sizes and kinds (zeros, random bytes, text, and random
+ * bytes broken up by long runs) must come back unchanged, and only decode
+ * to their exact original length. Compressed streams that are cut short,
+ * have bytes flipped, or are random garbage must be rejected or decode to
+ * something, but never read or write outside their buffers; build with
+ * -fsanitize=address to have that checked too. Output buffers are
+ * allocated to the exact length so any overrun lands outside them.
+ */
+
+enum { ZEROS, RANDOM, TEXT, RUNS, KIND_COUNT };
+
+static const char *kind_names[KIND_COUNT] = { "zeros", "random", "text", "runs" };
+
+static const unsigned int sizes[] = {
+  0, 1, 3, 4, 5, 15, 16, 17, 19, 255, 256, 270, 4096, 65535, 65536, 70000, 300000
+};
+
+static unsigned int seed = 12345u;
+
+static unsigned int next_random(void) {
+  seed = seed * 1103515245u + 12345u;
+  return seed >> 8;
+}
+
+static void fill(unsigned char *data, unsigned int length, int kind) {
+  static const char *words[] = { "map ", "key ", "value ", "entry ", "the ", "snapshot\n" };
+  unsigned int i = 0, n;
+  const char *word;
+
+  while (i < length) {
+    switch (kind) {
+    case ZEROS:
+      data[i++] = 0;
+      break;
+    case RANDOM:
+      data[i++] = (unsigned char)next_random();
+      break;
+    case TEXT:
+      for (word = words[next_random() % 6]; *word && i < length; ++word) {
+        data[i++] = (unsigned char)*word;
+      }
+      break;
+    default:
+      n = next_random() % 600;
+      if (next_random() % 2) {
+        memset(data + i, (int)(next_random() & 0xff), n < length - i ? n : length - i);
+        i += n < length - i ? n : length - i;
+      }
+      else {
+        data[i++] = (unsigned char)next_random();
+      }
+    }
+  }
+}
+
+/*
+ * Decompresses into a buffer of exactly length bytes, so that the result
+ * is only trusted when the codec stayed within it.
+ */
+static int decompress(const unsigned char *src, unsigned int src_length,
+                      unsigned int length, const unsigned char *expect) {
+  unsigned char *out = (unsigned char *)malloc(length ? length : 1);
+  int result;
+
+  if (!out) {
+    return -2;
+  }
+
+  result = map_lz_decompress(src, src_length, out, length);
+  if (result == 0 && expect && memcmp(out, expect, length) != 0) {
+    result = -2;
+  }
+
+  free(out);
+  return result;
+}
+
+static unsigned int check_malformed(unsigned char *packed, unsigned int packed_length,
+                                    const unsigned char *data, unsigned int length) {
+  unsigned char *broken = (unsigned char *)malloc(packed_length ? packed_length : 1);
+  unsigned int errors = 0, cut, i, step;
+  int result;
+
+  if (!broken) {
+    return 1;
+  }
+
+  /* A truncated stream may only be accepted if it still decodes exactly */
+  step = packed_length > 2048 ? packed_length / 2048 : 1;
+  for (cut = 0; cut < packed_length; cut += step) {
+    if (decompress(packed, cut, length, data) == -2) {
+      errors++;
+    }
+  }
+
+  /* Flipped bytes may decode to anything, as long as they stay in bounds */
+  for (i = 0; i < 256 && packed_length; ++i) {
+    memcpy(broken, packed, packed_length);
+    broken[next_random() % packed_length] ^= (unsigned char)(1 + next_random() % 255);
+    if (next_random() % 2) {
+      broken[next_random() % packed_length] = 0xff;
+    }
+
+    result = decompress(broken, packed_length, length, NULL);
+    if (result != 0 && result != -1) {
+      errors++;
+    }
+  }
+
+  free(broken);
+  return errors;
+}
+
+int main(void) {
+  unsigned char *data, *packed;
+  unsigned int errors = 0, bound, length, packed_length, i;
+  int kind, result;
+
+  for (kind = 0; kind < KIND_COUNT; ++kind) {
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+      length = sizes[i];
+      bound = length + length / 255 + 16;
+      data = (unsigned char *)malloc(length ? length : 1);
+      packed = (unsigned char *)malloc(bound);
+      if (!data || !packed) {
+        fprintf(stderr, "lz_roundtrip: out of memory\n");
+        return 1;
+      }
+
+      fill(data, length, kind);
+
+      packed_length = map_lz_compress(data, length, packed, bound);
+      if (packed_length == 0 || packed_length > bound ||
+          decompress(packed, packed_length, length, data) != 0) {
+        fprintf(stderr, "lz_roundtrip: %s, %u bytes: round trip failed\n", kind_names[kind], length);
+        errors++;
+      }
+      else {
+        /* The length is not in the stream, so a wrong one must not pass */
+        if (decompress(packed, packed_length, length + 1, NULL) != -1 ||
+            (length && decompress(packed, packed_length, length - 1, NULL) != -1)) {
+          fprintf(stderr, "lz_roundtrip: %s, %u bytes: wrong length accepted\n", kind_names[kind], length);
+          errors++;
+        }
+
+        errors += check_malformed(packed, packed_length, data, length);
+
+        /* Output that does not save the difference must be refused */
+        if (packed_length > length / 2 && length > 1 &&
+            map_lz_compress(data, length, packed, length / 2) != 0) {
+          fprintf(stderr, "lz_roundtrip: %s, %u bytes: overlong output accepted\n", kind_names[kind], length);
+          errors++;
+        }
+      }
+
+      free(data);
+      free(packed);
+    }
+  }
+
+  /* Random garbage up to 512 bytes long, against random output lengths */
+  packed = (unsigned char *)malloc(512);
+  for (i = 0; packed && i < 20000; ++i) {
+    packed_length = 1 + next_random() % 512;
+    fill(packed, packed_length, RANDOM);
+    result = decompress(packed, packed_length, next_random() % 4096, NULL);
+    if (result != 0 && result != -1) {
+      errors++;
+    }
+  }
+  free(packed);
+
+  if (errors) {
+    fprintf(stderr, "lz_roundtrip: %u errors\n", errors);
+    return 1;
+  }
+
+  printf("lz_roundtrip: ok\n");
+  return 0;
+}
@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "map.h"
+#include "map_skiplist.h"
+
+/*
+ * Hammers one skip list from several threads at once and checks that it
+ * ends up in the state the operations imply.
+ *
+ * Each writer owns the keys congruent to its index modulo the number of
+ * writers. Every round it inserts all of them and deletes the odd ones
+ * again, checking its own keys with `get` as it goes, so that at the end
+ * exactly its even keys must be present. All writers also fight over a
+ * small set of shared keys, whose values must always be one a writer
+ * stored. Meanwhile scanners walk key ranges with `map_skiplist_range` and
+ * check that keys arrive in increasing order and within the range.
+ */
+
+#define WRITERS       4
+#define SCANNERS      2
+#define OWNED_KEYS    4096
+#define SHARED_KEYS   64
+#define ROUNDS        50
+
+typedef struct Scan {
+  int          from;
+  int          to;
+  int          last;
+  int          seen;
+  unsigned int errors;
+} Scan;
+
+typedef struct Worker {
+  pthread_t    thread;
+  int          index;
+  unsigned int seed;
+  unsigned int errors;
+} Worker;
+
+static int keys[OWNED_KEYS + SHARED_KEYS];
+static int tokens[WRITERS];
+static Map *map;
+static int writing = 1;
+
+static unsigned int next_random(unsigned int *seed) {
+  *seed = *seed * 1103515245u + 12345u;
+  return *seed >> 8;
+}
+
+static int is_token(void *value) {
+  return value >= (void *)tokens && value < (void *)(tokens + WRITERS);
+}
+
+static void *write_keys(void *argument) {
+  Worker *worker = (Worker *)argument;
+  unsigned int round, i, k;
+  void *value;
+
+  for (round = 0; round < ROUNDS; ++round) {
+    for (i = worker->index; i < OWNED_KEYS; i += WRITERS) {
+      if (map->set(map, &keys[i], &keys[i]) != 0) {
+        worker->errors++;
+      }
+    }
+
+    for (i = worker->index + WRITERS; i < OWNED_KEYS; i += 2 * WRITERS) {
+      map->delete(map, &keys[i]);
+    }
+
+    for (i = worker->index; i < OWNED_KEYS; i += WRITERS) {
+      value = map->get(map, &keys[i]);
+      if ((i / WRITERS) % 2 == 0 ? value != &keys[i] : value != NULL) {
+        worker->errors++;
+      }
+    }
+
+    for (i = 0; i < 256; ++i) {
+      k = OWNED_KEYS + next_random(&worker->seed) % SHARED_KEYS;
+      switch (next_random(&worker->seed) % 3) {
+      case 0:
+        map->set(map, &keys[k], &tokens[worker->index]);
+        break;
+      case 1:
+        map->delete(map, &keys[k]);
+        break;
+      default:
+        value = map->get(map, &keys[k]);
+        if (value && !is_token(value)) {
+          worker->errors++;
+        }
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void check_entry(void *key, void *value, void *context) {
+  Scan *scan = (Scan *)context;
+  int k = *(int *)key;
+
+  if ((scan->seen && k <= scan->last) || k < scan->from || k >= scan->to ||
+      (value != key && !is_token(value))) {
+    scan->errors++;
+  }
+
+  scan->last = k;
+  scan->seen = 1;
+}
+
+static void *scan_keys(void *argument) {
+  Worker *worker = (Worker *)argument;
+  Scan scan;
+
+  while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE)) {
+    scan.from = (int)(next_random(&worker->seed) % (OWNED_KEYS + SHARED_KEYS));
+    scan.to = scan.from + 1 + (int)(next_random(&worker->seed) % 1024);
+    scan.seen = 0;
+    scan.errors = 0;
+
+    if (map_skiplist_range(map, &scan.from, &scan.to, check_entry, &scan) < 0) {
+      scan.errors++;
+    }
+    worker->errors += scan.errors;
+  }
+
+  return NULL;
+}
+
+int main(void) {
+  Worker writers[WRITERS], scanners[SCANNERS];
+  unsigned int errors = 0, i;
+  int expected = 0;
+  void *value;
+
+  for (i = 0; i < OWNED_KEYS + SHARED_KEYS; ++i) {
+    keys[i] = (int)i;
+  }
+
+  map = map_skiplist_create(map_compare_int_keys);
+  if (!map) {
+    fprintf(stderr, "skiplist_stress: could not create the map\n");
+    return 1;
+  }
+
+  for (i = 0; i < SCANNERS; ++i) {
+    scanners[i].index = (int)i;
+    scanners[i].seed = 7919u * (i + 1);
+    scanners[i].errors = 0;
+    pthread_create(&scanners[i].thread, NULL, scan_keys, &scanners[i]);
+  }
+
+  for (i = 0; i < WRITERS; ++i) {
+    writers[i].index = (int)i;
+    writers[i].seed = 104729u * (i + 1);
+    writers[i].errors = 0;
+    pthread_create(&writers[i].thread, NULL, write_keys, &writers[i]);
+  }
+
+  for (i = 0; i < WRITERS; ++i) {
+    pthread_join(writers[i].thread, NULL);
+    errors += writers[i].errors;
+  }
+
+  __atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+  for (i = 0; i < SCANNERS; ++i) {
+    pthread_join(scanners[i].thread, NULL);
+    errors += scanners[i].errors;
+  }
+
+  /* Every writer keeps its even keys, and the shared keys are counted */
+  for (i = 0; i < OWNED_KEYS + SHARED_KEYS; ++i) {
+    value = map->get(map, &keys[i]);
+    if (i < OWNED_KEYS && ((i / WRITERS) % 2 == 0 ? value != &keys[i] : value != NULL)) {
+      errors++;
+    }
+    if (value) {
+      expected++;
+    }
+  }
+
+  if (map->getSize(map) != expected) {
+    errors++;
+  }
+
+  map_skiplist_free(map);
+
+  if (errors) {
+    fprintf(stderr, "skiplist_stress: %u errors\n", errors);
+    return 1;
+  }
+
+  printf("skiplist_stress: ok\n");
+  return 0;
+}